@@ -1773,6 +1773,49 @@ static void blk_account_io_completion(struct request *req, unsigned int bytes)
 	}
 }
 
+#ifdef CONFIG_BLK_DEV_LATENCY_HIST
+static inline int blk_lat_hist_bucket(u64 ns)
+{
+	u64 us = div_u64(ns, NSEC_PER_USEC);
+
+	if (!us)
+		return 0;
+	return min_t(int, fls64(us) - 1, DISK_LAT_HIST_BUCKETS - 1);
+}
+
+/*
+ * Split the completion latency of @req into the part spent waiting in
+ * the queue and the part spent in the driver and record both in the
+ * per-device histogram.  Requests completed without ever being
+ * dequeued (io_start_time_ns unset) are not counted.
+ */
+static void blk_account_io_latency(int cpu, struct request *req,
+				   struct hd_struct *part, const int rw)
+{
+	struct gendisk *disk = req->rq_disk ? req->rq_disk : part_to_disk(part);
+	u64 now, start, io_start;
+	struct disk_lat_hist *hist;
+
+	io_start = rq_io_start_time_ns(req);
+	if (!disk || !disk->lat_hist || !io_start)
+		return;
+
+	now = sched_clock();
+	start = rq_start_time_ns(req);
+	hist = per_cpu_ptr(disk->lat_hist, cpu);
+
+	hist->queue[rw][blk_lat_hist_bucket(io_start > start ?
+					    io_start - start : 0)]++;
+	hist->service[rw][blk_lat_hist_bucket(now > io_start ?
+					      now - io_start : 0)]++;
+}
+#else
+static inline void blk_account_io_latency(int cpu, struct request *req,
+					  struct hd_struct *part, const int rw)
+{
+}
+#endif
+
 static void blk_account_io_done(struct request *req)
 {
 	/*
@@ -1793,6 +1836,7 @@ static void blk_account_io_done(struct request *req)
 		part_stat_add(cpu, part, ticks[rw], duration);
 		part_round_stats(cpu, part);
 		part_dec_in_flight(part, rw);
+		blk_account_io_latency(cpu, req, part, rw);
 
 		hd_struct_put(part);
 		part_stat_unlock();
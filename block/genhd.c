@@ -977,6 +977,51 @@ static ssize_t disk_discard_alignment_show(struct device *dev,
 	return sprintf(buf, "%d\n", queue_discard_alignment(disk->queue));
 }
 
+#ifdef CONFIG_BLK_DEV_LATENCY_HIST
+static ssize_t disk_latency_hist_show(struct device *dev,
+				      struct device_attribute *attr, char *buf)
+{
+	struct gendisk *disk = dev_to_disk(dev);
+	struct disk_lat_hist sum;
+	ssize_t len;
+	int cpu, rw, i;
+
+	memset(&sum, 0, sizeof(sum));
+	for_each_possible_cpu(cpu) {
+		struct disk_lat_hist *h = per_cpu_ptr(disk->lat_hist, cpu);
+
+		for (rw = 0; rw < 2; rw++)
+			for (i = 0; i < DISK_LAT_HIST_BUCKETS; i++) {
+				sum.queue[rw][i] += h->queue[rw][i];
+				sum.service[rw][i] += h->service[rw][i];
+			}
+	}
+
+	len = sprintf(buf, "%-10s %10s %10s %10s %10s\n", "usecs",
+		      "rd_queue", "rd_service", "wr_queue", "wr_service");
+	/* each row is labelled with the lower bound of its bucket */
+	for (i = 0; i < DISK_LAT_HIST_BUCKETS; i++)
+		len += sprintf(buf + len, "%-10lu %10lu %10lu %10lu %10lu\n",
+			       i ? 1UL << i : 0UL,
+			       sum.queue[READ][i], sum.service[READ][i],
+			       sum.queue[WRITE][i], sum.service[WRITE][i]);
+	return len;
+}
+
+static ssize_t disk_latency_hist_store(struct device *dev,
+				       struct device_attribute *attr,
+				       const char *buf, size_t count)
+{
+	struct gendisk *disk = dev_to_disk(dev);
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(disk->lat_hist, cpu), 0,
+		       sizeof(struct disk_lat_hist));
+	return count;
+}
+#endif
+
 static DEVICE_ATTR(range, S_IRUGO, disk_range_show, NULL);
 static DEVICE_ATTR(ext_range, S_IRUGO, disk_ext_range_show, NULL);
 static DEVICE_ATTR(removable, S_IRUGO, disk_removable_show, NULL);
@@ -988,6 +1033,10 @@ static DEVICE_ATTR(discard_alignment, S_IRUGO, disk_discard_alignment_show,
 static DEVICE_ATTR(capability, S_IRUGO, disk_capability_show, NULL);
 static DEVICE_ATTR(stat, S_IRUGO, part_stat_show, NULL);
 static DEVICE_ATTR(inflight, S_IRUGO, part_inflight_show, NULL);
+#ifdef CONFIG_BLK_DEV_LATENCY_HIST
+static DEVICE_ATTR(latency_hist, S_IRUGO|S_IWUSR, disk_latency_hist_show,
+		   disk_latency_hist_store);
+#endif
 #ifdef CONFIG_FAIL_MAKE_REQUEST
 static struct device_attribute dev_attr_fail =
 	__ATTR(make-it-fail, S_IRUGO|S_IWUSR, part_fail_show, part_fail_store);
@@ -1009,6 +1058,9 @@ static struct attribute *disk_attrs[] = {
 	&dev_attr_capability.attr,
 	&dev_attr_stat.attr,
 	&dev_attr_inflight.attr,
+#ifdef CONFIG_BLK_DEV_LATENCY_HIST
+	&dev_attr_latency_hist.attr,
+#endif
 #ifdef CONFIG_FAIL_MAKE_REQUEST
 	&dev_attr_fail.attr,
 #endif
@@ -1112,6 +1164,9 @@ static void disk_release(struct device *dev)
 	disk_replace_part_tbl(disk, NULL);
 	free_part_stats(&disk->part0);
 	free_part_info(&disk->part0);
+#ifdef CONFIG_BLK_DEV_LATENCY_HIST
+	free_percpu(disk->lat_hist);
+#endif
 	if (disk->queue)
 		blk_put_queue(disk->queue);
 	kfree(disk);
@@ -1284,8 +1339,19 @@ struct gendisk *alloc_disk_node(int minors, int node_id)
 			kfree(disk);
 			return NULL;
 		}
+#ifdef CONFIG_BLK_DEV_LATENCY_HIST
+		disk->lat_hist = alloc_percpu(struct disk_lat_hist);
+		if (!disk->lat_hist) {
+			free_part_stats(&disk->part0);
+			kfree(disk);
+			return NULL;
+		}
+#endif
 		disk->node_id = node_id;
 		if (disk_expand_part_tbl(disk, 0)) {
+#ifdef CONFIG_BLK_DEV_LATENCY_HIST
+			free_percpu(disk->lat_hist);
+#endif
 			free_part_stats(&disk->part0);
 			kfree(disk);
 			return NULL;
@@ -12,6 +12,15 @@
  * Asynchronous and synchronous requests are not treated separately, but
  * we relay on deadlines to ensure fairness.
  *
+ * In flash mode, reads are served by ioprio class (RT before BE, idle
+ * class after writes) and writes get a turn every writes_starved reads.
+ * Asynchronous writes are dispatched in batches that fall inside one
+ * write_unit_kb aligned unit, in sector order, so the device sees whole
+ * erase/program units instead of interleaved fragments.
+ *
+ * Per-class dispatch counts and add-to-completion latencies are shown in
+ * class_stats; flash-mode write batching in write_batches.
+ *
  */
 #include <linux/blkdev.h>
 #include <linux/elevator.h>
@@ -20,9 +29,15 @@
 #include <linux/init.h>
 #include <linux/version.h>
 #include <linux/slab.h>
+#include <linux/ioprio.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
 
 enum { ASYNC, SYNC };
 
+/* ioprio classes, in dispatch priority order */
+enum { SIO_RT, SIO_BE, SIO_IDLE, SIO_NR_CLASSES };
+
 /* Tunables */
 static const int sync_read_expire  = HZ / 2;	/* max time before a sync read is submitted. */
 static const int sync_write_expire = 2 * HZ;	/* max time before a sync write is submitted. */
@@ -34,10 +49,20 @@ static const int writes_starved = 2;		/* max times reads can starve a write */
 static const int fifo_batch     = 1;		/* # of sequential requests treated as one
 						   by the above parameters. For throughput. */
 
+static const int flash_mode     = 0;		/* ioprio-aware reads, batched writes */
+static const int write_unit_kb  = 512;		/* async write batch unit (erase group) */
+
+struct sio_class_stats {
+	unsigned long dispatched[2];		/* per data direction */
+	unsigned long completed;
+	u64 total_latency;			/* msecs, add to completion */
+	unsigned int max_latency;		/* msecs */
+};
+
 /* Elevator data */
 struct sio_data {
-	/* Request queues */
-	struct list_head fifo_list[2][2];
+	/* Request queues, per ioprio class */
+	struct list_head fifo_list[2][2][SIO_NR_CLASSES];
 
 	/* Attributes */
 	unsigned int batched;
@@ -47,8 +72,62 @@ struct sio_data {
 	int fifo_expire[2][2];
 	int fifo_batch;
 	int writes_starved;
+	int flash_mode;
+	int write_unit_kb;
+
+	/* Statistics */
+	struct sio_class_stats stats[SIO_NR_CLASSES];
+	unsigned long write_batches;
+	unsigned long write_batched;
 };
 
+/*
+ * The class is picked when the request is allocated, in the submitting
+ * task's context, and kept in elevator_private[0] (offset by one so that
+ * requests that bypassed sio_set_request count as best-effort).
+ */
+static inline int
+sio_rq_class(struct request *rq)
+{
+	unsigned long class = (unsigned long) rq->elevator_private[0];
+
+	return class ? class - 1 : SIO_BE;
+}
+
+static inline void
+sio_set_rq_class(struct request *rq, int class)
+{
+	rq->elevator_private[0] = (void *) (unsigned long) (class + 1);
+}
+
+static int
+sio_ioprio_to_class(int ioprio_class)
+{
+	switch (ioprio_class) {
+	case IOPRIO_CLASS_RT:
+		return SIO_RT;
+	case IOPRIO_CLASS_IDLE:
+		return SIO_IDLE;
+	default:
+		return SIO_BE;
+	}
+}
+
+static int
+sio_set_request(struct request_queue *q, struct request *rq, gfp_t gfp_mask)
+{
+	struct io_context *ioc = current->io_context;
+	int ioprio_class;
+
+	if (ioc && ioprio_valid(ioc->ioprio))
+		ioprio_class = IOPRIO_PRIO_CLASS(ioc->ioprio);
+	else
+		ioprio_class = task_nice_ioclass(current);
+
+	sio_set_rq_class(rq, sio_ioprio_to_class(ioprio_class));
+	return 0;
+}
+
 static void
 sio_merged_requests(struct request_queue *q, struct request *rq,
 		    struct request *next)
@@ -61,6 +140,7 @@ sio_merged_requests(struct request_queue *q, struct request *rq,
 		if (time_before(rq_fifo_time(next), rq_fifo_time(rq))) {
 			list_move(&rq->queuelist, &next->queuelist);
 			rq_set_fifo_time(rq, rq_fifo_time(next));
+			sio_set_rq_class(rq, sio_rq_class(next));
 		}
 	}
 
@@ -74,13 +154,74 @@ sio_add_request(struct request_queue *q, struct request *rq)
 	struct sio_data *sd = q->elevator->elevator_data;
 	const int sync = rq_is_sync(rq);
 	const int data_dir = rq_data_dir(rq);
+	int class = sio_rq_class(rq);
+
+	/* An explicit per-request priority overrides the task's */
+	if (ioprio_valid(rq->ioprio)) {
+		class = sio_ioprio_to_class(IOPRIO_PRIO_CLASS(rq->ioprio));
+		sio_set_rq_class(rq, class);
+	}
 
 	/*
 	 * Add request to the proper fifo list and set its
 	 * expire time.
 	 */
 	rq_set_fifo_time(rq, jiffies + sd->fifo_expire[sync][data_dir]);
-	list_add_tail(&rq->queuelist, &sd->fifo_list[sync][data_dir]);
+	list_add_tail(&rq->queuelist, &sd->fifo_list[sync][data_dir][class]);
+}
+
+static void
+sio_completed_request(struct request_queue *q, struct request *rq)
+{
+	struct sio_data *sd = q->elevator->elevator_data;
+	struct sio_class_stats *st = &sd->stats[sio_rq_class(rq)];
+	unsigned int lat = jiffies_to_msecs(jiffies - rq->start_time);
+
+	st->completed++;
+	st->total_latency += lat;
+	if (lat > st->max_latency)
+		st->max_latency = lat;
+}
+
+static inline struct request *
+sio_class_head(struct sio_data *sd, int sync, int data_dir, int class)
+{
+	struct list_head *list = &sd->fifo_list[sync][data_dir][class];
+
+	return list_empty(list) ? NULL : rq_entry_fifo(list->next);
+}
+
+/* Oldest request of any class */
+static struct request *
+sio_fifo_head(struct sio_data *sd, int sync, int data_dir)
+{
+	struct request *rq, *oldest = NULL;
+	int class;
+
+	for (class = 0; class < SIO_NR_CLASSES; class++) {
+		rq = sio_class_head(sd, sync, data_dir, class);
+		if (rq && (!oldest ||
+			   time_before(rq_fifo_time(rq), rq_fifo_time(oldest))))
+			oldest = rq;
+	}
+
+	return oldest;
+}
+
+/* First request in ioprio class order, up to and including @max_class */
+static struct request *
+sio_prio_head(struct sio_data *sd, int sync, int data_dir, int max_class)
+{
+	struct request *rq;
+	int class;
+
+	for (class = 0; class <= max_class; class++) {
+		rq = sio_class_head(sd, sync, data_dir, class);
+		if (rq)
+			return rq;
+	}
+
+	return NULL;
 }
 
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,38)
@@ -90,22 +231,20 @@ sio_queue_empty(struct request_queue *q)
 	struct sio_data *sd = q->elevator->elevator_data;
 
 	/* Check if fifo lists are empty */
-	return list_empty(&sd->fifo_list[SYNC][READ]) && list_empty(&sd->fifo_list[SYNC][WRITE]) &&
-	       list_empty(&sd->fifo_list[ASYNC][READ]) && list_empty(&sd->fifo_list[ASYNC][WRITE]);
+	return !sio_fifo_head(sd, SYNC, READ) && !sio_fifo_head(sd, SYNC, WRITE) &&
+	       !sio_fifo_head(sd, ASYNC, READ) && !sio_fifo_head(sd, ASYNC, WRITE);
 }
 #endif
 
 static struct request *
 sio_expired_request(struct sio_data *sd, int sync, int data_dir)
 {
-	struct list_head *list = &sd->fifo_list[sync][data_dir];
 	struct request *rq;
 
-	if (list_empty(list))
-		return NULL;
-
 	/* Retrieve request */
-	rq = rq_entry_fifo(list->next);
+	rq = sio_fifo_head(sd, sync, data_dir);
+	if (!rq)
+		return NULL;
 
 	/* Request has expired */
 	if (time_after(jiffies, rq_fifo_time(rq)))
@@ -144,30 +283,75 @@ sio_choose_expired_request(struct sio_data *sd)
 static struct request *
 sio_choose_request(struct sio_data *sd, int data_dir)
 {
-	struct list_head *sync = sd->fifo_list[SYNC];
-	struct list_head *async = sd->fifo_list[ASYNC];
+	struct request *rq;
 
 	/*
 	 * Retrieve request from available fifo list.
 	 * Synchronous requests have priority over asynchronous.
 	 * Read requests have priority over write.
 	 */
-	if (!list_empty(&sync[data_dir]))
-		return rq_entry_fifo(sync[data_dir].next);
-	if (!list_empty(&async[data_dir]))
-		return rq_entry_fifo(async[data_dir].next);
+	rq = sio_fifo_head(sd, SYNC, data_dir);
+	if (rq)
+		return rq;
+	rq = sio_fifo_head(sd, ASYNC, data_dir);
+	if (rq)
+		return rq;
 
-	if (!list_empty(&sync[!data_dir]))
-		return rq_entry_fifo(sync[!data_dir].next);
-	if (!list_empty(&async[!data_dir]))
-		return rq_entry_fifo(async[!data_dir].next);
+	rq = sio_fifo_head(sd, SYNC, !data_dir);
+	if (rq)
+		return rq;
+	rq = sio_fifo_head(sd, ASYNC, !data_dir);
+	if (rq)
+		return rq;
 
 	return NULL;
 }
 
+static struct request *
+sio_flash_choose_request(struct sio_data *sd)
+{
+	struct request *rq;
+	int class;
+
+	/* Writes get a turn once reads have starved them long enough */
+	if (sd->starved > sd->writes_starved) {
+		rq = sio_prio_head(sd, SYNC, WRITE, SIO_IDLE);
+		if (rq)
+			return rq;
+		rq = sio_prio_head(sd, ASYNC, WRITE, SIO_IDLE);
+		if (rq)
+			return rq;
+	}
+
+	/* Reads by ioprio class, synchronous first within a class */
+	for (class = SIO_RT; class < SIO_IDLE; class++) {
+		rq = sio_class_head(sd, SYNC, READ, class);
+		if (rq)
+			return rq;
+		rq = sio_class_head(sd, ASYNC, READ, class);
+		if (rq)
+			return rq;
+	}
+
+	rq = sio_prio_head(sd, SYNC, WRITE, SIO_IDLE);
+	if (rq)
+		return rq;
+	rq = sio_prio_head(sd, ASYNC, WRITE, SIO_IDLE);
+	if (rq)
+		return rq;
+
+	/* Idle class reads only when nothing else is queued */
+	rq = sio_class_head(sd, SYNC, READ, SIO_IDLE);
+	if (rq)
+		return rq;
+	return sio_class_head(sd, ASYNC, READ, SIO_IDLE);
+}
+
 static inline void
 sio_dispatch_request(struct sio_data *sd, struct request *rq)
 {
+	const int data_dir = rq_data_dir(rq);
+
 	/*
 	 * Remove the request from the fifo list
 	 * and dispatch it.
@@ -176,13 +360,68 @@ sio_dispatch_request(struct sio_data *sd, struct request *rq)
 	elv_dispatch_add_tail(rq->q, rq);
 
 	sd->batched++;
+	sd->stats[sio_rq_class(rq)].dispatched[data_dir]++;
 
-	if (rq_data_dir(rq))
+	if (data_dir)
 		sd->starved = 0;
 	else
 		sd->starved++;
 }
 
+/*
+ * Dispatch @rq together with every other queued asynchronous write that
+ * starts in the same write unit, in ascending sector order, stopping once
+ * a unit's worth of sectors has been gathered.
+ */
+static int
+sio_dispatch_write_batch(struct sio_data *sd, struct request *rq)
+{
+	const sector_t unit = (sector_t) sd->write_unit_kb << 1;
+	struct request *pos, *tmp, *it;
+	sector_t start, end, total;
+	LIST_HEAD(batch);
+	int class, count = 0;
+
+	if (!unit) {
+		sio_dispatch_request(sd, rq);
+		return 1;
+	}
+
+	start = blk_rq_pos(rq) & ~(unit - 1);
+	end = start + unit;
+	total = blk_rq_sectors(rq);
+	list_move(&rq->queuelist, &batch);
+
+	for (class = 0; class < SIO_NR_CLASSES; class++) {
+		list_for_each_entry_safe(pos, tmp,
+				&sd->fifo_list[ASYNC][WRITE][class], queuelist) {
+			if (blk_rq_pos(pos) < start || blk_rq_pos(pos) >= end)
+				continue;
+			if (total + blk_rq_sectors(pos) > unit)
+				continue;
+			total += blk_rq_sectors(pos);
+
+			/* Keep the batch sorted by sector */
+			list_for_each_entry(it, &batch, queuelist)
+				if (blk_rq_pos(it) > blk_rq_pos(pos))
+					break;
+			list_move_tail(&pos->queuelist, &it->queuelist);
+		}
+	}
+
+	list_for_each_entry_safe(pos, tmp, &batch, queuelist) {
+		sio_dispatch_request(sd, pos);
+		count++;
+	}
+
+	if (count > 1) {
+		sd->write_batches++;
+		sd->write_batched += count;
+	}
+
+	return count;
+}
+
 static int
 sio_dispatch_requests(struct request_queue *q, int force)
 {
@@ -201,15 +440,22 @@ sio_dispatch_requests(struct request_queue *q, int force)
 
 	/* Retrieve request */
 	if (!rq) {
-		if (sd->starved > sd->writes_starved)
-			data_dir = WRITE;
+		if (sd->flash_mode) {
+			rq = sio_flash_choose_request(sd);
+		} else {
+			if (sd->starved > sd->writes_starved)
+				data_dir = WRITE;
 
-		rq = sio_choose_request(sd, data_dir);
+			rq = sio_choose_request(sd, data_dir);
+		}
 		if (!rq)
 			return 0;
 	}
 
 	/* Dispatch request */
+	if (sd->flash_mode && rq_data_dir(rq) == WRITE && !rq_is_sync(rq))
+		return sio_dispatch_write_batch(sd, rq);
+
 	sio_dispatch_request(sd, rq);
 
 	return 1;
@@ -222,7 +468,7 @@ sio_former_request(struct request_queue *q, struct request *rq)
 	const int sync = rq_is_sync(rq);
 	const int data_dir = rq_data_dir(rq);
 
-	if (rq->queuelist.prev == &sd->fifo_list[sync][data_dir])
+	if (rq->queuelist.prev == &sd->fifo_list[sync][data_dir][sio_rq_class(rq)])
 		return NULL;
 
 	/* Return former request */
@@ -236,7 +482,7 @@ sio_latter_request(struct request_queue *q, struct request *rq)
 	const int sync = rq_is_sync(rq);
 	const int data_dir = rq_data_dir(rq);
 
-	if (rq->queuelist.next == &sd->fifo_list[sync][data_dir])
+	if (rq->queuelist.next == &sd->fifo_list[sync][data_dir][sio_rq_class(rq)])
 		return NULL;
 
 	/* Return latter request */
@@ -247,17 +493,20 @@ static void *
 sio_init_queue(struct request_queue *q)
 {
 	struct sio_data *sd;
+	int class;
 
 	/* Allocate structure */
-	sd = kmalloc_node(sizeof(*sd), GFP_KERNEL, q->node);
+	sd = kmalloc_node(sizeof(*sd), GFP_KERNEL | __GFP_ZERO, q->node);
 	if (!sd)
 		return NULL;
 
 	/* Initialize fifo lists */
-	INIT_LIST_HEAD(&sd->fifo_list[SYNC][READ]);
-	INIT_LIST_HEAD(&sd->fifo_list[SYNC][WRITE]);
-	INIT_LIST_HEAD(&sd->fifo_list[ASYNC][READ]);
-	INIT_LIST_HEAD(&sd->fifo_list[ASYNC][WRITE]);
+	for (class = 0; class < SIO_NR_CLASSES; class++) {
+		INIT_LIST_HEAD(&sd->fifo_list[SYNC][READ][class]);
+		INIT_LIST_HEAD(&sd->fifo_list[SYNC][WRITE][class]);
+		INIT_LIST_HEAD(&sd->fifo_list[ASYNC][READ][class]);
+		INIT_LIST_HEAD(&sd->fifo_list[ASYNC][WRITE][class]);
+	}
 
 	/* Initialize data */
 	sd->batched = 0;
@@ -266,6 +515,9 @@ sio_init_queue(struct request_queue *q)
 	sd->fifo_expire[ASYNC][READ] = async_read_expire;
 	sd->fifo_expire[ASYNC][WRITE] = async_write_expire;
 	sd->fifo_batch = fifo_batch;
+	sd->writes_starved = writes_starved;
+	sd->flash_mode = flash_mode;
+	sd->write_unit_kb = write_unit_kb;
 
 	return sd;
 }
@@ -274,11 +526,14 @@ static void
 sio_exit_queue(struct elevator_queue *e)
 {
 	struct sio_data *sd = e->elevator_data;
+	int class;
 
-	BUG_ON(!list_empty(&sd->fifo_list[SYNC][READ]));
-	BUG_ON(!list_empty(&sd->fifo_list[SYNC][WRITE]));
-	BUG_ON(!list_empty(&sd->fifo_list[ASYNC][READ]));
-	BUG_ON(!list_empty(&sd->fifo_list[ASYNC][WRITE]));
+	for (class = 0; class < SIO_NR_CLASSES; class++) {
+		BUG_ON(!list_empty(&sd->fifo_list[SYNC][READ][class]));
+		BUG_ON(!list_empty(&sd->fifo_list[SYNC][WRITE][class]));
+		BUG_ON(!list_empty(&sd->fifo_list[ASYNC][READ][class]));
+		BUG_ON(!list_empty(&sd->fifo_list[ASYNC][WRITE][class]));
+	}
 
 	/* Free structure */
 	kfree(sd);
@@ -318,6 +573,8 @@ SHOW_FUNCTION(sio_async_read_expire_show, sd->fifo_expire[ASYNC][READ], 1);
 SHOW_FUNCTION(sio_async_write_expire_show, sd->fifo_expire[ASYNC][WRITE], 1);
 SHOW_FUNCTION(sio_fifo_batch_show, sd->fifo_batch, 0);
 SHOW_FUNCTION(sio_writes_starved_show, sd->writes_starved, 0);
+SHOW_FUNCTION(sio_flash_mode_show, sd->flash_mode, 0);
+SHOW_FUNCTION(sio_write_unit_kb_show, sd->write_unit_kb, 0);
 #undef SHOW_FUNCTION
 
 #define STORE_FUNCTION(__FUNC, __PTR, MIN, MAX, __CONV)			\
@@ -342,8 +599,56 @@ STORE_FUNCTION(sio_async_read_expire_store, &sd->fifo_expire[ASYNC][READ], 0, IN
 STORE_FUNCTION(sio_async_write_expire_store, &sd->fifo_expire[ASYNC][WRITE], 0, INT_MAX, 1);
 STORE_FUNCTION(sio_fifo_batch_store, &sd->fifo_batch, 0, INT_MAX, 0);
 STORE_FUNCTION(sio_writes_starved_store, &sd->writes_starved, 0, INT_MAX, 0);
+STORE_FUNCTION(sio_flash_mode_store, &sd->flash_mode, 0, 1, 0);
 #undef STORE_FUNCTION
 
+/* Batches are unit aligned by masking, so round down to a power of two */
+static ssize_t
+sio_write_unit_kb_store(struct elevator_queue *e, const char *page, size_t count)
+{
+	struct sio_data *sd = e->elevator_data;
+	int data;
+	int ret = sio_var_store(&data, page, count);
+
+	if (data <= 0)
+		data = 0;
+	else
+		data = rounddown_pow_of_two(min(data, 1 << 20));
+	sd->write_unit_kb = data;
+	return ret;
+}
+
+static ssize_t
+sio_class_stats_show(struct elevator_queue *e, char *page)
+{
+	static const char * const names[SIO_NR_CLASSES] = { "rt", "be", "idle" };
+	struct sio_data *sd = e->elevator_data;
+	struct sio_class_stats *st;
+	ssize_t len = 0;
+	int class;
+
+	for (class = 0; class < SIO_NR_CLASSES; class++) {
+		st = &sd->stats[class];
+		len += sprintf(page + len,
+			"%s: reads %lu writes %lu completed %lu "
+			"avg_lat_ms %llu max_lat_ms %u\n", names[class],
+			st->dispatched[READ], st->dispatched[WRITE],
+			st->completed, st->completed ?
+			div64_u64(st->total_latency, st->completed) : 0ULL,
+			st->max_latency);
+	}
+
+	return len;
+}
+
+static ssize_t
+sio_write_batches_show(struct elevator_queue *e, char *page)
+{
+	struct sio_data *sd = e->elevator_data;
+
+	return sprintf(page, "%lu %lu\n", sd->write_batches, sd->write_batched);
+}
+
 #define DD_ATTR(name) \
 	__ATTR(name, S_IRUGO|S_IWUSR, sio_##name##_show, \
 				      sio_##name##_store)
@@ -355,6 +660,10 @@ static struct elv_fs_entry sio_attrs[] = {
 	DD_ATTR(async_write_expire),
 	DD_ATTR(fifo_batch),
 	DD_ATTR(writes_starved),
+	DD_ATTR(flash_mode),
+	DD_ATTR(write_unit_kb),
+	__ATTR(class_stats, S_IRUGO, sio_class_stats_show, NULL),
+	__ATTR(write_batches, S_IRUGO, sio_write_batches_show, NULL),
 	__ATTR_NULL
 };
 
@@ -363,11 +672,13 @@ static struct elevator_type iosched_sio = {
 		.elevator_merge_req_fn		= sio_merged_requests,
 		.elevator_dispatch_fn		= sio_dispatch_requests,
 		.elevator_add_req_fn		= sio_add_request,
+		.elevator_completed_req_fn	= sio_completed_request,
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,38)
 		.elevator_queue_empty_fn	= sio_queue_empty,
 #endif
 		.elevator_former_req_fn		= sio_former_request,
 		.elevator_latter_req_fn		= sio_latter_request,
+		.elevator_set_req_fn		= sio_set_request,
 		.elevator_init_fn		= sio_init_queue,
 		.elevator_exit_fn		= sio_exit_queue,
 	},
@@ -397,4 +708,4 @@ module_exit(sio_exit);
 MODULE_AUTHOR("Miguel Boton");
 MODULE_LICENSE("GPL");
 MODULE_DESCRIPTION("Simple IO scheduler");
-MODULE_VERSION("0.2");
+MODULE_VERSION("0.3");
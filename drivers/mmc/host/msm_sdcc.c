@@ -4831,6 +4831,11 @@ msmsdcc_probe(struct platform_device *pdev)
 	if (!plat->disable_cmd23 && host->sdcc_version)
 		mmc->caps |= MMC_CAP_CMD23;
 
+	/* packed commands are built on CMD23 */
+	mmc->caps2 |= MMC_CAP2_CACHE_CTRL;
+	if (mmc->caps & MMC_CAP_CMD23)
+		mmc->caps2 |= MMC_CAP2_PACKED_WR;
+
 	mmc->caps |= plat->uhs_caps;
 	/*
 	 * XPC controls the maximum current in the default speed mode of SDXC
@@ -20,6 +20,7 @@
 #include <linux/fdtable.h>
 #include <linux/file.h>
 #include <linux/fs.h>
+#include <linux/ktime.h>
 #include <linux/list.h>
 #include <linux/miscdevice.h>
 #include <linux/mm.h>
@@ -29,6 +30,7 @@
 #include <linux/poll.h>
 #include <linux/debugfs.h>
 #include <linux/rbtree.h>
+#include <linux/rwsem.h>
 #include <linux/sched.h>
 #include <linux/seq_file.h>
 #include <linux/slab.h>
@@ -37,18 +39,59 @@
 
 #include "binder.h"
 
-static DEFINE_MUTEX(binder_lock);
+/*
+ * Locking overview
+ *
+ * binder_main_lock is held for read by every ioctl and poll and for write
+ * while objects are torn down (deferred release and flush, thread exit,
+ * context manager registration) and by the debugfs dumps.  Procs, threads
+ * and dead nodes are only freed with it held for write, so a reader may
+ * follow pointers to them without taking a reference.
+ *
+ * Under the read lock, state is protected by per-process locks:
+ *
+ * proc->outer_lock:  refs_by_desc and refs_by_node, and the strong, weak
+ *                    and death fields of every ref in those trees.
+ * proc->alloc_lock:  the transaction buffer allocator (buffers,
+ *                    free_buffers, allocated_buffers, the size class
+ *                    lists, pages and free_async_space).
+ * proc->inner_lock:  the nodes tree and all fields of the nodes in it
+ *                    (including node->refs), proc->todo,
+ *                    proc->delivered_death, the threads tree, the todo
+ *                    list, looper state, return errors and transaction
+ *                    stack of each thread, the thread accounting
+ *                    counters of the proc and its latency histograms.
+ *
+ * Nodes whose proc has died are protected by binder_dead_nodes_lock
+ * instead of an inner lock; binder_node_lock() picks the right one.
+ *
+ * binder_lru_lock protects binder_lru, the list of unused but still
+ * mapped buffer pages of all procs.  It nests inside alloc_lock; the
+ * shrinker, which walks the list the other way round, only trylocks
+ * alloc_lock.
+ *
+ * Locks are taken in the order main -> outer -> alloc -> inner.  Two outer
+ * locks are only ever held together through binder_outer_lock_pair(), and
+ * two inner locks are never held at the same time.
+ */
+static DECLARE_RWSEM(binder_main_lock);
 static DEFINE_MUTEX(binder_deferred_lock);
+static DEFINE_MUTEX(binder_dead_nodes_lock);
+static DEFINE_SPINLOCK(binder_transaction_log_lock);
+static DEFINE_SPINLOCK(binder_lru_lock);
 
 static HLIST_HEAD(binder_procs);
 static HLIST_HEAD(binder_deferred_list);
 static HLIST_HEAD(binder_dead_nodes);
+static LIST_HEAD(binder_lru);
+static int binder_lru_pages;
+static atomic_t binder_lru_reclaimed;
 
 static struct dentry *binder_debugfs_dir_entry_root;
 static struct dentry *binder_debugfs_dir_entry_proc;
 static struct binder_node *binder_context_mgr_node;
 static uid_t binder_context_mgr_uid = -1;
-static int binder_last_id;
+static atomic_t binder_last_id;
 static struct workqueue_struct *binder_deferred_workqueue;
 
 #define BINDER_DEBUG_ENTRY(name) \
@@ -81,6 +124,34 @@ BINDER_DEBUG_ENTRY(proc);
 
 #define BINDER_SMALL_BUF_SIZE (PAGE_SIZE * 64)
 
+/*
+ * Transactions of up to BINDER_SIZE_CLASS_MAX bytes are rounded up to a
+ * power of two size class.  Freed buffers of exactly a class size are
+ * parked on a per-class list with their pages left mapped, so the next
+ * transaction of that class is served without searching free_buffers or
+ * touching the page tables.  Parked buffers may use at most
+ * 1/BINDER_SIZE_CLASS_SHARE of the mapping.
+ */
+#define BINDER_SIZE_CLASS_SHIFT             7
+#define BINDER_SIZE_CLASS_MIN               (1U << BINDER_SIZE_CLASS_SHIFT)
+#define BINDER_SIZE_CLASSES                 6
+#define BINDER_SIZE_CLASS_MAX \
+	(BINDER_SIZE_CLASS_MIN << (BINDER_SIZE_CLASSES - 1))
+#define BINDER_SIZE_CLASS_SHARE             16
+
+/* Number of buffer pages allocated and mapped with one map_vm_area() */
+#define BINDER_PAGE_BATCH                   16
+
+/*
+ * Latency of synchronous transactions, from BC_TRANSACTION until the
+ * matching BC_REPLY, is kept in log2 buckets of microseconds: bucket 0
+ * counts replies under 1us and bucket n replies of 2^(n-1) to 2^n us,
+ * with the last bucket open ended.  Histograms are kept for each target
+ * proc and for up to BINDER_LATENCY_MAX_CODES transaction codes in it.
+ */
+#define BINDER_LATENCY_BUCKETS              20
+#define BINDER_LATENCY_MAX_CODES            64
+
 enum {
 	BINDER_DEBUG_USER_ERROR             = 1U << 0,
 	BINDER_DEBUG_FAILED_TRANSACTION     = 1U << 1,
@@ -147,22 +218,59 @@ enum binder_stat_types {
 };
 
 struct binder_stats {
-	int br[_IOC_NR(BR_FAILED_REPLY) + 1];
-	int bc[_IOC_NR(BC_DEAD_BINDER_DONE) + 1];
-	int obj_created[BINDER_STAT_COUNT];
-	int obj_deleted[BINDER_STAT_COUNT];
+	atomic_t br[_IOC_NR(BR_FAILED_REPLY) + 1];
+	atomic_t bc[_IOC_NR(BC_REPLY_SG) + 1];
+	atomic_t obj_created[BINDER_STAT_COUNT];
+	atomic_t obj_deleted[BINDER_STAT_COUNT];
 };
 
 static struct binder_stats binder_stats;
 
 static inline void binder_stats_deleted(enum binder_stat_types type)
 {
-	binder_stats.obj_deleted[type]++;
+	atomic_inc(&binder_stats.obj_deleted[type]);
 }
 
 static inline void binder_stats_created(enum binder_stat_types type)
 {
-	binder_stats.obj_created[type]++;
+	atomic_inc(&binder_stats.obj_created[type]);
+}
+
+enum binder_lock_class {
+	BINDER_LOCK_MAIN,
+	BINDER_LOCK_OUTER,
+	BINDER_LOCK_ALLOC,
+	BINDER_LOCK_INNER,
+	BINDER_LOCK_DEAD_NODES,
+	BINDER_LOCK_COUNT
+};
+
+/* number of acquisitions that had to wait, per lock class */
+static atomic_t binder_lock_contended[BINDER_LOCK_COUNT];
+
+static void binder_mutex_lock(struct mutex *lock, unsigned int subclass,
+			      enum binder_lock_class class)
+{
+	if (mutex_trylock(lock))
+		return;
+	atomic_inc(&binder_lock_contended[class]);
+	mutex_lock_nested(lock, subclass);
+}
+
+static void binder_main_lock_read(void)
+{
+	if (down_read_trylock(&binder_main_lock))
+		return;
+	atomic_inc(&binder_lock_contended[BINDER_LOCK_MAIN]);
+	down_read(&binder_main_lock);
+}
+
+static void binder_main_lock_write(void)
+{
+	if (down_write_trylock(&binder_main_lock))
+		return;
+	atomic_inc(&binder_lock_contended[BINDER_LOCK_MAIN]);
+	down_write(&binder_main_lock);
 }
 
 struct binder_transaction_log_entry {
@@ -189,13 +297,16 @@ static struct binder_transaction_log_entry *binder_transaction_log_add(
 	struct binder_transaction_log *log)
 {
 	struct binder_transaction_log_entry *e;
+
+	spin_lock(&binder_transaction_log_lock);
 	e = &log->entry[log->next];
-	memset(e, 0, sizeof(*e));
 	log->next++;
 	if (log->next == ARRAY_SIZE(log->entry)) {
 		log->next = 0;
 		log->full = 1;
 	}
+	spin_unlock(&binder_transaction_log_lock);
+	memset(e, 0, sizeof(*e));
 	return e;
 }
 
@@ -223,6 +334,7 @@ struct binder_node {
 	int internal_strong_refs;
 	int local_weak_refs;
 	int local_strong_refs;
+	int tmp_refs; /* lookups in progress, see binder_get_node */
 	void __user *ptr;
 	void __user *cookie;
 	unsigned has_strong_ref:1;
@@ -259,21 +371,54 @@ struct binder_ref {
 
 struct binder_buffer {
 	struct list_head entry; /* free and allocated entries by addesss */
-	struct rb_node rb_node; /* free entry by size or allocated entry */
-				/* by address */
+	union {
+		struct rb_node rb_node; /* free entry by size or allocated */
+					/* entry by address */
+		struct list_head class_entry; /* parked entry by size class */
+	};
 	unsigned free:1;
-	unsigned allow_user_free:1;
 	unsigned async_transaction:1;
-	unsigned debug_id:29;
+	unsigned parked:1;
+	unsigned debug_id:28;
+	/*
+	 * Not a bitfield: set under proc->inner_lock by binder_thread_read()
+	 * while the bits above change under the alloc lock.
+	 */
+	bool allow_user_free;
 
 	struct binder_transaction *transaction;
 
 	struct binder_node *target_node;
 	size_t data_size;
 	size_t offsets_size;
+	size_t extra_buffers_size;
 	uint8_t data[0];
 };
 
+struct binder_latency_hist {
+	u32 count;
+	u64 total_ns;
+	u64 max_ns;
+	u32 bucket[BINDER_LATENCY_BUCKETS];
+};
+
+struct binder_code_latency {
+	struct rb_node rb_node;
+	uint32_t code;
+	struct binder_latency_hist hist;
+};
+
+struct binder_priority {
+	unsigned int sched_policy;
+	int prio;	/* nice value, or rt_priority for SCHED_FIFO/RR */
+};
+
+struct binder_lru_page {
+	struct list_head lru;	/* on binder_lru while mapped but unused */
+	struct page *page_ptr;
+	struct binder_proc *proc;
+};
+
 enum binder_deferred_state {
 	BINDER_DEFERRED_PUT_FILES    = 0x01,
 	BINDER_DEFERRED_FLUSH        = 0x02,
@@ -282,6 +427,9 @@ enum binder_deferred_state {
 
 struct binder_proc {
 	struct hlist_node proc_node;
+	struct mutex outer_lock;
+	struct mutex alloc_lock;
+	struct mutex inner_lock;
 	struct rb_root threads;
 	struct rb_root nodes;
 	struct rb_root refs_by_desc;
@@ -299,8 +447,10 @@ struct binder_proc {
 	struct rb_root free_buffers;
 	struct rb_root allocated_buffers;
 	size_t free_async_space;
+	struct list_head size_class[BINDER_SIZE_CLASSES];
+	size_t size_class_bytes;
 
-	struct page **pages;
+	struct binder_lru_page *pages;
 	size_t buffer_size;
 	uint32_t buffer_free;
 	struct list_head todo;
@@ -311,8 +461,10 @@ struct binder_proc {
 	int requested_threads;
 	int requested_threads_started;
 	int ready_threads;
-	long default_priority;
 	struct dentry *debugfs_entry;
+	struct binder_latency_hist latency;
+	struct rb_root code_latency;
+	int code_latency_count;
 };
 
 enum {
@@ -337,6 +489,8 @@ struct binder_thread {
 		/* we are also waiting on */
 	wait_queue_head_t wait;
 	struct binder_stats stats;
+	/* own priority, taken when the thread enters the looper */
+	struct binder_priority looper_priority;
 };
 
 struct binder_transaction {
@@ -353,14 +507,96 @@ struct binder_transaction {
 	struct binder_buffer *buffer;
 	unsigned int	code;
 	unsigned int	flags;
-	long	priority;
-	long	saved_priority;
+	struct binder_priority	priority;
+	struct binder_priority	saved_priority;
 	uid_t	sender_euid;
+	u64	start_ns;
 };
 
+#define CREATE_TRACE_POINTS
+#include "binder_trace.h"
+
 static void
 binder_defer_work(struct binder_proc *proc, enum binder_deferred_state defer);
 
+static inline void binder_outer_lock(struct binder_proc *proc)
+{
+	binder_mutex_lock(&proc->outer_lock, 0, BINDER_LOCK_OUTER);
+}
+
+static inline void binder_outer_unlock(struct binder_proc *proc)
+{
+	mutex_unlock(&proc->outer_lock);
+}
+
+static void binder_outer_lock_pair(struct binder_proc *proc1,
+				   struct binder_proc *proc2)
+{
+	if (proc1 == proc2) {
+		binder_outer_lock(proc1);
+		return;
+	}
+	if (proc1 > proc2)
+		swap(proc1, proc2);
+	binder_mutex_lock(&proc1->outer_lock, 0, BINDER_LOCK_OUTER);
+	binder_mutex_lock(&proc2->outer_lock, SINGLE_DEPTH_NESTING,
+			  BINDER_LOCK_OUTER);
+}
+
+static void binder_outer_unlock_pair(struct binder_proc *proc1,
+				     struct binder_proc *proc2)
+{
+	mutex_unlock(&proc1->outer_lock);
+	if (proc1 != proc2)
+		mutex_unlock(&proc2->outer_lock);
+}
+
+static inline void binder_alloc_lock(struct binder_proc *proc)
+{
+	binder_mutex_lock(&proc->alloc_lock, 0, BINDER_LOCK_ALLOC);
+}
+
+static inline void binder_alloc_unlock(struct binder_proc *proc)
+{
+	mutex_unlock(&proc->alloc_lock);
+}
+
+static inline void binder_inner_lock(struct binder_proc *proc)
+{
+	binder_mutex_lock(&proc->inner_lock, 0, BINDER_LOCK_INNER);
+}
+
+static inline void binder_inner_unlock(struct binder_proc *proc)
+{
+	mutex_unlock(&proc->inner_lock);
+}
+
+/*
+ * A node is protected by the inner lock of its proc, or by
+ * binder_dead_nodes_lock once that proc is gone.  node->proc only changes
+ * with binder_main_lock held for write.  The node may be freed while the
+ * lock is held, so binder_node_unlock() takes the proc returned here.
+ */
+static struct binder_proc *binder_node_lock(struct binder_node *node)
+{
+	struct binder_proc *proc = node->proc;
+
+	if (proc)
+		binder_inner_lock(proc);
+	else
+		binder_mutex_lock(&binder_dead_nodes_lock, 0,
+				  BINDER_LOCK_DEAD_NODES);
+	return proc;
+}
+
+static void binder_node_unlock(struct binder_proc *proc)
+{
+	if (proc)
+		binder_inner_unlock(proc);
+	else
+		mutex_unlock(&binder_dead_nodes_lock);
+}
+
 /*
  * copied from get_unused_fd_flags
  */
@@ -516,6 +752,92 @@ static void binder_set_nice(long nice)
 	binder_user_error("binder: %d RLIMIT_NICE not set\n", current->pid);
 }
 
+static inline int binder_rt_policy(unsigned int policy)
+{
+	return policy == SCHED_FIFO || policy == SCHED_RR;
+}
+
+static void binder_get_priority(struct task_struct *task,
+				struct binder_priority *p)
+{
+	p->sched_policy = task->policy;
+	if (binder_rt_policy(task->policy))
+		p->prio = task->rt_priority;
+	else
+		p->prio = task_nice(task);
+}
+
+static void binder_set_priority(struct binder_priority desired)
+{
+	struct sched_param params;
+	int ret;
+
+	if (binder_rt_policy(desired.sched_policy)) {
+		if (current->policy == desired.sched_policy &&
+		    current->rt_priority == desired.prio)
+			return;
+		params.sched_priority = desired.prio;
+		ret = sched_setscheduler_nocheck(current, desired.sched_policy,
+						 &params);
+		if (ret)
+			binder_debug(BINDER_DEBUG_PRIORITY_CAP,
+				     "binder: %d: failed to set policy %u "
+				     "priority %d, %d\n", current->pid,
+				     desired.sched_policy, desired.prio, ret);
+		return;
+	}
+	if (binder_rt_policy(current->policy)) {
+		params.sched_priority = 0;
+		ret = sched_setscheduler_nocheck(current, desired.sched_policy,
+						 &params);
+		if (ret)
+			binder_debug(BINDER_DEBUG_PRIORITY_CAP,
+				     "binder: %d: failed to drop policy %u, "
+				     "%d\n", current->pid, current->policy,
+				     ret);
+	}
+	binder_set_nice(desired.prio);
+}
+
+/*
+ * Called by the thread that picks up t, to work out the priority to run
+ * it at.  Synchronous transactions run at the caller's priority,
+ * including a real-time policy, but never below the minimum priority of
+ * the target node.  Asynchronous transactions only raise the thread to
+ * the node's minimum priority.  A thread that is real-time on its own is
+ * only ever raised.
+ *
+ * Only looks at current, so it may be called under the inner lock;
+ * returns 0 if the thread keeps its priority, else the caller applies
+ * *desired with binder_set_priority() after dropping the lock.
+ */
+static int binder_transaction_priority(struct binder_transaction *t,
+				       struct binder_node *node,
+				       struct binder_priority *desired)
+{
+	struct binder_priority *saved = &t->saved_priority;
+
+	binder_get_priority(current, saved);
+	*desired = t->priority;
+
+	if (binder_rt_policy(saved->sched_policy))
+		return !(t->flags & TF_ONE_WAY) &&
+			binder_rt_policy(desired->sched_policy) &&
+			desired->prio > saved->prio;
+
+	if (t->flags & TF_ONE_WAY) {
+		if (saved->prio <= node->min_priority)
+			return 0;
+		desired->sched_policy = saved->sched_policy;
+		desired->prio = node->min_priority;
+		return 1;
+	}
+	if (!binder_rt_policy(desired->sched_policy) &&
+	    desired->prio > node->min_priority)
+		desired->prio = node->min_priority;
+	return 1;
+}
+
 static size_t binder_buffer_size(struct binder_proc *proc,
 				 struct binder_buffer *buffer)
 {
@@ -608,15 +930,114 @@ static struct binder_buffer *binder_buffer_lookup(struct binder_proc *proc,
 	return NULL;
 }
 
+static struct binder_lru_page *binder_lru_page_at(struct binder_proc *proc,
+						  void *page_addr)
+{
+	return &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+}
+
+static void *binder_lru_page_addr(struct binder_lru_page *lru_page)
+{
+	struct binder_proc *proc = lru_page->proc;
+
+	return proc->buffer + (lru_page - proc->pages) * PAGE_SIZE;
+}
+
+static void binder_park_pages(struct binder_proc *proc, void *start,
+			      void *end)
+{
+	void *page_addr;
+	struct binder_lru_page *lru_page;
+
+	spin_lock(&binder_lru_lock);
+	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
+		lru_page = binder_lru_page_at(proc, page_addr);
+		if (lru_page->page_ptr == NULL)
+			continue;
+		BUG_ON(!list_empty(&lru_page->lru));
+		list_add_tail(&lru_page->lru, &binder_lru);
+		binder_lru_pages++;
+	}
+	spin_unlock(&binder_lru_lock);
+}
+
+static int binder_map_pages(struct binder_proc *proc,
+			    struct vm_area_struct *vma,
+			    void *start, int nr_pages)
+{
+	struct page *pages[BINDER_PAGE_BATCH];
+	struct page **page_array_ptr = pages;
+	struct binder_lru_page *lru_page;
+	unsigned long user_page_addr;
+	struct vm_struct tmp_area;
+	int i;
+	int ret;
+
+	for (i = 0; i < nr_pages; i++) {
+		pages[i] = alloc_page(GFP_KERNEL | __GFP_ZERO);
+		if (pages[i] == NULL) {
+			binder_debug(BINDER_DEBUG_TOP_ERRORS,
+			       "binder: %d: binder_alloc_buf failed "
+			       "for page at %p\n", proc->pid,
+			       start + i * PAGE_SIZE);
+			goto err_alloc_page_failed;
+		}
+	}
+	tmp_area.addr = start;
+	tmp_area.size = nr_pages * PAGE_SIZE + PAGE_SIZE /* guard page? */;
+	ret = map_vm_area(&tmp_area, PAGE_KERNEL, &page_array_ptr);
+	if (ret) {
+		binder_debug(BINDER_DEBUG_TOP_ERRORS,
+		       "binder: %d: binder_alloc_buf failed "
+		       "to map pages at %p-%p in kernel\n",
+		       proc->pid, start, start + nr_pages * PAGE_SIZE);
+		goto err_map_kernel_failed;
+	}
+	user_page_addr = (uintptr_t)start + proc->user_buffer_offset;
+	for (i = 0; i < nr_pages; i++) {
+		ret = vm_insert_page(vma, user_page_addr + i * PAGE_SIZE,
+				     pages[i]);
+		if (ret) {
+			binder_debug(BINDER_DEBUG_TOP_ERRORS,
+			       "binder: %d: binder_alloc_buf failed "
+			       "to map page at %lx in userspace\n",
+			       proc->pid, user_page_addr + i * PAGE_SIZE);
+			goto err_vm_insert_page_failed;
+		}
+		/* vm_insert_page does not seem to increment the refcount */
+	}
+	lru_page = binder_lru_page_at(proc, start);
+	for (i = 0; i < nr_pages; i++)
+		lru_page[i].page_ptr = pages[i];
+	return 0;
+
+err_vm_insert_page_failed:
+	if (i)
+		zap_page_range(vma, user_page_addr, i * PAGE_SIZE, NULL);
+	unmap_kernel_range((unsigned long)start, nr_pages * PAGE_SIZE);
+err_map_kernel_failed:
+	i = nr_pages;
+err_alloc_page_failed:
+	while (i--)
+		__free_page(pages[i]);
+	return -ENOMEM;
+}
+
+/*
+ * Pages are not freed when a buffer no longer uses them.  They are parked
+ * on binder_lru, still mapped in the kernel and in userspace, and taken
+ * back without any page table work if the range is allocated again before
+ * binder_shrink() reclaims them.  Pages that do have to be populated are
+ * allocated and mapped BINDER_PAGE_BATCH at a time.
+ */
 static int binder_update_page_range(struct binder_proc *proc, int allocate,
 				    void *start, void *end,
 				    struct vm_area_struct *vma)
 {
 	void *page_addr;
-	unsigned long user_page_addr;
-	struct vm_struct tmp_area;
-	struct page **page;
+	struct binder_lru_page *lru_page;
 	struct mm_struct *mm;
+	int missing = 0;
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: %s pages %p-%p\n", proc->pid,
@@ -625,6 +1046,27 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	if (end <= start)
 		return 0;
 
+	if (allocate == 0) {
+		binder_park_pages(proc, start, end);
+		return 0;
+	}
+
+	spin_lock(&binder_lru_lock);
+	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
+		lru_page = binder_lru_page_at(proc, page_addr);
+		if (lru_page->page_ptr == NULL) {
+			missing++;
+			continue;
+		}
+		BUG_ON(list_empty(&lru_page->lru));
+		list_del_init(&lru_page->lru);
+		binder_lru_pages--;
+	}
+	spin_unlock(&binder_lru_lock);
+
+	if (!missing)
+		return 0;
+
 	if (vma)
 		mm = NULL;
 	else
@@ -635,9 +1077,6 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		vma = proc->vma;
 	}
 
-	if (allocate == 0)
-		goto free_range;
-
 	if (vma == NULL) {
 		binder_debug(BINDER_DEBUG_TOP_ERRORS,
 		       "binder: %d: binder_alloc_buf failed to "
@@ -645,41 +1084,22 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		goto err_no_vma;
 	}
 
-	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
-		int ret;
-		struct page **page_array_ptr;
-		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+	page_addr = start;
+	while (page_addr < end) {
+		void *run_start = page_addr;
+		int nr_pages = 0;
 
-		BUG_ON(*page);
-		*page = alloc_page(GFP_KERNEL | __GFP_ZERO);
-		if (*page == NULL) {
-			binder_debug(BINDER_DEBUG_TOP_ERRORS,
-			       "binder: %d: binder_alloc_buf failed "
-			       "for page at %p\n", proc->pid, page_addr);
-			goto err_alloc_page_failed;
-		}
-		tmp_area.addr = page_addr;
-		tmp_area.size = PAGE_SIZE + PAGE_SIZE /* guard page? */;
-		page_array_ptr = page;
-		ret = map_vm_area(&tmp_area, PAGE_KERNEL, &page_array_ptr);
-		if (ret) {
-			binder_debug(BINDER_DEBUG_TOP_ERRORS,
-			       "binder: %d: binder_alloc_buf failed "
-			       "to map page at %p in kernel\n",
-			       proc->pid, page_addr);
-			goto err_map_kernel_failed;
+		while (page_addr < end && nr_pages < BINDER_PAGE_BATCH &&
+		       !binder_lru_page_at(proc, page_addr)->page_ptr) {
+			page_addr += PAGE_SIZE;
+			nr_pages++;
 		}
-		user_page_addr =
-			(uintptr_t)page_addr + proc->user_buffer_offset;
-		ret = vm_insert_page(vma, user_page_addr, page[0]);
-		if (ret) {
-			binder_debug(BINDER_DEBUG_TOP_ERRORS,
-			       "binder: %d: binder_alloc_buf failed "
-			       "to map page at %lx in userspace\n",
-			       proc->pid, user_page_addr);
-			goto err_vm_insert_page_failed;
+		if (nr_pages == 0) {
+			page_addr += PAGE_SIZE;
+			continue;
 		}
-		/* vm_insert_page does not seem to increment the refcount */
+		if (binder_map_pages(proc, vma, run_start, nr_pages))
+			goto err_map_pages_failed;
 	}
 	if (mm) {
 		up_write(&mm->mmap_sem);
@@ -687,40 +1107,172 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	}
 	return 0;
 
-free_range:
-	for (page_addr = end - PAGE_SIZE; page_addr >= start;
-	     page_addr -= PAGE_SIZE) {
-		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
-		if (vma)
-			zap_page_range(vma, (uintptr_t)page_addr +
-				proc->user_buffer_offset, PAGE_SIZE, NULL);
-err_vm_insert_page_failed:
-		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
-err_map_kernel_failed:
-		__free_page(*page);
-		*page = NULL;
-err_alloc_page_failed:
-		;
-	}
+err_map_pages_failed:
 err_no_vma:
 	if (mm) {
 		up_write(&mm->mmap_sem);
 		mmput(mm);
 	}
+	binder_park_pages(proc, start, end);
 	return -ENOMEM;
 }
 
-static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
-					      size_t data_size,
-					      size_t offsets_size, int is_async)
+/*
+ * Unmaps and frees a parked page.  Called with proc->alloc_lock held and
+ * the page already taken off binder_lru.  Fails without sleeping if the
+ * mm of the proc cannot be locked.
+ */
+static int binder_free_lru_page(struct binder_lru_page *lru_page)
+{
+	struct binder_proc *proc = lru_page->proc;
+	void *page_addr = binder_lru_page_addr(lru_page);
+	struct mm_struct *mm = NULL;
+
+	if (proc->vma) {
+		mm = get_task_mm(proc->tsk);
+		if (mm == NULL || !down_read_trylock(&mm->mmap_sem))
+			goto err_busy;
+		if (proc->vma)
+			zap_page_range(proc->vma, (uintptr_t)page_addr +
+				proc->user_buffer_offset, PAGE_SIZE, NULL);
+		up_read(&mm->mmap_sem);
+		mmput(mm);
+	}
+	unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+	__free_page(lru_page->page_ptr);
+	lru_page->page_ptr = NULL;
+	return 0;
+
+err_busy:
+	if (mm)
+		mmput(mm);
+	return -EBUSY;
+}
+
+static int binder_shrink(struct shrinker *s, struct shrink_control *sc)
+{
+	struct binder_lru_page *lru_page;
+	struct binder_proc *proc;
+	int nr_to_scan = sc->nr_to_scan;
+	int freed = 0;
+
+	while (nr_to_scan-- > 0) {
+		spin_lock(&binder_lru_lock);
+		if (list_empty(&binder_lru)) {
+			spin_unlock(&binder_lru_lock);
+			break;
+		}
+		lru_page = list_first_entry(&binder_lru, struct binder_lru_page,
+					    lru);
+		proc = lru_page->proc;
+		if (!mutex_trylock(&proc->alloc_lock)) {
+			list_move_tail(&lru_page->lru, &binder_lru);
+			spin_unlock(&binder_lru_lock);
+			continue;
+		}
+		list_del_init(&lru_page->lru);
+		binder_lru_pages--;
+		spin_unlock(&binder_lru_lock);
+
+		if (binder_free_lru_page(lru_page)) {
+			spin_lock(&binder_lru_lock);
+			list_add_tail(&lru_page->lru, &binder_lru);
+			binder_lru_pages++;
+			spin_unlock(&binder_lru_lock);
+		} else
+			freed++;
+		mutex_unlock(&proc->alloc_lock);
+	}
+	if (freed) {
+		atomic_add(freed, &binder_lru_reclaimed);
+		binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
+			     "binder: shrink freed %d pages, %d left\n",
+			     freed, binder_lru_pages);
+	}
+	return binder_lru_pages;
+}
+
+static struct shrinker binder_shrinker = {
+	.shrink = binder_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
+static int binder_size_class(size_t size)
+{
+	if (size > BINDER_SIZE_CLASS_MAX)
+		return -1;
+	if (size <= BINDER_SIZE_CLASS_MIN)
+		return 0;
+	return fls((size - 1) >> BINDER_SIZE_CLASS_SHIFT);
+}
+
+static int binder_park_buffer(struct binder_proc *proc,
+			      struct binder_buffer *buffer, size_t buffer_size)
+{
+	int class = binder_size_class(buffer_size);
+	size_t cost = buffer_size + sizeof(struct binder_buffer);
+
+	if (class < 0 || (BINDER_SIZE_CLASS_MIN << class) != buffer_size)
+		return 0;
+	if (proc->size_class_bytes + cost >
+	    proc->buffer_size / BINDER_SIZE_CLASS_SHARE)
+		return 0;
+
+	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
+		     "binder: %d: park buffer %p in size class %zd\n",
+		     proc->pid, buffer, buffer_size);
+	buffer->parked = 1;
+	list_add(&buffer->class_entry, &proc->size_class[class]);
+	proc->size_class_bytes += cost;
+	return 1;
+}
+
+static struct binder_buffer *binder_unpark_buffer(struct binder_proc *proc,
+						  int class)
+{
+	struct binder_buffer *buffer;
+
+	if (list_empty(&proc->size_class[class]))
+		return NULL;
+	buffer = list_first_entry(&proc->size_class[class],
+				  struct binder_buffer, class_entry);
+	list_del(&buffer->class_entry);
+	buffer->parked = 0;
+	proc->size_class_bytes -= (BINDER_SIZE_CLASS_MIN << class) +
+				  sizeof(struct binder_buffer);
+	return buffer;
+}
+
+static void binder_insert_free_space(struct binder_proc *proc,
+				     struct binder_buffer *buffer,
+				     size_t buffer_size);
+
+static void binder_drain_size_classes(struct binder_proc *proc)
 {
-	struct rb_node *n = proc->free_buffers.rb_node;
+	struct binder_buffer *buffer;
+	int class;
+
+	for (class = 0; class < BINDER_SIZE_CLASSES; class++) {
+		while ((buffer = binder_unpark_buffer(proc, class)))
+			binder_insert_free_space(proc, buffer,
+				binder_buffer_size(proc, buffer));
+	}
+}
+
+static struct binder_buffer *binder_alloc_buf_locked(struct binder_proc *proc,
+						     size_t data_size,
+						     size_t offsets_size,
+						     size_t extra_buffers_size,
+						     int is_async)
+{
+	struct rb_node *n;
 	struct binder_buffer *buffer;
 	size_t buffer_size;
-	struct rb_node *best_fit = NULL;
+	struct rb_node *best_fit;
 	void *has_page_addr;
 	void *end_page_addr;
-	size_t size;
+	size_t size, alloc_size;
+	int class;
 
 	if (proc->vma == NULL) {
 		binder_debug(BINDER_DEBUG_TOP_ERRORS,
@@ -737,6 +1289,13 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 			"size %zd-%zd\n", proc->pid, data_size, offsets_size);
 		return NULL;
 	}
+	size += ALIGN(extra_buffers_size, sizeof(void *));
+	if (size < extra_buffers_size) {
+		binder_user_error("binder: %d: got transaction with invalid "
+			"extra buffers size %zd\n", proc->pid,
+			extra_buffers_size);
+		return NULL;
+	}
 
 	if (is_async &&
 	    proc->free_async_space < size + sizeof(struct binder_buffer)) {
@@ -746,21 +1305,46 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 		return NULL;
 	}
 
+	alloc_size = size;
+	class = binder_size_class(size);
+	if (class >= 0) {
+		alloc_size = BINDER_SIZE_CLASS_MIN << class;
+		buffer = binder_unpark_buffer(proc, class);
+		if (buffer) {
+			binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
+				     "binder: %d: binder_alloc_buf size %zd "
+				     "got parked %p\n", proc->pid, size, buffer);
+			binder_insert_allocated_buffer(proc, buffer);
+			goto found;
+		}
+	}
+
+retry:
+	n = proc->free_buffers.rb_node;
+	best_fit = NULL;
 	while (n) {
 		buffer = rb_entry(n, struct binder_buffer, rb_node);
 		BUG_ON(!buffer->free);
 		buffer_size = binder_buffer_size(proc, buffer);
 
-		if (size < buffer_size) {
+		if (alloc_size < buffer_size) {
 			best_fit = n;
 			n = n->rb_left;
-		} else if (size > buffer_size)
+		} else if (alloc_size > buffer_size)
 			n = n->rb_right;
 		else {
 			best_fit = n;
 			break;
 		}
 	}
+	if (best_fit == NULL && proc->size_class_bytes) {
+		binder_drain_size_classes(proc);
+		goto retry;
+	}
+	if (best_fit == NULL && alloc_size != size) {
+		alloc_size = size;
+		goto retry;
+	}
 	if (best_fit == NULL) {
 		binder_debug(BINDER_DEBUG_TOP_ERRORS,
 		       "binder: %d: binder_alloc_buf size %zd failed, "
@@ -779,10 +1363,10 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	has_page_addr =
 		(void *)(((uintptr_t)buffer->data + buffer_size) & PAGE_MASK);
 	if (n == NULL) {
-		if (size + sizeof(struct binder_buffer) + 4 >= buffer_size)
-			buffer_size = size; /* no room for other buffers */
+		if (alloc_size + sizeof(struct binder_buffer) + 4 >= buffer_size)
+			buffer_size = alloc_size; /* no room for other buffers */
 		else
-			buffer_size = size + sizeof(struct binder_buffer);
+			buffer_size = alloc_size + sizeof(struct binder_buffer);
 	}
 	end_page_addr =
 		(void *)PAGE_ALIGN((uintptr_t)buffer->data + buffer_size);
@@ -795,8 +1379,9 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	rb_erase(best_fit, &proc->free_buffers);
 	buffer->free = 0;
 	binder_insert_allocated_buffer(proc, buffer);
-	if (buffer_size != size) {
-		struct binder_buffer *new_buffer = (void *)buffer->data + size;
+	if (buffer_size != alloc_size) {
+		struct binder_buffer *new_buffer =
+			(void *)buffer->data + alloc_size;
 		list_add(&new_buffer->entry, &buffer->entry);
 		new_buffer->free = 1;
 		binder_insert_free_buffer(proc, new_buffer);
@@ -804,8 +1389,10 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: binder_alloc_buf size %zd got "
 		     "%p\n", proc->pid, size, buffer);
+found:
 	buffer->data_size = data_size;
 	buffer->offsets_size = offsets_size;
+	buffer->extra_buffers_size = extra_buffers_size;
 	buffer->async_transaction = is_async;
 	if (is_async) {
 		proc->free_async_space -= size + sizeof(struct binder_buffer);
@@ -818,6 +1405,23 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	return buffer;
 }
 
+static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
+					      size_t data_size,
+					      size_t offsets_size,
+					      size_t extra_buffers_size,
+					      int is_async)
+{
+	struct binder_buffer *buffer;
+
+	binder_alloc_lock(proc);
+	buffer = binder_alloc_buf_locked(proc, data_size, offsets_size,
+					 extra_buffers_size, is_async);
+	if (buffer)
+		buffer->allow_user_free = 0;
+	binder_alloc_unlock(proc);
+	return buffer;
+}
+
 static void *buffer_start_page(struct binder_buffer *buffer)
 {
 	return (void *)((uintptr_t)buffer & PAGE_MASK);
@@ -875,15 +1479,16 @@ static void binder_delete_free_buffer(struct binder_proc *proc,
 	}
 }
 
-static void binder_free_buf(struct binder_proc *proc,
-			    struct binder_buffer *buffer)
+static void binder_free_buf_locked(struct binder_proc *proc,
+				   struct binder_buffer *buffer)
 {
 	size_t size, buffer_size;
 
 	buffer_size = binder_buffer_size(proc, buffer);
 
 	size = ALIGN(buffer->data_size, sizeof(void *)) +
-		ALIGN(buffer->offsets_size, sizeof(void *));
+		ALIGN(buffer->offsets_size, sizeof(void *)) +
+		ALIGN(buffer->extra_buffers_size, sizeof(void *));
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: binder_free_buf %p size %zd buffer"
@@ -904,11 +1509,20 @@ static void binder_free_buf(struct binder_proc *proc,
 			     proc->free_async_space);
 	}
 
+	rb_erase(&buffer->rb_node, &proc->allocated_buffers);
+	if (binder_park_buffer(proc, buffer, buffer_size))
+		return;
+	binder_insert_free_space(proc, buffer, buffer_size);
+}
+
+static void binder_insert_free_space(struct binder_proc *proc,
+				     struct binder_buffer *buffer,
+				     size_t buffer_size)
+{
 	binder_update_page_range(proc, 0,
 		(void *)PAGE_ALIGN((uintptr_t)buffer->data),
 		(void *)(((uintptr_t)buffer->data + buffer_size) & PAGE_MASK),
 		NULL);
-	rb_erase(&buffer->rb_node, &proc->allocated_buffers);
 	buffer->free = 1;
 	if (!list_is_last(&buffer->entry, &proc->buffers)) {
 		struct binder_buffer *next = list_entry(buffer->entry.next,
@@ -930,8 +1544,16 @@ static void binder_free_buf(struct binder_proc *proc,
 	binder_insert_free_buffer(proc, buffer);
 }
 
-static struct binder_node *binder_get_node(struct binder_proc *proc,
-					   void __user *ptr)
+static void binder_free_buf(struct binder_proc *proc,
+			    struct binder_buffer *buffer)
+{
+	binder_alloc_lock(proc);
+	binder_free_buf_locked(proc, buffer);
+	binder_alloc_unlock(proc);
+}
+
+static struct binder_node *binder_get_node_ilocked(struct binder_proc *proc,
+						   void __user *ptr)
 {
 	struct rb_node *n = proc->nodes.rb_node;
 	struct binder_node *node;
@@ -949,14 +1571,41 @@ static struct binder_node *binder_get_node(struct binder_proc *proc,
 	return NULL;
 }
 
+/*
+ * Looks up a node and pins it with a temporary reference, so it stays
+ * around after the inner lock is dropped.  Release with binder_put_node().
+ */
+static struct binder_node *binder_get_node(struct binder_proc *proc,
+					   void __user *ptr)
+{
+	struct binder_node *node;
+
+	binder_inner_lock(proc);
+	node = binder_get_node_ilocked(proc, ptr);
+	if (node)
+		node->tmp_refs++;
+	binder_inner_unlock(proc);
+	return node;
+}
+
+/*
+ * Creates a node pinned with a temporary reference.  The caller must hold
+ * proc->outer_lock, which serializes node creation within a proc.
+ */
 static struct binder_node *binder_new_node(struct binder_proc *proc,
 					   void __user *ptr,
 					   void __user *cookie)
 {
-	struct rb_node **p = &proc->nodes.rb_node;
+	struct rb_node **p;
 	struct rb_node *parent = NULL;
-	struct binder_node *node;
+	struct binder_node *node, *new_node;
+
+	new_node = kzalloc(sizeof(*new_node), GFP_KERNEL);
+	if (new_node == NULL)
+		return NULL;
 
+	binder_inner_lock(proc);
+	p = &proc->nodes.rb_node;
 	while (*p) {
 		parent = *p;
 		node = rb_entry(parent, struct binder_node, rb_node);
@@ -965,23 +1614,25 @@ static struct binder_node *binder_new_node(struct binder_proc *proc,
 			p = &(*p)->rb_left;
 		else if (ptr > node->ptr)
 			p = &(*p)->rb_right;
-		else
+		else {
+			binder_inner_unlock(proc);
+			kfree(new_node);
 			return NULL;
+		}
 	}
-
-	node = kzalloc(sizeof(*node), GFP_KERNEL);
-	if (node == NULL)
-		return NULL;
+	node = new_node;
 	binder_stats_created(BINDER_STAT_NODE);
 	rb_link_node(&node->rb_node, parent, p);
 	rb_insert_color(&node->rb_node, &proc->nodes);
-	node->debug_id = ++binder_last_id;
+	node->debug_id = atomic_inc_return(&binder_last_id);
 	node->proc = proc;
 	node->ptr = ptr;
 	node->cookie = cookie;
+	node->tmp_refs = 1;
 	node->work.type = BINDER_WORK_NODE;
 	INIT_LIST_HEAD(&node->work.entry);
 	INIT_LIST_HEAD(&node->async_todo);
+	binder_inner_unlock(proc);
 	binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 		     "binder: %d:%d node %d u%p c%p created\n",
 		     proc->pid, current->pid, node->debug_id,
@@ -989,8 +1640,8 @@ static struct binder_node *binder_new_node(struct binder_proc *proc,
 	return node;
 }
 
-static int binder_inc_node(struct binder_node *node, int strong, int internal,
-			   struct list_head *target_list)
+static int binder_inc_node_ilocked(struct binder_node *node, int strong,
+				   int internal, struct list_head *target_list)
 {
 	if (strong) {
 		if (internal) {
@@ -1026,21 +1677,20 @@ static int binder_inc_node(struct binder_node *node, int strong, int internal,
 	return 0;
 }
 
-static int binder_dec_node(struct binder_node *node, int strong, int internal)
+static int binder_inc_node(struct binder_node *node, int strong, int internal,
+			   struct list_head *target_list)
+{
+	struct binder_proc *proc;
+	int ret;
+
+	proc = binder_node_lock(node);
+	ret = binder_inc_node_ilocked(node, strong, internal, target_list);
+	binder_node_unlock(proc);
+	return ret;
+}
+
+static void binder_release_node_ilocked(struct binder_node *node)
 {
-	if (strong) {
-		if (internal)
-			node->internal_strong_refs--;
-		else
-			node->local_strong_refs--;
-		if (node->local_strong_refs || node->internal_strong_refs)
-			return 0;
-	} else {
-		if (!internal)
-			node->local_weak_refs--;
-		if (node->local_weak_refs || !hlist_empty(&node->refs))
-			return 0;
-	}
 	if (node->proc && (node->has_strong_ref || node->has_weak_ref)) {
 		if (list_empty(&node->work.entry)) {
 			list_add_tail(&node->work.entry, &node->proc->todo);
@@ -1048,7 +1698,7 @@ static int binder_dec_node(struct binder_node *node, int strong, int internal)
 		}
 	} else {
 		if (hlist_empty(&node->refs) && !node->local_strong_refs &&
-		    !node->local_weak_refs) {
+		    !node->local_weak_refs && !node->tmp_refs) {
 			list_del_init(&node->work.entry);
 			if (node->proc) {
 				rb_erase(&node->rb_node, &node->proc->nodes);
@@ -1065,11 +1715,55 @@ static int binder_dec_node(struct binder_node *node, int strong, int internal)
 			binder_stats_deleted(BINDER_STAT_NODE);
 		}
 	}
+}
 
+static int binder_dec_node_ilocked(struct binder_node *node, int strong,
+				   int internal)
+{
+	if (strong) {
+		if (internal)
+			node->internal_strong_refs--;
+		else
+			node->local_strong_refs--;
+		if (node->local_strong_refs || node->internal_strong_refs)
+			return 0;
+	} else {
+		if (!internal)
+			node->local_weak_refs--;
+		if (node->local_weak_refs || !hlist_empty(&node->refs))
+			return 0;
+	}
+	binder_release_node_ilocked(node);
 	return 0;
 }
 
+static int binder_dec_node(struct binder_node *node, int strong, int internal)
+{
+	struct binder_proc *proc;
+	int ret;
+
+	proc = binder_node_lock(node);
+	ret = binder_dec_node_ilocked(node, strong, internal);
+	binder_node_unlock(proc);
+	return ret;
+}
+
+static void binder_put_node(struct binder_node *node)
+{
+	struct binder_proc *proc;
+
+	proc = binder_node_lock(node);
+	BUG_ON(node->tmp_refs <= 0);
+	node->tmp_refs--;
+	if (!node->tmp_refs && !node->local_strong_refs &&
+	    !node->internal_strong_refs && !node->local_weak_refs &&
+	    hlist_empty(&node->refs))
+		binder_release_node_ilocked(node);
+	binder_node_unlock(proc);
+}
+
 
+/* The caller must hold proc->outer_lock for the ref lookups below. */
 static struct binder_ref *binder_get_ref(struct binder_proc *proc,
 					 uint32_t desc)
 {
@@ -1112,7 +1806,7 @@ static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
 	if (new_ref == NULL)
 		return NULL;
 	binder_stats_created(BINDER_STAT_REF);
-	new_ref->debug_id = ++binder_last_id;
+	new_ref->debug_id = atomic_inc_return(&binder_last_id);
 	new_ref->proc = proc;
 	new_ref->node = node;
 	rb_link_node(&new_ref->rb_node_node, parent, p);
@@ -1141,7 +1835,10 @@ static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
 	rb_link_node(&new_ref->rb_node_desc, parent, p);
 	rb_insert_color(&new_ref->rb_node_desc, &proc->refs_by_desc);
 	if (node) {
+		struct binder_proc *node_proc = binder_node_lock(node);
+
 		hlist_add_head(&new_ref->node_entry, &node->refs);
+		binder_node_unlock(node_proc);
 
 		binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 			     "binder: %d new ref %d desc %d for "
@@ -1158,6 +1855,8 @@ static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
 
 static void binder_delete_ref(struct binder_ref *ref)
 {
+	struct binder_proc *node_proc;
+
 	binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 		     "binder: %d delete ref %d desc %d for "
 		     "node %d\n", ref->proc->pid, ref->debug_id,
@@ -1165,16 +1864,20 @@ static void binder_delete_ref(struct binder_ref *ref)
 
 	rb_erase(&ref->rb_node_desc, &ref->proc->refs_by_desc);
 	rb_erase(&ref->rb_node_node, &ref->proc->refs_by_node);
+	node_proc = binder_node_lock(ref->node);
 	if (ref->strong)
-		binder_dec_node(ref->node, 1, 1);
+		binder_dec_node_ilocked(ref->node, 1, 1);
 	hlist_del(&ref->node_entry);
-	binder_dec_node(ref->node, 0, 1);
+	binder_dec_node_ilocked(ref->node, 0, 1);
+	binder_node_unlock(node_proc);
 	if (ref->death) {
 		binder_debug(BINDER_DEBUG_DEAD_BINDER,
 			     "binder: %d delete ref %d desc %d "
 			     "has death notification\n", ref->proc->pid,
 			     ref->debug_id, ref->desc);
+		binder_inner_lock(ref->proc);
 		list_del(&ref->death->work.entry);
+		binder_inner_unlock(ref->proc);
 		kfree(ref->death);
 		binder_stats_deleted(BINDER_STAT_DEATH);
 	}
@@ -1237,19 +1940,96 @@ static int binder_dec_ref(struct binder_ref *ref, int strong)
 	return 0;
 }
 
-static void binder_pop_transaction(struct binder_thread *target_thread,
-				   struct binder_transaction *t)
+/* The caller must hold target_thread->proc->inner_lock. */
+static void binder_pop_transaction_ilocked(struct binder_thread *target_thread,
+					   struct binder_transaction *t)
 {
-	if (target_thread) {
-		BUG_ON(target_thread->transaction_stack != t);
-		BUG_ON(target_thread->transaction_stack->from != target_thread);
-		target_thread->transaction_stack =
-			target_thread->transaction_stack->from_parent;
-		t->from = NULL;
+	BUG_ON(target_thread->transaction_stack != t);
+	BUG_ON(target_thread->transaction_stack->from != target_thread);
+	target_thread->transaction_stack =
+		target_thread->transaction_stack->from_parent;
+	t->from = NULL;
+}
+
+static void binder_latency_hist_add(struct binder_latency_hist *hist,
+				    u64 latency_ns)
+{
+	u64 latency_us = div_u64(latency_ns, NSEC_PER_USEC);
+	int bucket = latency_us ? fls64(latency_us) : 0;
+
+	if (bucket >= BINDER_LATENCY_BUCKETS)
+		bucket = BINDER_LATENCY_BUCKETS - 1;
+	hist->bucket[bucket]++;
+	hist->count++;
+	hist->total_ns += latency_ns;
+	if (latency_ns > hist->max_ns)
+		hist->max_ns = latency_ns;
+}
+
+static struct binder_latency_hist *
+binder_get_code_latency_ilocked(struct binder_proc *proc, uint32_t code)
+{
+	struct rb_node **p = &proc->code_latency.rb_node;
+	struct rb_node *parent = NULL;
+	struct binder_code_latency *cl;
+
+	while (*p) {
+		parent = *p;
+		cl = rb_entry(parent, struct binder_code_latency, rb_node);
+
+		if (code < cl->code)
+			p = &parent->rb_left;
+		else if (code > cl->code)
+			p = &parent->rb_right;
+		else
+			return &cl->hist;
 	}
+	if (proc->code_latency_count >= BINDER_LATENCY_MAX_CODES)
+		return NULL;
+	cl = kzalloc(sizeof(*cl), GFP_KERNEL);
+	if (cl == NULL)
+		return NULL;
+	cl->code = code;
+	rb_link_node(&cl->rb_node, parent, p);
+	rb_insert_color(&cl->rb_node, &proc->code_latency);
+	proc->code_latency_count++;
+	return &cl->hist;
+}
+
+/*
+ * Called with the inner lock of the replying proc, which is the target of
+ * in_reply_to, held.
+ */
+static void binder_account_reply_ilocked(struct binder_proc *proc,
+					 struct binder_transaction *in_reply_to)
+{
+	struct binder_latency_hist *hist;
+	u64 latency_ns;
+
+	latency_ns = ktime_to_ns(ktime_get()) - in_reply_to->start_ns;
+	trace_binder_transaction_reply(in_reply_to, latency_ns);
+
+	binder_latency_hist_add(&proc->latency, latency_ns);
+	hist = binder_get_code_latency_ilocked(proc, in_reply_to->code);
+	if (hist)
+		binder_latency_hist_add(hist, latency_ns);
+}
+
+/*
+ * Frees a transaction that is no longer on any stack or work list.  The
+ * buffer link is protected by the inner lock of the proc owning the buffer.
+ */
+static void binder_free_transaction(struct binder_transaction *t)
+{
+	struct binder_proc *to_proc = t->to_proc;
+
 	t->need_reply = 0;
+	if (to_proc)
+		binder_inner_lock(to_proc);
 	if (t->buffer)
 		t->buffer->transaction = NULL;
+	if (to_proc)
+		binder_inner_unlock(to_proc);
 	kfree(t);
 	binder_stats_deleted(BINDER_STAT_TRANSACTION);
 }
@@ -1262,6 +2042,7 @@ static void binder_send_failed_reply(struct binder_transaction *t,
 	while (1) {
 		target_thread = t->from;
 		if (target_thread) {
+			binder_inner_lock(target_thread->proc);
 			if (target_thread->return_error != BR_OK &&
 			   target_thread->return_error2 == BR_OK) {
 				target_thread->return_error2 =
@@ -1276,9 +2057,11 @@ static void binder_send_failed_reply(struct binder_transaction *t,
 					      target_thread->proc->pid,
 					      target_thread->pid);
 
-				binder_pop_transaction(target_thread, t);
+				binder_pop_transaction_ilocked(target_thread, t);
 				target_thread->return_error = error_code;
 				wake_up_interruptible(&target_thread->wait);
+				binder_inner_unlock(target_thread->proc);
+				binder_free_transaction(t);
 			} else {
 				binder_debug(BINDER_DEBUG_TOP_ERRORS,
 					"binder: reply failed, target "
@@ -1286,6 +2069,7 @@ static void binder_send_failed_reply(struct binder_transaction *t,
 					"already\n", target_thread->proc->pid,
 					target_thread->pid,
 					target_thread->return_error);
+				binder_inner_unlock(target_thread->proc);
 			}
 			return;
 		} else {
@@ -1296,7 +2080,7 @@ static void binder_send_failed_reply(struct binder_transaction *t,
 				     "for transaction %d, target dead\n",
 				     t->debug_id);
 
-			binder_pop_transaction(target_thread, t);
+			binder_free_transaction(t);
 			if (next == NULL) {
 				binder_debug(BINDER_DEBUG_DEAD_BINDER,
 					     "binder: reply failed,"
@@ -1311,6 +2095,7 @@ static void binder_send_failed_reply(struct binder_transaction *t,
 	}
 }
 
+/* The caller must hold proc->outer_lock. */
 static void binder_transaction_buffer_release(struct binder_proc *proc,
 					      struct binder_buffer *buffer,
 					      size_t *failed_at)
@@ -1347,9 +2132,12 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 		switch (fp->type) {
 		case BINDER_TYPE_BINDER:
 		case BINDER_TYPE_WEAK_BINDER: {
-			struct binder_node *node = binder_get_node(proc,
-								fp->binder);
+			struct binder_node *node;
+
+			binder_inner_lock(proc);
+			node = binder_get_node_ilocked(proc, fp->binder);
 			if (node == NULL) {
+				binder_inner_unlock(proc);
 				binder_debug(BINDER_DEBUG_TOP_ERRORS,
 					"binder: transaction release %d"
 				       " bad node %p\n", debug_id, fp->binder);
@@ -1358,8 +2146,9 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 			binder_debug(BINDER_DEBUG_TRANSACTION,
 				     "        node %d u%p\n",
 				     node->debug_id, node->ptr);
-			binder_dec_node(node, fp->type == BINDER_TYPE_BINDER,
-									0);
+			binder_dec_node_ilocked(node,
+					fp->type == BINDER_TYPE_BINDER, 0);
+			binder_inner_unlock(proc);
 		} break;
 		case BINDER_TYPE_HANDLE:
 		case BINDER_TYPE_WEAK_HANDLE: {
@@ -1386,6 +2175,10 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 				task_close_fd(proc, fp->handle);
 			break;
 
+		case BINDER_TYPE_PTR:
+			/* the copy is freed with the buffer */
+			break;
+
 		default:
 			binder_debug(BINDER_DEBUG_TOP_ERRORS,
 				"binder: transaction release %d bad "
@@ -1397,11 +2190,13 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 
 static void binder_transaction(struct binder_proc *proc,
 			       struct binder_thread *thread,
-			       struct binder_transaction_data *tr, int reply)
+			       struct binder_transaction_data *tr, int reply,
+			       size_t extra_buffers_size)
 {
 	struct binder_transaction *t;
 	struct binder_work *tcomplete;
-	size_t *offp, *off_end;
+	size_t *offp, *off_end, *sg_offp;
+	uint8_t *sg_bufp, *sg_buf_end;
 	struct binder_proc *target_proc;
 	struct binder_thread *target_thread = NULL;
 	struct binder_node *target_node = NULL;
@@ -1420,16 +2215,18 @@ static void binder_transaction(struct binder_proc *proc,
 	e->offsets_size = tr->offsets_size;
 
 	if (reply) {
+		binder_inner_lock(proc);
 		in_reply_to = thread->transaction_stack;
 		if (in_reply_to == NULL) {
+			binder_inner_unlock(proc);
 			binder_user_error("binder: %d:%d got reply transaction "
 					  "with no transaction stack\n",
 					  proc->pid, thread->pid);
 			return_error = BR_FAILED_REPLY;
 			goto err_empty_call_stack;
 		}
-		binder_set_nice(in_reply_to->saved_priority);
 		if (in_reply_to->to_thread != thread) {
+			binder_inner_unlock(proc);
 			binder_user_error("binder: %d:%d got reply transaction "
 				"with bad transaction stack,"
 				" transaction %d has target %d:%d\n",
@@ -1443,11 +2240,14 @@ static void binder_transaction(struct binder_proc *proc,
 			goto err_bad_call_stack;
 		}
 		thread->transaction_stack = in_reply_to->to_parent;
+		binder_inner_unlock(proc);
+		binder_set_priority(in_reply_to->saved_priority);
 		target_thread = in_reply_to->from;
 		if (target_thread == NULL) {
 			return_error = BR_DEAD_REPLY;
 			goto err_dead_binder;
 		}
+		binder_inner_lock(target_thread->proc);
 		if (target_thread->transaction_stack != in_reply_to) {
 			binder_user_error("binder: %d:%d got reply transaction "
 				"with bad target transaction stack %d, "
@@ -1456,17 +2256,22 @@ static void binder_transaction(struct binder_proc *proc,
 				target_thread->transaction_stack ?
 				target_thread->transaction_stack->debug_id : 0,
 				in_reply_to->debug_id);
+			binder_inner_unlock(target_thread->proc);
 			return_error = BR_FAILED_REPLY;
 			in_reply_to = NULL;
 			target_thread = NULL;
 			goto err_dead_binder;
 		}
+		binder_inner_unlock(target_thread->proc);
 		target_proc = target_thread->proc;
 	} else {
 		if (tr->target.handle) {
 			struct binder_ref *ref;
+
+			binder_outer_lock(proc);
 			ref = binder_get_ref(proc, tr->target.handle);
 			if (ref == NULL) {
+				binder_outer_unlock(proc);
 				binder_user_error("binder: %d:%d got "
 					"transaction to invalid handle\n",
 					proc->pid, thread->pid);
@@ -1474,12 +2279,15 @@ static void binder_transaction(struct binder_proc *proc,
 				goto err_invalid_target_handle;
 			}
 			target_node = ref->node;
+			binder_inc_node(target_node, 1, 0, NULL);
+			binder_outer_unlock(proc);
 		} else {
 			target_node = binder_context_mgr_node;
 			if (target_node == NULL) {
 				return_error = BR_DEAD_REPLY;
 				goto err_no_context_mgr_node;
 			}
+			binder_inc_node(target_node, 1, 0, NULL);
 		}
 		e->to_node = target_node->debug_id;
 		target_proc = target_node->proc;
@@ -1487,10 +2295,12 @@ static void binder_transaction(struct binder_proc *proc,
 			return_error = BR_DEAD_REPLY;
 			goto err_dead_binder;
 		}
+		binder_inner_lock(proc);
 		if (!(tr->flags & TF_ONE_WAY) && thread->transaction_stack) {
 			struct binder_transaction *tmp;
 			tmp = thread->transaction_stack;
 			if (tmp->to_thread != thread) {
+				binder_inner_unlock(proc);
 				binder_user_error("binder: %d:%d got new "
 					"transaction with bad transaction stack"
 					", transaction %d has target %d:%d\n",
@@ -1507,6 +2317,7 @@ static void binder_transaction(struct binder_proc *proc,
 				tmp = tmp->from_parent;
 			}
 		}
+		binder_inner_unlock(proc);
 	}
 	if (target_thread) {
 		e->to_thread = target_thread->pid;
@@ -1533,7 +2344,7 @@ static void binder_transaction(struct binder_proc *proc,
 	}
 	binder_stats_created(BINDER_STAT_TRANSACTION_COMPLETE);
 
-	t->debug_id = ++binder_last_id;
+	t->debug_id = atomic_inc_return(&binder_last_id);
 	e->debug_id = t->debug_id;
 
 	if (reply)
@@ -1562,19 +2373,20 @@ static void binder_transaction(struct binder_proc *proc,
 	t->to_thread = target_thread;
 	t->code = tr->code;
 	t->flags = tr->flags;
-	t->priority = task_nice(current);
+	binder_get_priority(current, &t->priority);
+	if (!reply && !(t->flags & TF_ONE_WAY))
+		t->start_ns = ktime_to_ns(ktime_get());
 	t->buffer = binder_alloc_buf(target_proc, tr->data_size,
-		tr->offsets_size, !reply && (t->flags & TF_ONE_WAY));
+		tr->offsets_size, extra_buffers_size,
+		!reply && (t->flags & TF_ONE_WAY));
 	if (t->buffer == NULL) {
 		return_error = BR_FAILED_REPLY;
 		goto err_binder_alloc_buf_failed;
 	}
-	t->buffer->allow_user_free = 0;
 	t->buffer->debug_id = t->debug_id;
 	t->buffer->transaction = t;
+	/* the reference taken on target_node now belongs to the buffer */
 	t->buffer->target_node = target_node;
-	if (target_node)
-		binder_inc_node(target_node, 1, 0, NULL);
 
 	offp = (size_t *)(t->buffer->data + ALIGN(tr->data_size, sizeof(void *)));
 
@@ -1595,9 +2407,52 @@ static void binder_transaction(struct binder_proc *proc,
 			"invalid offsets size, %zd\n",
 			proc->pid, thread->pid, tr->offsets_size);
 		return_error = BR_FAILED_REPLY;
-		goto err_bad_offset;
+		goto err_bad_offsets_size;
 	}
 	off_end = (void *)offp + tr->offsets_size;
+
+	/*
+	 * Gather the buffer objects into the space after the offsets before
+	 * taking any locks.  Invalid offsets are skipped here and rejected by
+	 * the translation loop below.
+	 */
+	sg_bufp = (uint8_t *)offp + ALIGN(tr->offsets_size, sizeof(void *));
+	sg_buf_end = sg_bufp + ALIGN(extra_buffers_size, sizeof(void *));
+	for (sg_offp = offp; sg_offp < off_end; sg_offp++) {
+		struct binder_buffer_object *bp;
+
+		if (*sg_offp > t->buffer->data_size - sizeof(*bp) ||
+		    t->buffer->data_size < sizeof(*bp) ||
+		    !IS_ALIGNED(*sg_offp, sizeof(void *)))
+			continue;
+		bp = (struct binder_buffer_object *)(t->buffer->data +
+						     *sg_offp);
+		if (bp->type != BINDER_TYPE_PTR)
+			continue;
+		if (bp->flags || bp->length > sg_buf_end - sg_bufp) {
+			binder_user_error("binder: %d:%d got transaction with "
+				"invalid buffer object, flags %lx length %zd, "
+				"%zd left\n", proc->pid, thread->pid,
+				bp->flags, bp->length,
+				(size_t)(sg_buf_end - sg_bufp));
+			return_error = BR_FAILED_REPLY;
+			goto err_bad_buffer_object;
+		}
+		if (copy_from_user(sg_bufp, bp->buffer, bp->length)) {
+			binder_user_error("binder: %d:%d got transaction with "
+				"invalid buffer object ptr\n",
+				proc->pid, thread->pid);
+			return_error = BR_FAILED_REPLY;
+			goto err_copy_buffer_object_failed;
+		}
+		binder_debug(BINDER_DEBUG_TRANSACTION,
+			     "        buffer %p size %zd -> %p\n", bp->buffer,
+			     bp->length, sg_bufp);
+		bp->buffer = sg_bufp + target_proc->user_buffer_offset;
+		sg_bufp += ALIGN(bp->length, sizeof(void *));
+	}
+
+	binder_outer_lock_pair(proc, target_proc);
 	for (; offp < off_end; offp++) {
 		struct flat_binder_object *fp;
 		if (*offp > t->buffer->data_size - sizeof(*fp) ||
@@ -1634,10 +2489,13 @@ static void binder_transaction(struct binder_proc *proc,
 					proc->pid, thread->pid,
 					fp->binder, node->debug_id,
 					fp->cookie, node->cookie);
+				binder_put_node(node);
+				return_error = BR_FAILED_REPLY;
 				goto err_binder_get_ref_for_node_failed;
 			}
 			ref = binder_get_ref_for_node(target_proc, node);
 			if (ref == NULL) {
+				binder_put_node(node);
 				return_error = BR_FAILED_REPLY;
 				goto err_binder_get_ref_for_node_failed;
 			}
@@ -1653,6 +2511,7 @@ static void binder_transaction(struct binder_proc *proc,
 				     "        node %d u%p -> ref %d desc %d\n",
 				     node->debug_id, node->ptr, ref->debug_id,
 				     ref->desc);
+			binder_put_node(node);
 		} break;
 		case BINDER_TYPE_HANDLE:
 		case BINDER_TYPE_WEAK_HANDLE: {
@@ -1749,6 +2608,10 @@ static void binder_transaction(struct binder_proc *proc,
 			fp->handle = target_fd;
 		} break;
 
+		case BINDER_TYPE_PTR:
+			/* already gathered above */
+			break;
+
 		default:
 			binder_user_error("binder: %d:%d got transactio"
 				"n with invalid object type, %lx\n",
@@ -1757,15 +2620,33 @@ static void binder_transaction(struct binder_proc *proc,
 			goto err_bad_object_type;
 		}
 	}
-	if (reply) {
-		BUG_ON(t->buffer->async_transaction != 0);
-		binder_pop_transaction(target_thread, in_reply_to);
-	} else if (!(t->flags & TF_ONE_WAY)) {
+	binder_outer_unlock_pair(proc, target_proc);
+
+	t->work.type = BINDER_WORK_TRANSACTION;
+	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
+
+	/*
+	 * Queue the completion and push the transaction on our own stack
+	 * before the target can see it, so that a fast reply can neither
+	 * overtake BR_TRANSACTION_COMPLETE nor miss the stack entry.
+	 */
+	binder_inner_lock(proc);
+	list_add_tail(&tcomplete->entry, &thread->todo);
+	if (reply)
+		binder_account_reply_ilocked(proc, in_reply_to);
+	if (!reply && !(t->flags & TF_ONE_WAY)) {
 		BUG_ON(t->buffer->async_transaction != 0);
 		t->need_reply = 1;
 		t->from_parent = thread->transaction_stack;
 		thread->transaction_stack = t;
-	} else {
+	}
+	binder_inner_unlock(proc);
+
+	binder_inner_lock(target_proc);
+	if (reply) {
+		BUG_ON(t->buffer->async_transaction != 0);
+		binder_pop_transaction_ilocked(target_thread, in_reply_to);
+	} else if (t->flags & TF_ONE_WAY) {
 		BUG_ON(target_node == NULL);
 		BUG_ON(t->buffer->async_transaction != 1);
 		if (target_node->has_async_transaction) {
@@ -1774,12 +2655,22 @@ static void binder_transaction(struct binder_proc *proc,
 		} else
 			target_node->has_async_transaction = 1;
 	}
-	t->work.type = BINDER_WORK_TRANSACTION;
 	list_add_tail(&t->work.entry, target_list);
-	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
-	list_add_tail(&tcomplete->entry, &thread->todo);
-	if (target_wait)
-		wake_up_interruptible(target_wait);
+	trace_binder_transaction(reply, t, target_node);
+	if (target_wait) {
+		/*
+		 * The sender of a synchronous transaction or reply is about
+		 * to block in binder_thread_read, so let the scheduler run
+		 * the target on this cpu.
+		 */
+		if (reply || !(t->flags & TF_ONE_WAY))
+			wake_up_interruptible_sync(target_wait);
+		else
+			wake_up_interruptible(target_wait);
+	}
+	binder_inner_unlock(target_proc);
+	if (reply)
+		binder_free_transaction(in_reply_to);
 	return;
 
 err_get_unused_fd_failed:
@@ -1790,8 +2681,19 @@ err_binder_get_ref_failed:
 err_binder_new_node_failed:
 err_bad_object_type:
 err_bad_offset:
+	binder_transaction_buffer_release(target_proc, t->buffer, offp);
+	binder_outer_unlock_pair(proc, target_proc);
+	goto err_free_buf;
+err_bad_buffer_object:
+err_copy_buffer_object_failed:
+err_bad_offsets_size:
 err_copy_data_failed:
+	binder_outer_lock(target_proc);
 	binder_transaction_buffer_release(target_proc, t->buffer, offp);
+	binder_outer_unlock(target_proc);
+err_free_buf:
+	/* the buffer release dropped the reference on target_node */
+	target_node = NULL;
 	t->buffer->transaction = NULL;
 	binder_free_buf(target_proc, t->buffer);
 err_binder_alloc_buf_failed:
@@ -1806,6 +2708,8 @@ err_empty_call_stack:
 err_dead_binder:
 err_invalid_target_handle:
 err_no_context_mgr_node:
+	if (target_node)
+		binder_dec_node(target_node, 1, 0);
 	binder_debug(BINDER_DEBUG_FAILED_TRANSACTION,
 		     "binder: %d:%d transaction failed %d, size %zd-%zd\n",
 		     proc->pid, thread->pid, return_error,
@@ -1817,12 +2721,15 @@ err_no_context_mgr_node:
 		*fe = *e;
 	}
 
+	binder_inner_lock(proc);
 	BUG_ON(thread->return_error != BR_OK);
-	if (in_reply_to) {
+	if (in_reply_to)
 		thread->return_error = BR_TRANSACTION_COMPLETE;
-		binder_send_failed_reply(in_reply_to, return_error);
-	} else
+	else
 		thread->return_error = return_error;
+	binder_inner_unlock(proc);
+	if (in_reply_to)
+		binder_send_failed_reply(in_reply_to, return_error);
 }
 
 int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
@@ -1837,9 +2744,9 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			return -EFAULT;
 		ptr += sizeof(uint32_t);
 		if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.bc)) {
-			binder_stats.bc[_IOC_NR(cmd)]++;
-			proc->stats.bc[_IOC_NR(cmd)]++;
-			thread->stats.bc[_IOC_NR(cmd)]++;
+			atomic_inc(&binder_stats.bc[_IOC_NR(cmd)]);
+			atomic_inc(&proc->stats.bc[_IOC_NR(cmd)]);
+			atomic_inc(&thread->stats.bc[_IOC_NR(cmd)]);
 		}
 		switch (cmd) {
 		case BC_INCREFS:
@@ -1853,6 +2760,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (get_user(target, (uint32_t __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
+			binder_outer_lock(proc);
 			if (target == 0 && binder_context_mgr_node &&
 			    (cmd == BC_INCREFS || cmd == BC_ACQUIRE)) {
 				ref = binder_get_ref_for_node(proc,
@@ -1868,6 +2776,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			} else
 				ref = binder_get_ref(proc, target);
 			if (ref == NULL) {
+				binder_outer_unlock(proc);
 				binder_user_error("binder: %d:%d refcou"
 					"nt change on invalid ref %d\n",
 					proc->pid, thread->pid, target);
@@ -1898,6 +2807,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				     debug_string, ref->debug_id, ref->desc,
 				     ref->strong, ref->weak,
 				     ref->node->debug_id);
+			binder_outer_unlock(proc);
 			break;
 		}
 		case BC_INCREFS_DONE:
@@ -1912,8 +2822,10 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (get_user(cookie, (void * __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(void *);
-			node = binder_get_node(proc, node_ptr);
+			binder_inner_lock(proc);
+			node = binder_get_node_ilocked(proc, node_ptr);
 			if (node == NULL) {
+				binder_inner_unlock(proc);
 				binder_user_error("binder: %d:%d "
 					"%s u%p no match\n",
 					proc->pid, thread->pid,
@@ -1924,6 +2836,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				break;
 			}
 			if (cookie != node->cookie) {
+				binder_inner_unlock(proc);
 				binder_user_error("binder: %d:%d %s u%p node %d"
 					" cookie mismatch %p != %p\n",
 					proc->pid, thread->pid,
@@ -1935,6 +2848,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			}
 			if (cmd == BC_ACQUIRE_DONE) {
 				if (node->pending_strong_ref == 0) {
+					binder_inner_unlock(proc);
 					binder_user_error("binder: %d:%d "
 						"BC_ACQUIRE_DONE node %d has "
 						"no pending acquire request\n",
@@ -1945,6 +2859,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				node->pending_strong_ref = 0;
 			} else {
 				if (node->pending_weak_ref == 0) {
+					binder_inner_unlock(proc);
 					binder_user_error("binder: %d:%d "
 						"BC_INCREFS_DONE node %d has "
 						"no pending increfs request\n",
@@ -1954,7 +2869,6 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				}
 				node->pending_weak_ref = 0;
 			}
-			binder_dec_node(node, cmd == BC_ACQUIRE_DONE, 0);
 			binder_debug(BINDER_DEBUG_USER_REFS,
 				     "binder: %d:%d %s node %d ls %d lw %d\n",
 				     proc->pid, thread->pid,
@@ -1962,6 +2876,8 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 							: "BC_ACQUIRE_DONE",
 				     node->debug_id, node->local_strong_refs,
 							node->local_weak_refs);
+			binder_dec_node_ilocked(node, cmd == BC_ACQUIRE_DONE, 0);
+			binder_inner_unlock(proc);
 			break;
 		}
 		case BC_ATTEMPT_ACQUIRE:
@@ -1981,20 +2897,28 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				return -EFAULT;
 			ptr += sizeof(void *);
 
+			binder_alloc_lock(proc);
 			buffer = binder_buffer_lookup(proc, data_ptr);
 			if (buffer == NULL) {
+				binder_alloc_unlock(proc);
 				binder_user_error("binder: %d:%d "
 					"BC_FREE_BUFFER u%p no match\n",
 					proc->pid, thread->pid, data_ptr);
 				break;
 			}
 			if (!buffer->allow_user_free) {
+				binder_alloc_unlock(proc);
 				binder_user_error("binder: %d:%d "
 					"BC_FREE_BUFFER u%p matched "
 					"unreturned buffer\n",
 					proc->pid, thread->pid, data_ptr);
 				break;
 			}
+			/* claim it, so a racing free of the same ptr fails */
+			buffer->allow_user_free = 0;
+			binder_alloc_unlock(proc);
+
+			binder_inner_lock(proc);
 			binder_debug(BINDER_DEBUG_FREE_BUFFER,
 				     "binder: %d:%d BC_FREE_BUFFER u%p found"
 				     " buffer %d for %s transaction\n",
@@ -2013,7 +2937,10 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				else
 					list_move_tail(buffer->target_node->async_todo.next, &thread->todo);
 			}
+			binder_inner_unlock(proc);
+			binder_outer_lock(proc);
 			binder_transaction_buffer_release(proc, buffer, NULL);
+			binder_outer_unlock(proc);
 			binder_free_buf(proc, buffer);
 			break;
 		}
@@ -2025,7 +2952,19 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (copy_from_user(&tr, ptr, sizeof(tr)))
 				return -EFAULT;
 			ptr += sizeof(tr);
-			binder_transaction(proc, thread, &tr, cmd == BC_REPLY);
+			binder_transaction(proc, thread, &tr, cmd == BC_REPLY, 0);
+			break;
+		}
+
+		case BC_TRANSACTION_SG:
+		case BC_REPLY_SG: {
+			struct binder_transaction_data_sg tr;
+
+			if (copy_from_user(&tr, ptr, sizeof(tr)))
+				return -EFAULT;
+			ptr += sizeof(tr);
+			binder_transaction(proc, thread, &tr.transaction_data,
+					   cmd == BC_REPLY_SG, tr.buffers_size);
 			break;
 		}
 
@@ -2033,6 +2972,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			binder_debug(BINDER_DEBUG_THREADS,
 				     "binder: %d:%d BC_REGISTER_LOOPER\n",
 				     proc->pid, thread->pid);
+			binder_inner_lock(proc);
 			if (thread->looper & BINDER_LOOPER_STATE_ENTERED) {
 				thread->looper |= BINDER_LOOPER_STATE_INVALID;
 				binder_user_error("binder: %d:%d ERROR:"
@@ -2050,11 +2990,14 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				proc->requested_threads_started++;
 			}
 			thread->looper |= BINDER_LOOPER_STATE_REGISTERED;
+			binder_get_priority(current, &thread->looper_priority);
+			binder_inner_unlock(proc);
 			break;
 		case BC_ENTER_LOOPER:
 			binder_debug(BINDER_DEBUG_THREADS,
 				     "binder: %d:%d BC_ENTER_LOOPER\n",
 				     proc->pid, thread->pid);
+			binder_inner_lock(proc);
 			if (thread->looper & BINDER_LOOPER_STATE_REGISTERED) {
 				thread->looper |= BINDER_LOOPER_STATE_INVALID;
 				binder_user_error("binder: %d:%d ERROR:"
@@ -2063,12 +3006,16 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					proc->pid, thread->pid);
 			}
 			thread->looper |= BINDER_LOOPER_STATE_ENTERED;
+			binder_get_priority(current, &thread->looper_priority);
+			binder_inner_unlock(proc);
 			break;
 		case BC_EXIT_LOOPER:
 			binder_debug(BINDER_DEBUG_THREADS,
 				     "binder: %d:%d BC_EXIT_LOOPER\n",
 				     proc->pid, thread->pid);
+			binder_inner_lock(proc);
 			thread->looper |= BINDER_LOOPER_STATE_EXITED;
+			binder_inner_unlock(proc);
 			break;
 
 		case BC_REQUEST_DEATH_NOTIFICATION:
@@ -2084,8 +3031,10 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (get_user(cookie, (void __user * __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(void *);
+			binder_outer_lock(proc);
 			ref = binder_get_ref(proc, target);
 			if (ref == NULL) {
+				binder_outer_unlock(proc);
 				binder_user_error("binder: %d:%d %s "
 					"invalid ref %d\n",
 					proc->pid, thread->pid,
@@ -2114,11 +3063,15 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"FICATION death notific"
 						"ation already set\n",
 						proc->pid, thread->pid);
+					binder_outer_unlock(proc);
 					break;
 				}
 				death = kzalloc(sizeof(*death), GFP_KERNEL);
 				if (death == NULL) {
+					binder_outer_unlock(proc);
+					binder_inner_lock(proc);
 					thread->return_error = BR_ERROR;
+					binder_inner_unlock(proc);
 					binder_debug(
 						BINDER_DEBUG_FAILED_TRANSACTION,
 						"binder: %d:%d "
@@ -2133,12 +3086,14 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				ref->death = death;
 				if (ref->node->proc == NULL) {
 					ref->death->work.type = BINDER_WORK_DEAD_BINDER;
+					binder_inner_lock(proc);
 					if (thread->looper & (BINDER_LOOPER_STATE_REGISTERED | BINDER_LOOPER_STATE_ENTERED)) {
 						list_add_tail(&ref->death->work.entry, &thread->todo);
 					} else {
 						list_add_tail(&ref->death->work.entry, &proc->todo);
 						wake_up_interruptible(&proc->wait);
 					}
+					binder_inner_unlock(proc);
 				}
 			} else {
 				if (ref->death == NULL) {
@@ -2147,6 +3102,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"CATION death notificat"
 						"ion not active\n",
 						proc->pid, thread->pid);
+					binder_outer_unlock(proc);
 					break;
 				}
 				death = ref->death;
@@ -2158,9 +3114,11 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"%p != %p\n",
 						proc->pid, thread->pid,
 						death->cookie, cookie);
+					binder_outer_unlock(proc);
 					break;
 				}
 				ref->death = NULL;
+				binder_inner_lock(proc);
 				if (list_empty(&death->work.entry)) {
 					death->work.type = BINDER_WORK_CLEAR_DEATH_NOTIFICATION;
 					if (thread->looper & (BINDER_LOOPER_STATE_REGISTERED | BINDER_LOOPER_STATE_ENTERED)) {
@@ -2173,7 +3131,9 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					BUG_ON(death->work.type != BINDER_WORK_DEAD_BINDER);
 					death->work.type = BINDER_WORK_DEAD_BINDER_AND_CLEAR;
 				}
+				binder_inner_unlock(proc);
 			}
+			binder_outer_unlock(proc);
 		} break;
 		case BC_DEAD_BINDER_DONE: {
 			struct binder_work *w;
@@ -2183,6 +3143,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				return -EFAULT;
 
 			ptr += sizeof(void *);
+			binder_inner_lock(proc);
 			list_for_each_entry(w, &proc->delivered_death, entry) {
 				struct binder_ref_death *tmp_death = container_of(w, struct binder_ref_death, work);
 				if (tmp_death->cookie == cookie) {
@@ -2194,6 +3155,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				     "binder: %d:%d BC_DEAD_BINDER_DONE %p found %p\n",
 				     proc->pid, thread->pid, cookie, death);
 			if (death == NULL) {
+				binder_inner_unlock(proc);
 				binder_user_error("binder: %d:%d BC_DEAD"
 					"_BINDER_DONE %p not found\n",
 					proc->pid, thread->pid, cookie);
@@ -2210,6 +3172,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					wake_up_interruptible(&proc->wait);
 				}
 			}
+			binder_inner_unlock(proc);
 		} break;
 
 		default:
@@ -2227,9 +3190,9 @@ void binder_stat_br(struct binder_proc *proc, struct binder_thread *thread,
 		    uint32_t cmd)
 {
 	if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.br)) {
-		binder_stats.br[_IOC_NR(cmd)]++;
-		proc->stats.br[_IOC_NR(cmd)]++;
-		thread->stats.br[_IOC_NR(cmd)]++;
+		atomic_inc(&binder_stats.br[_IOC_NR(cmd)]);
+		atomic_inc(&proc->stats.br[_IOC_NR(cmd)]);
+		atomic_inc(&thread->stats.br[_IOC_NR(cmd)]);
 	}
 }
 
@@ -2256,6 +3219,9 @@ static int binder_thread_read(struct binder_proc *proc,
 
 	int ret = 0;
 	int wait_for_proc_work;
+	struct binder_priority prio;
+	int set_prio = 0;
+	int spawn = 0;
 
 	if (*consumed == 0) {
 		if (put_user(BR_NOOP, (uint32_t __user *)ptr))
@@ -2264,22 +3230,27 @@ static int binder_thread_read(struct binder_proc *proc,
 	}
 
 retry:
+	binder_inner_lock(proc);
 	wait_for_proc_work = thread->transaction_stack == NULL &&
 				list_empty(&thread->todo);
 
 	if (thread->return_error != BR_OK && ptr < end) {
+		uint32_t errors[2];
+		size_t n = 0;
+
 		if (thread->return_error2 != BR_OK) {
-			if (put_user(thread->return_error2, (uint32_t __user *)ptr))
-				return -EFAULT;
-			ptr += sizeof(uint32_t);
-			if (ptr == end)
-				goto done;
+			errors[n++] = thread->return_error2;
 			thread->return_error2 = BR_OK;
 		}
-		if (put_user(thread->return_error, (uint32_t __user *)ptr))
+		if (ptr + n * sizeof(uint32_t) < end) {
+			errors[n++] = thread->return_error;
+			thread->return_error = BR_OK;
+		}
+		binder_inner_unlock(proc);
+		if (copy_to_user(ptr, errors, n * sizeof(uint32_t)))
 			return -EFAULT;
-		ptr += sizeof(uint32_t);
-		thread->return_error = BR_OK;
+		ptr += n * sizeof(uint32_t);
+		binder_inner_lock(proc);
 		goto done;
 	}
 
@@ -2287,7 +3258,8 @@ retry:
 	thread->looper |= BINDER_LOOPER_STATE_WAITING;
 	if (wait_for_proc_work)
 		proc->ready_threads++;
-	mutex_unlock(&binder_lock);
+	binder_inner_unlock(proc);
+	up_read(&binder_main_lock);
 	if (wait_for_proc_work) {
 		if (!(thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
 					BINDER_LOOPER_STATE_ENTERED))) {
@@ -2298,7 +3270,7 @@ retry:
 			wait_event_interruptible(binder_user_error_wait,
 						 binder_stop_on_user_error < 2);
 		}
-		binder_set_nice(proc->default_priority);
+		binder_set_priority(thread->looper_priority);
 		if (non_block) {
 			if (!binder_has_proc_work(proc, thread))
 				ret = -EAGAIN;
@@ -2311,27 +3283,41 @@ retry:
 		} else
 			ret = wait_event_interruptible(thread->wait, binder_has_thread_work(thread));
 	}
-	mutex_lock(&binder_lock);
+	binder_main_lock_read();
+	binder_inner_lock(proc);
 	if (wait_for_proc_work)
 		proc->ready_threads--;
 	thread->looper &= ~BINDER_LOOPER_STATE_WAITING;
 
-	if (ret)
+	if (ret) {
+		binder_inner_unlock(proc);
 		return ret;
+	}
 
+	/*
+	 * Each work item is turned into a return command and taken off its
+	 * list under the inner lock, then copied to user space without it.
+	 */
 	while (1) {
-		uint32_t cmd;
+		uint32_t cmd = BR_NOOP;
 		struct binder_transaction_data tr;
 		struct binder_work *w;
 		struct binder_transaction *t = NULL;
+		void *ptrs[2];
+		void *payload = NULL;
+		size_t payload_size = 0;
+		int t_prio = 0;
+		int stop = 0;
 
 		if (!list_empty(&thread->todo))
 			w = list_first_entry(&thread->todo, struct binder_work, entry);
 		else if (!list_empty(&proc->todo) && wait_for_proc_work)
 			w = list_first_entry(&proc->todo, struct binder_work, entry);
 		else {
-			if (ptr - buffer == 4 && !(thread->looper & BINDER_LOOPER_STATE_NEED_RETURN)) /* no data added */
+			if (ptr - buffer == 4 && !(thread->looper & BINDER_LOOPER_STATE_NEED_RETURN)) { /* no data added */
+				binder_inner_unlock(proc);
 				goto retry;
+			}
 			break;
 		}
 
@@ -2344,11 +3330,6 @@ retry:
 		} break;
 		case BINDER_WORK_TRANSACTION_COMPLETE: {
 			cmd = BR_TRANSACTION_COMPLETE;
-			if (put_user(cmd, (uint32_t __user *)ptr))
-				return -EFAULT;
-			ptr += sizeof(uint32_t);
-
-			binder_stat_br(proc, thread, cmd);
 			binder_debug(BINDER_DEBUG_TRANSACTION_COMPLETE,
 				     "binder: %d:%d BR_TRANSACTION_COMPLETE\n",
 				     proc->pid, thread->pid);
@@ -2359,7 +3340,6 @@ retry:
 		} break;
 		case BINDER_WORK_NODE: {
 			struct binder_node *node = container_of(w, struct binder_node, work);
-			uint32_t cmd = BR_NOOP;
 			const char *cmd_name;
 			int strong = node->internal_strong_refs || node->local_strong_refs;
 			int weak = !hlist_empty(&node->refs) || node->local_weak_refs || strong;
@@ -2385,23 +3365,17 @@ retry:
 				node->has_weak_ref = 0;
 			}
 			if (cmd != BR_NOOP) {
-				if (put_user(cmd, (uint32_t __user *)ptr))
-					return -EFAULT;
-				ptr += sizeof(uint32_t);
-				if (put_user(node->ptr, (void * __user *)ptr))
-					return -EFAULT;
-				ptr += sizeof(void *);
-				if (put_user(node->cookie, (void * __user *)ptr))
-					return -EFAULT;
-				ptr += sizeof(void *);
-
-				binder_stat_br(proc, thread, cmd);
+				/* the work stays queued until nothing changes */
+				ptrs[0] = node->ptr;
+				ptrs[1] = node->cookie;
+				payload = ptrs;
+				payload_size = sizeof(ptrs);
 				binder_debug(BINDER_DEBUG_USER_REFS,
 					     "binder: %d:%d %s %d u%p c%p\n",
 					     proc->pid, thread->pid, cmd_name, node->debug_id, node->ptr, node->cookie);
 			} else {
 				list_del_init(&w->entry);
-				if (!weak && !strong) {
+				if (!weak && !strong && !node->tmp_refs) {
 					binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 						     "binder: %d:%d node %d u%p c%p deleted\n",
 						     proc->pid, thread->pid, node->debug_id,
@@ -2421,19 +3395,15 @@ retry:
 		case BINDER_WORK_DEAD_BINDER_AND_CLEAR:
 		case BINDER_WORK_CLEAR_DEATH_NOTIFICATION: {
 			struct binder_ref_death *death;
-			uint32_t cmd;
 
 			death = container_of(w, struct binder_ref_death, work);
 			if (w->type == BINDER_WORK_CLEAR_DEATH_NOTIFICATION)
 				cmd = BR_CLEAR_DEATH_NOTIFICATION_DONE;
 			else
 				cmd = BR_DEAD_BINDER;
-			if (put_user(cmd, (uint32_t __user *)ptr))
-				return -EFAULT;
-			ptr += sizeof(uint32_t);
-			if (put_user(death->cookie, (void * __user *)ptr))
-				return -EFAULT;
-			ptr += sizeof(void *);
+			ptrs[0] = death->cookie;
+			payload = ptrs;
+			payload_size = sizeof(void *);
 			binder_debug(BINDER_DEBUG_DEATH_NOTIFICATION,
 				     "binder: %d:%d %s %p\n",
 				      proc->pid, thread->pid,
@@ -2448,26 +3418,21 @@ retry:
 				binder_stats_deleted(BINDER_STAT_DEATH);
 			} else
 				list_move(&w->entry, &proc->delivered_death);
-			if (cmd == BR_DEAD_BINDER)
-				goto done; /* DEAD_BINDER notifications can cause transactions */
+			/* DEAD_BINDER notifications can cause transactions */
+			stop = cmd == BR_DEAD_BINDER;
 		} break;
 		}
 
 		if (!t)
-			continue;
+			goto copy;
 
 		BUG_ON(t->buffer == NULL);
 		if (t->buffer->target_node) {
 			struct binder_node *target_node = t->buffer->target_node;
 			tr.target.ptr = target_node->ptr;
 			tr.cookie =  target_node->cookie;
-			t->saved_priority = task_nice(current);
-			if (t->priority < target_node->min_priority &&
-			    !(t->flags & TF_ONE_WAY))
-				binder_set_nice(t->priority);
-			else if (!(t->flags & TF_ONE_WAY) ||
-				 t->saved_priority > target_node->min_priority)
-				binder_set_nice(target_node->min_priority);
+			t_prio = binder_transaction_priority(t, target_node,
+							     &prio);
 			cmd = BR_TRANSACTION;
 		} else {
 			tr.target.ptr = NULL;
@@ -2494,14 +3459,6 @@ retry:
 					ALIGN(t->buffer->data_size,
 					    sizeof(void *));
 
-		if (put_user(cmd, (uint32_t __user *)ptr))
-			return -EFAULT;
-		ptr += sizeof(uint32_t);
-		if (copy_to_user(ptr, &tr, sizeof(tr)))
-			return -EFAULT;
-		ptr += sizeof(tr);
-
-		binder_stat_br(proc, thread, cmd);
 		binder_debug(BINDER_DEBUG_TRANSACTION,
 			     "binder: %d:%d %s %d %d:%d, cmd %d"
 			     "size %zd-%zd ptr %p-%p\n",
@@ -2513,7 +3470,11 @@ retry:
 			     t->buffer->data_size, t->buffer->offsets_size,
 			     tr.data.ptr.buffer, tr.data.ptr.offsets);
 
+		/* applied once the inner lock is dropped */
+		set_prio = t_prio;
+
 		list_del(&t->work.entry);
+		trace_binder_transaction_received(t);
 		t->buffer->allow_user_free = 1;
 		if (cmd == BR_TRANSACTION && !(t->flags & TF_ONE_WAY)) {
 			t->to_parent = thread->transaction_stack;
@@ -2524,7 +3485,26 @@ retry:
 			kfree(t);
 			binder_stats_deleted(BINDER_STAT_TRANSACTION);
 		}
-		break;
+		payload = &tr;
+		payload_size = sizeof(tr);
+		stop = 1;
+
+copy:
+		if (cmd == BR_NOOP)
+			continue;
+
+		binder_inner_unlock(proc);
+		if (put_user(cmd, (uint32_t __user *)ptr))
+			goto err_fault;
+		ptr += sizeof(uint32_t);
+		if (payload_size && copy_to_user(ptr, payload, payload_size))
+			goto err_fault;
+		ptr += payload_size;
+		binder_stat_br(proc, thread, cmd);
+		binder_inner_lock(proc);
+
+		if (stop)
+			break;
 	}
 
 done:
@@ -2539,10 +3519,20 @@ done:
 		binder_debug(BINDER_DEBUG_THREADS,
 			     "binder: %d:%d BR_SPAWN_LOOPER\n",
 			     proc->pid, thread->pid);
-		if (put_user(BR_SPAWN_LOOPER, (uint32_t __user *)buffer))
-			return -EFAULT;
+		spawn = 1;
 	}
+	binder_inner_unlock(proc);
+	if (set_prio)
+		binder_set_priority(prio);
+	if (spawn && put_user(BR_SPAWN_LOOPER, (uint32_t __user *)buffer))
+		return -EFAULT;
 	return 0;
+
+err_fault:
+	/* the work was already dequeued, as with a full read buffer */
+	if (set_prio)
+		binder_set_priority(prio);
+	return -EFAULT;
 }
 
 static void binder_release_work(struct list_head *list)
@@ -2570,7 +3560,8 @@ static void binder_release_work(struct list_head *list)
 
 }
 
-static struct binder_thread *binder_get_thread(struct binder_proc *proc)
+static struct binder_thread *binder_get_thread_ilocked(
+		struct binder_proc *proc, struct binder_thread *new_thread)
 {
 	struct binder_thread *thread = NULL;
 	struct rb_node *parent = NULL;
@@ -2585,23 +3576,44 @@ static struct binder_thread *binder_get_thread(struct binder_proc *proc)
 		else if (current->pid > thread->pid)
 			p = &(*p)->rb_right;
 		else
-			break;
-	}
-	if (*p == NULL) {
-		thread = kzalloc(sizeof(*thread), GFP_KERNEL);
-		if (thread == NULL)
-			return NULL;
-		binder_stats_created(BINDER_STAT_THREAD);
-		thread->proc = proc;
-		thread->pid = current->pid;
-		init_waitqueue_head(&thread->wait);
-		INIT_LIST_HEAD(&thread->todo);
-		rb_link_node(&thread->rb_node, parent, p);
-		rb_insert_color(&thread->rb_node, &proc->threads);
-		thread->looper |= BINDER_LOOPER_STATE_NEED_RETURN;
-		thread->return_error = BR_OK;
-		thread->return_error2 = BR_OK;
+			return thread;
 	}
+	if (new_thread == NULL)
+		return NULL;
+	thread = new_thread;
+	binder_stats_created(BINDER_STAT_THREAD);
+	thread->proc = proc;
+	thread->pid = current->pid;
+	init_waitqueue_head(&thread->wait);
+	INIT_LIST_HEAD(&thread->todo);
+	rb_link_node(&thread->rb_node, parent, p);
+	rb_insert_color(&thread->rb_node, &proc->threads);
+	thread->looper |= BINDER_LOOPER_STATE_NEED_RETURN;
+	thread->return_error = BR_OK;
+	thread->return_error2 = BR_OK;
+	binder_get_priority(current, &thread->looper_priority);
+	return thread;
+}
+
+static struct binder_thread *binder_get_thread(struct binder_proc *proc)
+{
+	struct binder_thread *thread;
+	struct binder_thread *new_thread;
+
+	binder_inner_lock(proc);
+	thread = binder_get_thread_ilocked(proc, NULL);
+	binder_inner_unlock(proc);
+	if (thread)
+		return thread;
+
+	new_thread = kzalloc(sizeof(*thread), GFP_KERNEL);
+	if (new_thread == NULL)
+		return NULL;
+	binder_inner_lock(proc);
+	thread = binder_get_thread_ilocked(proc, new_thread);
+	binder_inner_unlock(proc);
+	if (thread != new_thread)
+		kfree(new_thread);
 	return thread;
 }
 
@@ -2612,6 +3624,7 @@ static int binder_free_thread(struct binder_proc *proc,
 	struct binder_transaction *send_reply = NULL;
 	int active_transactions = 0;
 
+	binder_inner_lock(proc);
 	rb_erase(&thread->rb_node, &proc->threads);
 	t = thread->transaction_stack;
 	if (t && t->to_thread == thread)
@@ -2638,6 +3651,7 @@ static int binder_free_thread(struct binder_proc *proc,
 		} else
 			BUG();
 	}
+	binder_inner_unlock(proc);
 	if (send_reply)
 		binder_send_failed_reply(send_reply, BR_DEAD_REPLY);
 	binder_release_work(&thread->todo);
@@ -2653,12 +3667,18 @@ static unsigned int binder_poll(struct file *filp,
 	struct binder_thread *thread = NULL;
 	int wait_for_proc_work;
 
-	mutex_lock(&binder_lock);
+	binder_main_lock_read();
 	thread = binder_get_thread(proc);
+	if (thread == NULL) {
+		up_read(&binder_main_lock);
+		return POLLERR;
+	}
 
+	binder_inner_lock(proc);
 	wait_for_proc_work = thread->transaction_stack == NULL &&
 		list_empty(&thread->todo) && thread->return_error == BR_OK;
-	mutex_unlock(&binder_lock);
+	binder_inner_unlock(proc);
+	up_read(&binder_main_lock);
 
 	if (wait_for_proc_work) {
 		if (binder_has_proc_work(proc, thread))
@@ -2683,6 +3703,7 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	struct binder_thread *thread;
 	unsigned int size = _IOC_SIZE(cmd);
 	void __user *ubuf = (void __user *)arg;
+	int exclusive;
 
 	/*binder_debug(BINDER_DEBUG_TOP_ERRORS, "binder_ioctl: %d:%d %x %lx\n",
 					proc->pid, current->pid, cmd, arg);*/
@@ -2692,7 +3713,12 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	if (ret)
 		return ret;
 
-	mutex_lock(&binder_lock);
+	/* these tear down or replace objects other threads may be using */
+	exclusive = cmd == BINDER_THREAD_EXIT || cmd == BINDER_SET_CONTEXT_MGR;
+	if (exclusive)
+		binder_main_lock_write();
+	else
+		binder_main_lock_read();
 	thread = binder_get_thread(proc);
 	if (thread == NULL) {
 		ret = -ENOMEM;
@@ -2744,13 +3770,18 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		}
 		break;
 	}
-	case BINDER_SET_MAX_THREADS:
-		if (copy_from_user(&proc->max_threads, ubuf,
-					sizeof(proc->max_threads))) {
+	case BINDER_SET_MAX_THREADS: {
+		int max_threads;
+
+		if (copy_from_user(&max_threads, ubuf, sizeof(max_threads))) {
 			ret = -EINVAL;
 			goto err;
 		}
+		binder_inner_lock(proc);
+		proc->max_threads = max_threads;
+		binder_inner_unlock(proc);
 		break;
+	}
 	case BINDER_SET_CONTEXT_MGR:
 		if (binder_context_mgr_node != NULL) {
 			binder_debug(BINDER_DEBUG_TOP_ERRORS,
@@ -2770,7 +3801,9 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 			}
 		} else
 			binder_context_mgr_uid = current->cred->euid;
+		binder_outer_lock(proc);
 		binder_context_mgr_node = binder_new_node(proc, NULL, NULL);
+		binder_outer_unlock(proc);
 		if (binder_context_mgr_node == NULL) {
 			ret = -ENOMEM;
 			goto err;
@@ -2779,6 +3812,7 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		binder_context_mgr_node->local_strong_refs++;
 		binder_context_mgr_node->has_strong_ref = 1;
 		binder_context_mgr_node->has_weak_ref = 1;
+		binder_context_mgr_node->tmp_refs--;
 		break;
 	case BINDER_THREAD_EXIT:
 		binder_debug(BINDER_DEBUG_THREADS, "binder: %d:%d exit\n",
@@ -2802,9 +3836,15 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	}
 	ret = 0;
 err:
-	if (thread)
+	if (thread) {
+		binder_inner_lock(proc);
 		thread->looper &= ~BINDER_LOOPER_STATE_NEED_RETURN;
-	mutex_unlock(&binder_lock);
+		binder_inner_unlock(proc);
+	}
+	if (exclusive)
+		up_write(&binder_main_lock);
+	else
+		up_read(&binder_main_lock);
 	wait_event_interruptible(binder_user_error_wait, binder_stop_on_user_error < 2);
 	if (ret && ret != -ERESTARTSYS)
 		binder_debug(BINDER_DEBUG_TOP_ERRORS,
@@ -2844,6 +3884,7 @@ static struct vm_operations_struct binder_vm_ops = {
 static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 {
 	int ret;
+	int i;
 	struct vm_struct *area;
 	struct binder_proc *proc = filp->private_data;
 	const char *failure_string;
@@ -2897,6 +3938,12 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 		goto err_alloc_pages_failed;
 	}
 	proc->buffer_size = vma->vm_end - vma->vm_start;
+	for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
+		INIT_LIST_HEAD(&proc->pages[i].lru);
+		proc->pages[i].proc = proc;
+	}
+	for (i = 0; i < BINDER_SIZE_CLASSES; i++)
+		INIT_LIST_HEAD(&proc->size_class[i]);
 
 	vma->vm_ops = &binder_vm_ops;
 	vma->vm_private_data = proc;
@@ -2948,16 +3995,18 @@ static int binder_open(struct inode *nodp, struct file *filp)
 		return -ENOMEM;
 	get_task_struct(current);
 	proc->tsk = current;
+	mutex_init(&proc->outer_lock);
+	mutex_init(&proc->alloc_lock);
+	mutex_init(&proc->inner_lock);
 	INIT_LIST_HEAD(&proc->todo);
 	init_waitqueue_head(&proc->wait);
-	proc->default_priority = task_nice(current);
-	mutex_lock(&binder_lock);
+	binder_main_lock_write();
 	binder_stats_created(BINDER_STAT_PROC);
 	hlist_add_head(&proc->proc_node, &binder_procs);
 	proc->pid = current->group_leader->pid;
 	INIT_LIST_HEAD(&proc->delivered_death);
 	filp->private_data = proc;
-	mutex_unlock(&binder_lock);
+	up_write(&binder_main_lock);
 
 	if (binder_debugfs_dir_entry_proc) {
 		char strbuf[11];
@@ -3070,12 +4119,14 @@ static void binder_deferred_release(struct binder_proc *proc)
 		}
 	}
 	outgoing_refs = 0;
+	binder_outer_lock(proc);
 	while ((n = rb_first(&proc->refs_by_desc))) {
 		struct binder_ref *ref = rb_entry(n, struct binder_ref,
 						  rb_node_desc);
 		outgoing_refs++;
 		binder_delete_ref(ref);
 	}
+	binder_outer_unlock(proc);
 	binder_release_work(&proc->todo);
 	buffers = 0;
 
@@ -3101,8 +4152,21 @@ static void binder_deferred_release(struct binder_proc *proc)
 	page_count = 0;
 	if (proc->pages) {
 		int i;
+
+		/* Take our pages away from the shrinker before freeing them */
+		binder_alloc_lock(proc);
+		spin_lock(&binder_lru_lock);
+		for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
+			if (!list_empty(&proc->pages[i].lru)) {
+				list_del_init(&proc->pages[i].lru);
+				binder_lru_pages--;
+			}
+		}
+		spin_unlock(&binder_lru_lock);
+		binder_alloc_unlock(proc);
+
 		for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
-			if (proc->pages[i]) {
+			if (proc->pages[i].page_ptr) {
 				void *page_addr = proc->buffer + i * PAGE_SIZE;
 				binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 					     "binder_release: %d: "
@@ -3111,7 +4175,7 @@ static void binder_deferred_release(struct binder_proc *proc)
 					     page_addr);
 				unmap_kernel_range((unsigned long)page_addr,
 					PAGE_SIZE);
-				__free_page(proc->pages[i]);
+				__free_page(proc->pages[i].page_ptr);
 				page_count++;
 			}
 		}
@@ -3119,6 +4183,13 @@ static void binder_deferred_release(struct binder_proc *proc)
 		vfree(proc->buffer);
 	}
 
+	while ((n = rb_first(&proc->code_latency))) {
+		struct binder_code_latency *cl = rb_entry(n,
+				struct binder_code_latency, rb_node);
+		rb_erase(&cl->rb_node, &proc->code_latency);
+		kfree(cl);
+	}
+
 	put_task_struct(proc->tsk);
 
 	binder_debug(BINDER_DEBUG_OPEN_CLOSE,
@@ -3138,7 +4209,7 @@ static void binder_deferred_func(struct work_struct *work)
 
 	int defer;
 	do {
-		mutex_lock(&binder_lock);
+		binder_main_lock_write();
 		mutex_lock(&binder_deferred_lock);
 		if (!hlist_empty(&binder_deferred_list)) {
 			proc = hlist_entry(binder_deferred_list.first,
@@ -3165,7 +4236,7 @@ static void binder_deferred_func(struct work_struct *work)
 		if (defer & BINDER_DEFERRED_RELEASE)
 			binder_deferred_release(proc); /* frees proc */
 
-		mutex_unlock(&binder_lock);
+		up_write(&binder_main_lock);
 		if (files)
 			put_files_struct(files);
 	} while (proc);
@@ -3189,13 +4260,14 @@ static void print_binder_transaction(struct seq_file *m, const char *prefix,
 				     struct binder_transaction *t)
 {
 	seq_printf(m,
-		   "%s %d: %p from %d:%d to %d:%d code %x flags %x pri %ld r%d",
+		   "%s %d: %p from %d:%d to %d:%d code %x flags %x pri %u:%d r%d",
 		   prefix, t->debug_id, t,
 		   t->from ? t->from->proc->pid : 0,
 		   t->from ? t->from->pid : 0,
 		   t->to_proc ? t->to_proc->pid : 0,
 		   t->to_thread ? t->to_thread->pid : 0,
-		   t->code, t->flags, t->priority, t->need_reply);
+		   t->code, t->flags, t->priority.sched_policy,
+		   t->priority.prio, t->need_reply);
 	if (t->buffer == NULL) {
 		seq_puts(m, " buffer free\n");
 		return;
@@ -3397,7 +4469,9 @@ static const char *binder_command_strings[] = {
 	"BC_EXIT_LOOPER",
 	"BC_REQUEST_DEATH_NOTIFICATION",
 	"BC_CLEAR_DEATH_NOTIFICATION",
-	"BC_DEAD_BINDER_DONE"
+	"BC_DEAD_BINDER_DONE",
+	"BC_TRANSACTION_SG",
+	"BC_REPLY_SG"
 };
 
 static const char *binder_objstat_strings[] = {
@@ -3418,17 +4492,21 @@ static void print_binder_stats(struct seq_file *m, const char *prefix,
 	BUILD_BUG_ON(ARRAY_SIZE(stats->bc) !=
 		     ARRAY_SIZE(binder_command_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->bc); i++) {
-		if (stats->bc[i])
+		int temp = atomic_read(&stats->bc[i]);
+
+		if (temp)
 			seq_printf(m, "%s%s: %d\n", prefix,
-				   binder_command_strings[i], stats->bc[i]);
+				   binder_command_strings[i], temp);
 	}
 
 	BUILD_BUG_ON(ARRAY_SIZE(stats->br) !=
 		     ARRAY_SIZE(binder_return_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->br); i++) {
-		if (stats->br[i])
+		int temp = atomic_read(&stats->br[i]);
+
+		if (temp)
 			seq_printf(m, "%s%s: %d\n", prefix,
-				   binder_return_strings[i], stats->br[i]);
+				   binder_return_strings[i], temp);
 	}
 
 	BUILD_BUG_ON(ARRAY_SIZE(stats->obj_created) !=
@@ -3436,12 +4514,59 @@ static void print_binder_stats(struct seq_file *m, const char *prefix,
 	BUILD_BUG_ON(ARRAY_SIZE(stats->obj_created) !=
 		     ARRAY_SIZE(stats->obj_deleted));
 	for (i = 0; i < ARRAY_SIZE(stats->obj_created); i++) {
-		if (stats->obj_created[i] || stats->obj_deleted[i])
+		int created = atomic_read(&stats->obj_created[i]);
+		int deleted = atomic_read(&stats->obj_deleted[i]);
+
+		if (created || deleted)
 			seq_printf(m, "%s%s: active %d total %d\n", prefix,
 				binder_objstat_strings[i],
-				stats->obj_created[i] - stats->obj_deleted[i],
-				stats->obj_created[i]);
+				created - deleted, created);
+	}
+}
+
+static const char *binder_lock_class_strings[] = {
+	"main",
+	"outer",
+	"alloc",
+	"inner",
+	"dead_nodes"
+};
+
+static void print_binder_lock_stats(struct seq_file *m)
+{
+	int i;
+
+	BUILD_BUG_ON(ARRAY_SIZE(binder_lock_contended) !=
+		     ARRAY_SIZE(binder_lock_class_strings));
+	seq_puts(m, "lock contention:\n");
+	for (i = 0; i < ARRAY_SIZE(binder_lock_contended); i++)
+		seq_printf(m, "  %s: %d\n", binder_lock_class_strings[i],
+			   atomic_read(&binder_lock_contended[i]));
+}
+
+static void print_binder_proc_page_stats(struct seq_file *m,
+					 struct binder_proc *proc)
+{
+	int i;
+	int active = 0;
+	int lru = 0;
+	int free = 0;
+
+	if (proc->pages == NULL)
+		return;
+
+	binder_alloc_lock(proc);
+	for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
+		if (proc->pages[i].page_ptr == NULL)
+			free++;
+		else if (list_empty(&proc->pages[i].lru))
+			active++;
+		else
+			lru++;
 	}
+	seq_printf(m, "  pages: %d:%d:%d\n", active, lru, free);
+	seq_printf(m, "  parked buffer space: %zd\n", proc->size_class_bytes);
+	binder_alloc_unlock(proc);
 }
 
 static void print_binder_proc_stats(struct seq_file *m,
@@ -3481,6 +4606,7 @@ static void print_binder_proc_stats(struct seq_file *m,
 	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
 		count++;
 	seq_printf(m, "  buffers: %d\n", count);
+	print_binder_proc_page_stats(m, proc);
 
 	count = 0;
 	list_for_each_entry(w, &proc->todo, entry) {
@@ -3506,7 +4632,7 @@ static int binder_state_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		binder_main_lock_write();
 
 	seq_puts(m, "binder state:\n");
 
@@ -3518,7 +4644,7 @@ static int binder_state_show(struct seq_file *m, void *unused)
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc(m, proc, 1);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		up_write(&binder_main_lock);
 	return 0;
 }
 
@@ -3529,16 +4655,71 @@ static int binder_stats_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		binder_main_lock_write();
 
 	seq_puts(m, "binder stats:\n");
 
 	print_binder_stats(m, "", &binder_stats);
+	print_binder_lock_stats(m);
+	seq_printf(m, "lru pages: %d\nlru pages reclaimed: %d\n",
+		   binder_lru_pages, atomic_read(&binder_lru_reclaimed));
 
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc_stats(m, proc);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		up_write(&binder_main_lock);
+	return 0;
+}
+
+static void print_binder_latency_hist(struct seq_file *m, const char *prefix,
+				      struct binder_latency_hist *hist)
+{
+	int i;
+
+	seq_printf(m, "%scount %u avg %lluus max %lluus:", prefix,
+		   hist->count,
+		   hist->count ? div_u64(div_u64(hist->total_ns, hist->count),
+					 NSEC_PER_USEC) : 0ULL,
+		   div_u64(hist->max_ns, NSEC_PER_USEC));
+	for (i = 0; i < BINDER_LATENCY_BUCKETS; i++)
+		seq_printf(m, " %u", hist->bucket[i]);
+	seq_puts(m, "\n");
+}
+
+static int binder_transaction_latency_show(struct seq_file *m, void *unused)
+{
+	struct binder_proc *proc;
+	struct hlist_node *pos;
+	struct rb_node *n;
+	int do_lock = !binder_debug_no_lock;
+	int i;
+
+	if (do_lock)
+		binder_main_lock_write();
+
+	seq_puts(m, "binder transaction latency:\nbuckets (us): <1");
+	for (i = 1; i < BINDER_LATENCY_BUCKETS - 1; i++)
+		seq_printf(m, " <%u", 1U << i);
+	seq_printf(m, " >=%u\n", 1U << (BINDER_LATENCY_BUCKETS - 2));
+
+	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
+		if (!proc->latency.count)
+			continue;
+		seq_printf(m, "proc %d\n", proc->pid);
+		print_binder_latency_hist(m, "  all: ", &proc->latency);
+		for (n = rb_first(&proc->code_latency); n != NULL;
+		     n = rb_next(n)) {
+			struct binder_code_latency *cl = rb_entry(n,
+					struct binder_code_latency, rb_node);
+			char prefix[32];
+
+			snprintf(prefix, sizeof(prefix), "  code 0x%x: ",
+				 cl->code);
+			print_binder_latency_hist(m, prefix, &cl->hist);
+		}
+	}
+	if (do_lock)
+		up_write(&binder_main_lock);
 	return 0;
 }
 
@@ -3549,13 +4730,13 @@ static int binder_transactions_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		binder_main_lock_write();
 
 	seq_puts(m, "binder transactions:\n");
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc(m, proc, 0);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		up_write(&binder_main_lock);
 	return 0;
 }
 
@@ -3565,11 +4746,11 @@ static int binder_proc_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		binder_main_lock_write();
 	seq_puts(m, "binder proc state:\n");
 	print_binder_proc(m, proc, 1);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		up_write(&binder_main_lock);
 	return 0;
 }
 
@@ -3617,6 +4798,7 @@ static struct miscdevice binder_miscdev = {
 BINDER_DEBUG_ENTRY(state);
 BINDER_DEBUG_ENTRY(stats);
 BINDER_DEBUG_ENTRY(transactions);
+BINDER_DEBUG_ENTRY(transaction_latency);
 BINDER_DEBUG_ENTRY(transaction_log);
 
 static int __init binder_init(void)
@@ -3632,6 +4814,8 @@ static int __init binder_init(void)
 		binder_debugfs_dir_entry_proc = debugfs_create_dir("proc",
 						 binder_debugfs_dir_entry_root);
 	ret = misc_register(&binder_miscdev);
+	if (!ret)
+		register_shrinker(&binder_shrinker);
 	if (binder_debugfs_dir_entry_root) {
 		debugfs_create_file("state",
 				    S_IRUGO,
@@ -3648,6 +4832,11 @@ static int __init binder_init(void)
 				    binder_debugfs_dir_entry_root,
 				    NULL,
 				    &binder_transactions_fops);
+		debugfs_create_file("transaction_latency",
+				    S_IRUGO,
+				    binder_debugfs_dir_entry_root,
+				    NULL,
+				    &binder_transaction_latency_fops);
 		debugfs_create_file("transaction_log",
 				    S_IRUGO,
 				    binder_debugfs_dir_entry_root,
@@ -32,6 +32,7 @@ enum {
 	BINDER_TYPE_HANDLE	= B_PACK_CHARS('s', 'h', '*', B_TYPE_LARGE),
 	BINDER_TYPE_WEAK_HANDLE	= B_PACK_CHARS('w', 'h', '*', B_TYPE_LARGE),
 	BINDER_TYPE_FD		= B_PACK_CHARS('f', 'd', '*', B_TYPE_LARGE),
+	BINDER_TYPE_PTR		= B_PACK_CHARS('p', 't', '*', B_TYPE_LARGE),
 };
 
 enum {
@@ -61,6 +62,21 @@ struct flat_binder_object {
 	void			*cookie;
 };
 
+/*
+ * A buffer object describes a block of the sender's memory that is not
+ * part of the flattened data.  It may only be sent with BC_TRANSACTION_SG
+ * or BC_REPLY_SG.  The driver copies 'length' bytes from 'buffer' straight
+ * into the target's transaction buffer, after the offsets array.  It then
+ * rewrites 'buffer' to the address of the copy in the target.  The copy is
+ * released along with the rest of the transaction by BC_FREE_BUFFER.
+ */
+struct binder_buffer_object {
+	unsigned long		type;	/* BINDER_TYPE_PTR */
+	unsigned long		flags;	/* must be 0 */
+	void			*buffer;
+	size_t			length;
+};
+
 /*
  * On 64-bit platforms where user code may run in 32-bits the driver must
  * translate the buffer (and local binder) addresses apropriately.
@@ -147,6 +163,12 @@ struct binder_transaction_data {
 	} data;
 };
 
+struct binder_transaction_data_sg {
+	struct binder_transaction_data transaction_data;
+	/* total size of the buffer objects, each aligned to a pointer */
+	size_t		buffers_size;
+};
+
 struct binder_ptr_cookie {
 	void *ptr;
 	void *cookie;
@@ -324,6 +346,13 @@ enum BinderDriverCommandProtocol {
 	/*
 	 * void *: cookie
 	 */
+
+	BC_TRANSACTION_SG = _IOW('c', 17, struct binder_transaction_data_sg),
+	BC_REPLY_SG = _IOW('c', 18, struct binder_transaction_data_sg),
+	/*
+	 * binder_transaction_data_sg: the sent command, with room for
+	 * the BINDER_TYPE_PTR buffer objects it contains.
+	 */
 };
 
 #endif /* _LINUX_BINDER_H */
@@ -25,16 +25,54 @@
 #include <linux/poll.h>
 #include <linux/slab.h>
 #include <linux/time.h>
+#include <linux/percpu.h>
+#include <linux/mm.h>
+#include <linux/workqueue.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
 
+/* size of each of the two buffers of a per-cpu staging area */
+#define LOGGER_STAGE_SIZE	(2 * PAGE_SIZE)
+
+/* longest time an entry stays staged when nobody reads the log */
+#define LOGGER_FLUSH_DELAY	(HZ / 20)
+
+/*
+ * struct logger_stage - per-cpu staging area for writers
+ *
+ * Writers append complete entries to the active buffer of the stage of the
+ * cpu they run on, holding only the stage's 'mutex', so writers on
+ * different cpus never contend.  Entries are padded to 4 bytes.  Holding
+ * log->mutex, logger_drain_stages() swaps the active and inactive buffers
+ * of all stages at once and merges the inactive ones into the ring buffer
+ * in write order.  The inactive buffer and 'drain_off' belong to whoever
+ * holds log->mutex.
+ */
+struct logger_stage {
+	struct mutex		mutex;	/* protects 'active' and its buffer */
+	unsigned char		*buf[2];
+	size_t			used[2];
+	int			active;
+	size_t			drain_off; /* next entry to merge */
+};
+
+/*
+ * struct logger_staged_entry - an entry in a staging buffer.  The clock
+ * only ticks once a jiffy, so the merge orders entries by 'seq' and the
+ * timestamp is just reported.
+ */
+struct logger_staged_entry {
+	u32			seq;	/* position in the log's write order */
+	struct logger_entry	entry;
+};
+
 /*
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
  * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * mutex 'mutex', except for the per-cpu staging areas.
  */
 struct logger_log {
 	unsigned char 		*buffer;/* the ring buffer itself */
@@ -45,6 +83,9 @@ struct logger_log {
 	size_t			w_off;	/* current write head offset */
 	size_t			head;	/* new readers start here */
 	size_t			size;	/* size of the log */
+	struct logger_stage __percpu *stages; /* writers' staging areas */
+	struct delayed_work	flush_work; /* drains idle stages */
+	atomic_t		seq;	/* write order of staged entries */
 };
 
 /*
@@ -230,6 +271,8 @@ static size_t get_next_entry_by_uid(struct logger_log *log,
 	return off;
 }
 
+static void logger_drain_stages(struct logger_log *log);
+
 /*
  * logger_read - our log's read() method
  *
@@ -255,6 +298,7 @@ start:
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
 		mutex_lock(&log->mutex);
+		logger_drain_stages(log);
 		ret = (log->w_off == reader->r_off);
 		mutex_unlock(&log->mutex);
 		if (!ret)
@@ -300,6 +344,30 @@ start:
 	/* get exactly one entry from the log */
 	ret = do_read_log_to_user(log, reader, buf, ret);
 
+	/* batching readers get as many more whole entries as fit */
+	if (reader->r_ver >= LOGGER_BATCH_VERSION) {
+		logger_drain_stages(log);
+		while (ret > 0) {
+			ssize_t len, nr;
+
+			if (!reader->r_all)
+				reader->r_off = get_next_entry_by_uid(log,
+					reader->r_off, current_euid());
+			if (log->w_off == reader->r_off)
+				break;
+
+			len = get_user_hdr_len(reader->r_ver) +
+				get_entry_msg_len(log, reader->r_off);
+			if (count - ret < len)
+				break;
+
+			nr = do_read_log_to_user(log, reader, buf + ret, len);
+			if (nr < 0)
+				break;
+			ret += nr;
+		}
+	}
+
 out:
 	mutex_unlock(&log->mutex);
 
@@ -384,30 +452,134 @@ static void do_write_log(struct logger_log *log, const void *buf, size_t count)
 
 }
 
+/* stage_entry_len - space taken by 'entry' in a staging buffer */
+static inline size_t stage_entry_len(struct logger_entry *entry)
+{
+	return ALIGN(sizeof(struct logger_staged_entry) + entry->len, 4);
+}
+
+/* staged_before - was 'a' written before 'b'? */
+static inline int staged_before(struct logger_staged_entry *a,
+				struct logger_staged_entry *b)
+{
+	return (s32)(a->seq - b->seq) < 0;
+}
+
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
+ * logger_drain_stages - moves the entries of all per-cpu staging areas into
+ * the ring buffer in the order they were written, even by a thread that
+ * moved between cpus.
  *
- * The caller needs to hold log->mutex.
+ * All stages are swapped while holding every stage lock, and entries are
+ * numbered under their stage lock, so everything drained was written
+ * before anything left staged and consecutive drains stay in order.
  *
- * Returns 'count' on success, negative error code on failure.
+ * The caller needs to hold log->mutex.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
-				      const void __user *buf, size_t count)
+static void logger_drain_stages(struct logger_log *log)
 {
-	size_t len;
+	struct logger_stage *stage, *oldest;
+	struct logger_staged_entry *entry, *oldest_entry;
+	int cpu, pending = 0;
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
-		return -EFAULT;
+	/*
+	 * Racy peek: a writer we miss wakes the readers and arms the flush
+	 * after it unlocks the stage, so the entry is drained later.
+	 */
+	for_each_possible_cpu(cpu) {
+		stage = per_cpu_ptr(log->stages, cpu);
+		if (stage->used[stage->active])
+			pending++;
+	}
+	if (!pending)
+		return;
 
-	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
-			return -EFAULT;
+	for_each_possible_cpu(cpu) {
+		stage = per_cpu_ptr(log->stages, cpu);
+		mutex_lock_nest_lock(&stage->mutex, &log->mutex);
+	}
+	for_each_possible_cpu(cpu) {
+		stage = per_cpu_ptr(log->stages, cpu);
+		stage->active ^= 1;
+		stage->drain_off = 0;
+	}
+	for_each_possible_cpu(cpu) {
+		stage = per_cpu_ptr(log->stages, cpu);
+		mutex_unlock(&stage->mutex);
+	}
 
-	log->w_off = logger_offset(log->w_off + count);
+	for (;;) {
+		oldest = NULL;
+		oldest_entry = NULL;
+		for_each_possible_cpu(cpu) {
+			int inactive;
+
+			stage = per_cpu_ptr(log->stages, cpu);
+			inactive = stage->active ^ 1;
+			if (stage->drain_off >= stage->used[inactive])
+				continue;
+			entry = (struct logger_staged_entry *)
+				(stage->buf[inactive] + stage->drain_off);
+			if (!oldest || staged_before(entry, oldest_entry)) {
+				oldest = stage;
+				oldest_entry = entry;
+			}
+		}
+		if (!oldest)
+			break;
+
+		fix_up_readers(log, sizeof(struct logger_entry) +
+			       oldest_entry->entry.len);
+		do_write_log(log, &oldest_entry->entry,
+			     sizeof(struct logger_entry) +
+			     oldest_entry->entry.len);
+		oldest->drain_off += stage_entry_len(&oldest_entry->entry);
+	}
 
-	return count;
+	for_each_possible_cpu(cpu) {
+		stage = per_cpu_ptr(log->stages, cpu);
+		stage->used[stage->active ^ 1] = 0;
+		stage->drain_off = 0;
+	}
+}
+
+/*
+ * logger_flush_work - drains staged entries nobody read, so the ring
+ * buffer seen through mmap() and the size ioctls is never stale for long.
+ */
+static void logger_flush_work(struct work_struct *work)
+{
+	struct logger_log *log = container_of(to_delayed_work(work),
+					      struct logger_log, flush_work);
+
+	mutex_lock(&log->mutex);
+	logger_drain_stages(log);
+	mutex_unlock(&log->mutex);
+}
+
+/*
+ * logger_get_stage - returns the staging area of the current cpu, locked,
+ * with room for an entry of 'len' bytes.  Drains the staging areas into
+ * the ring buffer first if it is full.
+ */
+static struct logger_stage *logger_get_stage(struct logger_log *log,
+					     size_t len)
+{
+	struct logger_stage *stage;
+
+	for (;;) {
+		stage = per_cpu_ptr(log->stages, get_cpu());
+		put_cpu();
+
+		mutex_lock(&stage->mutex);
+		if (stage->used[stage->active] + len <= LOGGER_STAGE_SIZE)
+			return stage;
+		mutex_unlock(&stage->mutex);
+
+		mutex_lock(&log->mutex);
+		logger_drain_stages(log);
+		mutex_unlock(&log->mutex);
+	}
 }
 
 /*
@@ -419,17 +591,16 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
+	struct logger_stage *stage;
+	struct logger_staged_entry *staged;
 	struct logger_entry header;
 	struct timespec now;
+	unsigned char *buf;
 	ssize_t ret = 0;
-
-	now = current_kernel_time();
+	int first;
 
 	header.pid = current->tgid;
 	header.tid = current->pid;
-	header.sec = now.tv_sec;
-	header.nsec = now.tv_nsec;
 	header.euid = current_euid();
 	header.len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
 	header.hdr_size = sizeof(struct logger_entry);
@@ -438,41 +609,48 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
+	stage = logger_get_stage(log, stage_entry_len(&header));
 
-	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
-	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
+	now = current_kernel_time();
+	header.sec = now.tv_sec;
+	header.nsec = now.tv_nsec;
 
-	do_write_log(log, &header, sizeof(struct logger_entry));
+	staged = (struct logger_staged_entry *)
+		(stage->buf[stage->active] + stage->used[stage->active]);
+	/* number under the stage lock so each stage stays sorted */
+	staged->seq = atomic_inc_return(&log->seq);
+	memcpy(&staged->entry, &header, sizeof(struct logger_entry));
+	buf = (unsigned char *)staged->entry.msg;
 
 	while (nr_segs-- > 0) {
 		size_t len;
-		ssize_t nr;
 
 		/* figure out how much of this vector we can keep */
 		len = min_t(size_t, iov->iov_len, header.len - ret);
 
 		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
-		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
+		if (len && copy_from_user(buf + ret, iov->iov_base, len)) {
+			mutex_unlock(&stage->mutex);
+			return -EFAULT;
 		}
 
 		iov++;
-		ret += nr;
+		ret += len;
 	}
 
-	mutex_unlock(&log->mutex);
+	/* the entry only becomes visible to a drain here */
+	first = !stage->used[stage->active];
+	stage->used[stage->active] += stage_entry_len(&header);
+	mutex_unlock(&stage->mutex);
+
+	/* bound how long a staged entry can wait for a reader to drain it */
+	if (first)
+		schedule_delayed_work(&log->flush_work, LOGGER_FLUSH_DELAY);
 
 	/* wake up any blocked readers */
-	wake_up_interruptible(&log->wq);
+	smp_mb();
+	if (waitqueue_active(&log->wq))
+		wake_up_interruptible(&log->wq);
 
 	return ret;
 }
@@ -563,6 +741,7 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 	poll_wait(file, &log->wq, wait);
 
 	mutex_lock(&log->mutex);
+	logger_drain_stages(log);
 	if (!reader->r_all)
 		reader->r_off = get_next_entry_by_uid(log,
 			reader->r_off, current_euid());
@@ -580,13 +759,43 @@ static long logger_set_version(struct logger_reader *reader, void __user *arg)
 	if (copy_from_user(&version, arg, sizeof(int)))
 		return -EFAULT;
 
-	if ((version < 1) || (version > 2))
+	if ((version < 1) || (version > LOGGER_BATCH_VERSION))
 		return -EINVAL;
 
 	reader->r_ver = version;
 	return 0;
 }
 
+/*
+ * logger_commit_read - advances 'reader' past the window it consumed
+ * through its mapping of the log.
+ *
+ * The caller needs to hold log->mutex.
+ */
+static long logger_commit_read(struct logger_log *log,
+			       struct logger_reader *reader, void __user *arg)
+{
+	struct logger_read_window win;
+	size_t off;
+
+	if (copy_from_user(&win, arg, sizeof(win)))
+		return -EFAULT;
+
+	/* the writer lapped us, so the window may have been overwritten */
+	if (win.r_off != reader->r_off)
+		return -EOVERFLOW;
+
+	/* the new offset must be an entry boundary within the log */
+	for (off = reader->r_off; off != win.w_off;
+	     off = logger_offset(off + sizeof(struct logger_entry) +
+				 get_entry_msg_len(log, off)))
+		if (off == log->w_off)
+			return -EINVAL;
+
+	reader->r_off = off;
+	return 0;
+}
+
 static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
@@ -595,6 +804,7 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	void __user *argp = (void __user *) arg;
 
 	mutex_lock(&log->mutex);
+	logger_drain_stages(log);
 
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
@@ -654,6 +864,27 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		reader = file->private_data;
 		ret = logger_set_version(reader, argp);
 		break;
+	case LOGGER_GET_READ_WINDOW: {
+		struct logger_read_window win;
+
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		win.r_off = reader->r_off;
+		win.w_off = log->w_off;
+		ret = copy_to_user(argp, &win, sizeof(win)) ? -EFAULT : 0;
+		break;
+	}
+	case LOGGER_COMMIT_READ:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		ret = logger_commit_read(log, reader, argp);
+		break;
 	}
 
 	mutex_unlock(&log->mutex);
@@ -661,11 +892,60 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	return ret;
 }
 
+/*
+ * logger_mmap - the log's mmap file operation
+ *
+ * Maps the ring buffer read-only. The mapping exposes every entry, so it is
+ * only offered to readers that are not filtered by uid.
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_reader *reader;
+	struct logger_log *log;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	unsigned long off;
+	int ret;
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EBADF;
+
+	reader = file->private_data;
+	log = reader->log;
+
+	if (!reader->r_all || (vma->vm_flags & VM_WRITE))
+		return -EPERM;
+	if (vma->vm_pgoff || size > log->size)
+		return -EINVAL;
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	/*
+	 * The buffer is static, so it lives in module space when the
+	 * driver is built as a module: map it one page at a time.
+	 */
+	for (off = 0; off < size; off += PAGE_SIZE) {
+		void *addr = log->buffer + off;
+		struct page *page;
+
+		if (virt_addr_valid(addr))
+			page = virt_to_page(addr);
+		else
+			page = vmalloc_to_page(addr);
+
+		ret = vm_insert_page(vma, vma->vm_start + off, page);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
 static const struct file_operations logger_fops = {
 	.owner = THIS_MODULE,
 	.read = logger_read,
 	.aio_write = logger_aio_write,
 	.poll = logger_poll,
+	.mmap = logger_mmap,
 	.unlocked_ioctl = logger_ioctl,
 	.compat_ioctl = logger_ioctl,
 	.open = logger_open,
@@ -674,11 +954,12 @@ static const struct file_operations logger_fops = {
 
 /*
  * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
- * must be a power of two, and greater than
- * (LOGGER_ENTRY_MAX_PAYLOAD + sizeof(struct logger_entry)).
+ * must be a power of two, at least PAGE_SIZE, and greater than
+ * (LOGGER_ENTRY_MAX_PAYLOAD + sizeof(struct logger_entry)).  The buffer is
+ * page aligned so that it can be mapped by readers.
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
+static unsigned char _buf_ ## VAR[SIZE] __aligned(PAGE_SIZE); \
 static struct logger_log VAR = { \
 	.buffer = _buf_ ## VAR, \
 	.misc = { \
@@ -713,14 +994,59 @@ static struct logger_log *get_log_from_minor(int minor)
 	return NULL;
 }
 
+static void __init free_log_stages(struct logger_log *log)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct logger_stage *stage = per_cpu_ptr(log->stages, cpu);
+		kfree(stage->buf[0]);
+		kfree(stage->buf[1]);
+	}
+	free_percpu(log->stages);
+	log->stages = NULL;
+}
+
+static int __init init_log_stages(struct logger_log *log)
+{
+	int cpu;
+
+	log->stages = alloc_percpu(struct logger_stage);
+	if (!log->stages)
+		return -ENOMEM;
+	INIT_DELAYED_WORK(&log->flush_work, logger_flush_work);
+
+	for_each_possible_cpu(cpu) {
+		struct logger_stage *stage = per_cpu_ptr(log->stages, cpu);
+
+		mutex_init(&stage->mutex);
+		stage->buf[0] = kmalloc(LOGGER_STAGE_SIZE, GFP_KERNEL);
+		stage->buf[1] = kmalloc(LOGGER_STAGE_SIZE, GFP_KERNEL);
+		if (!stage->buf[0] || !stage->buf[1]) {
+			free_log_stages(log);
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
 static int __init init_log(struct logger_log *log)
 {
 	int ret;
 
+	ret = init_log_stages(log);
+	if (unlikely(ret)) {
+		printk(KERN_ERR "logger: failed to allocate staging "
+		       "buffers for log '%s'!\n", log->misc.name);
+		return ret;
+	}
+
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
 		       "device for log '%s'!\n", log->misc.name);
+		free_log_stages(log);
 		return ret;
 	}
 
@@ -58,6 +58,25 @@ struct logger_entry {
 
 #define LOGGER_ENTRY_MAX_PAYLOAD	4076
 
+/*
+ * Version 3 of the ABI uses the version 2 entry header, but read() fills
+ * the buffer with as many whole entries as fit instead of returning one.
+ */
+#define LOGGER_BATCH_VERSION		3
+
+/*
+ * Readers with access to every entry may also mmap() the ring buffer
+ * read-only and consume the entries in [r_off, w_off), which may wrap
+ * around the end of the buffer.  Hand the same window back through
+ * LOGGER_COMMIT_READ to advance the reader; it fails with EOVERFLOW if
+ * the writer lapped the reader meanwhile, in which case the entries just
+ * copied may have been overwritten.
+ */
+struct logger_read_window {
+	__u32		r_off;	/* offset of the reader's next entry */
+	__u32		w_off;	/* offset just past the newest entry */
+};
+
 #define __LOGGERIO	0xAE
 
 #define LOGGER_GET_LOG_BUF_SIZE		_IO(__LOGGERIO, 1) /* size of log */
@@ -66,5 +85,9 @@ struct logger_entry {
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
 #define LOGGER_GET_VERSION		_IO(__LOGGERIO, 5) /* abi version */
 #define LOGGER_SET_VERSION		_IO(__LOGGERIO, 6) /* abi version */
+#define LOGGER_GET_READ_WINDOW		_IOR(__LOGGERIO, 7, \
+					     struct logger_read_window)
+#define LOGGER_COMMIT_READ		_IOW(__LOGGERIO, 8, \
+					     struct logger_read_window)
 
 #endif /* _LINUX_LOGGER_H */
@@ -16,6 +16,12 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * The driver also grades memory pressure as none, low, medium or critical,
+ * from the efficiency of page reclaim and the trend of free and file pages,
+ * and reports it through /dev/mem_pressure. Reading the device returns the
+ * current level as one line, then end of file until the level changes;
+ * poll() signals POLLIN when the level changed since the last read.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -37,6 +43,14 @@
 #include <linux/notifier.h>
 #include <linux/memory.h>
 #include <linux/memory_hotplug.h>
+#include <linux/spinlock.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/uaccess.h>
+#include <linux/vmstat.h>
+#include <linux/swap.h>
+#include <linux/workqueue.h>
 
 static uint32_t lowmem_debug_level = 2;
 static int lowmem_adj[6] = {
@@ -64,6 +78,68 @@ static unsigned long lowmem_deathpending_timeout;
 			printk(x);			\
 	} while (0)
 
+/*
+ * Thread group leaders are kept in one list per oom_adj value, so victim
+ * selection only looks at processes at or above the adj level being killed.
+ * The index is maintained from fork, release, exec and oom_adj writes; it
+ * nests inside tasklist_lock.
+ */
+#define LOWMEM_ADJ_BUCKETS	(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+
+static struct hlist_head lowmem_index[LOWMEM_ADJ_BUCKETS];
+static DEFINE_SPINLOCK(lowmem_index_lock);
+
+static struct hlist_head *lowmem_bucket(int oom_adj)
+{
+	oom_adj = clamp(oom_adj, OOM_DISABLE, OOM_ADJUST_MAX);
+	return &lowmem_index[oom_adj - OOM_DISABLE];
+}
+
+void lowmem_index_add(struct task_struct *p)
+{
+	spin_lock(&lowmem_index_lock);
+	hlist_add_head(&p->lowmem_node, lowmem_bucket(p->signal->oom_adj));
+	spin_unlock(&lowmem_index_lock);
+}
+
+void lowmem_index_del(struct task_struct *p)
+{
+	spin_lock(&lowmem_index_lock);
+	hlist_del_init(&p->lowmem_node);
+	spin_unlock(&lowmem_index_lock);
+}
+
+void lowmem_index_replace(struct task_struct *old, struct task_struct *new)
+{
+	spin_lock(&lowmem_index_lock);
+	if (!hlist_unhashed(&old->lowmem_node)) {
+		hlist_add_before(&new->lowmem_node, &old->lowmem_node);
+		hlist_del_init(&old->lowmem_node);
+	}
+	spin_unlock(&lowmem_index_lock);
+}
+
+/*
+ * lowmem_index_update - moves the process of 'p' to the bucket of its
+ * current oom_adj. Called after oom_adj changes, without locks held.
+ */
+void lowmem_index_update(struct task_struct *p)
+{
+	struct task_struct *leader;
+
+	read_lock(&tasklist_lock);
+	leader = p->group_leader;
+	spin_lock(&lowmem_index_lock);
+	/* a released process is no longer indexed */
+	if (!hlist_unhashed(&leader->lowmem_node)) {
+		hlist_del(&leader->lowmem_node);
+		hlist_add_head(&leader->lowmem_node,
+			       lowmem_bucket(leader->signal->oom_adj));
+	}
+	spin_unlock(&lowmem_index_lock);
+	read_unlock(&tasklist_lock);
+}
+
 static int
 task_notify_func(struct notifier_block *self, unsigned long val, void *data);
 
@@ -82,6 +158,195 @@ task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 	return NOTIFY_OK;
 }
 
+enum lowmem_pressure_level {
+	LOWMEM_PRESSURE_NONE,
+	LOWMEM_PRESSURE_LOW,
+	LOWMEM_PRESSURE_MEDIUM,
+	LOWMEM_PRESSURE_CRITICAL,
+};
+
+static const char * const lowmem_pressure_names[] = {
+	"none", "low", "medium", "critical",
+};
+
+/* reclaim pressure, 100 - reclaimed * 100 / scanned, at each level */
+static uint32_t lowmem_pressure_medium = 60;
+static uint32_t lowmem_pressure_critical = 95;
+
+#define LOWMEM_PRESSURE_WINDOW	(HZ / 10)
+/* without reclaim activity for this long, pressure decays to none */
+#define LOWMEM_PRESSURE_EXPIRE	HZ
+
+static DEFINE_SPINLOCK(lowmem_pressure_lock);
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_pressure_wait);
+static unsigned long lowmem_pressure_scanned;
+static unsigned long lowmem_pressure_reclaimed;
+static unsigned long lowmem_pressure_stamp;
+static int lowmem_pressure_headroom;
+static int lowmem_pressure;
+static atomic_t lowmem_pressure_seq = ATOMIC_INIT(0);
+
+static void lowmem_pressure_decay(struct work_struct *work);
+static DECLARE_DELAYED_WORK(lowmem_pressure_decay_work, lowmem_pressure_decay);
+
+/* called with lowmem_pressure_lock held */
+static void lowmem_set_pressure(int level)
+{
+	lowmem_pressure = level;
+	atomic_inc(&lowmem_pressure_seq);
+	wake_up_interruptible(&lowmem_pressure_wait);
+}
+
+/*
+ * Sums the per-zone counters of one event without all_vm_events(), which
+ * takes the cpu hotplug lock and may sleep.  A cpu going offline at the
+ * same time can skew one sample, which the next window corrects.
+ */
+static unsigned long lowmem_sum_zone_events(enum vm_event_item first)
+{
+	unsigned long sum = 0;
+	int cpu, i;
+
+	for_each_possible_cpu(cpu) {
+		struct vm_event_state *this = &per_cpu(vm_event_states, cpu);
+
+		for (i = 0; i < MAX_NR_ZONES; i++)
+			sum += this->event[first + i];
+	}
+	return sum;
+}
+
+/*
+ * lowmem_update_pressure - samples reclaim efficiency at most once per
+ * window and grades the pressure. 'headroom' is the larger of the free and
+ * file page counts, 'top' the highest minfree threshold in use.
+ */
+static void lowmem_update_pressure(int headroom, int top)
+{
+	unsigned long scanned, reclaimed;
+	unsigned long pressure = 0;
+	int level = LOWMEM_PRESSURE_NONE;
+
+	if (lowmem_pressure_stamp &&
+	    time_before(jiffies, lowmem_pressure_stamp + LOWMEM_PRESSURE_WINDOW))
+		return;
+	if (!spin_trylock(&lowmem_pressure_lock))
+		return;
+
+	scanned = lowmem_sum_zone_events(PGSCAN_KSWAPD_NORMAL - ZONE_NORMAL) +
+		lowmem_sum_zone_events(PGSCAN_DIRECT_NORMAL - ZONE_NORMAL);
+	reclaimed = lowmem_sum_zone_events(PGSTEAL_NORMAL - ZONE_NORMAL);
+
+	/* the first sample only sets the baseline */
+	if (lowmem_pressure_stamp &&
+	    scanned - lowmem_pressure_scanned >= SWAP_CLUSTER_MAX) {
+		unsigned long delta = scanned - lowmem_pressure_scanned;
+		unsigned long got = min(reclaimed - lowmem_pressure_reclaimed,
+					delta);
+
+		pressure = 100 - got * 100 / delta;
+		level = LOWMEM_PRESSURE_LOW;
+		if (pressure >= lowmem_pressure_medium)
+			level = LOWMEM_PRESSURE_MEDIUM;
+		if (pressure >= lowmem_pressure_critical)
+			level = LOWMEM_PRESSURE_CRITICAL;
+	}
+
+	/* falling towards the kill thresholds raises the level */
+	if (headroom < 2 * top && headroom < lowmem_pressure_headroom &&
+	    level < LOWMEM_PRESSURE_CRITICAL)
+		level++;
+	if (headroom < top && level < LOWMEM_PRESSURE_MEDIUM)
+		level = LOWMEM_PRESSURE_MEDIUM;
+
+	lowmem_pressure_scanned = scanned;
+	lowmem_pressure_reclaimed = reclaimed;
+	lowmem_pressure_headroom = headroom;
+	lowmem_pressure_stamp = jiffies ?: 1;
+
+	if (level != lowmem_pressure) {
+		lowmem_print(3, "lowmem pressure %s, reclaim %lu%%, headroom %d\n",
+			     lowmem_pressure_names[level], pressure, headroom);
+		lowmem_set_pressure(level);
+	}
+	if (level != LOWMEM_PRESSURE_NONE)
+		schedule_delayed_work(&lowmem_pressure_decay_work,
+				      LOWMEM_PRESSURE_EXPIRE + 1);
+	spin_unlock(&lowmem_pressure_lock);
+}
+
+/*
+ * Drops the pressure to none once reclaim has been quiet for
+ * LOWMEM_PRESSURE_EXPIRE, so pollers see the drop and a later rise to the
+ * same level is reported again.
+ */
+static void lowmem_pressure_decay(struct work_struct *work)
+{
+	unsigned long expire;
+
+	spin_lock(&lowmem_pressure_lock);
+	expire = lowmem_pressure_stamp + LOWMEM_PRESSURE_EXPIRE;
+	if (lowmem_pressure != LOWMEM_PRESSURE_NONE) {
+		if (time_after(jiffies, expire)) {
+			lowmem_print(3, "lowmem pressure none, reclaim idle\n");
+			lowmem_set_pressure(LOWMEM_PRESSURE_NONE);
+		} else
+			schedule_delayed_work(&lowmem_pressure_decay_work,
+					      expire - jiffies + 1);
+	}
+	spin_unlock(&lowmem_pressure_lock);
+}
+
+static int lowmem_pressure_open(struct inode *inode, struct file *file)
+{
+	file->f_version = atomic_read(&lowmem_pressure_seq);
+	return nonseekable_open(inode, file);
+}
+
+static ssize_t lowmem_pressure_read(struct file *file, char __user *buf,
+				    size_t count, loff_t *ppos)
+{
+	int seq = atomic_read(&lowmem_pressure_seq);
+	char line[16];
+	int len;
+
+	/* one line per level change, waiting for the next is up to poll() */
+	if (*ppos && file->f_version == seq)
+		return 0;
+
+	len = snprintf(line, sizeof(line), "%s\n",
+		       lowmem_pressure_names[lowmem_pressure]);
+	if (count < len)
+		return -EINVAL;
+	if (copy_to_user(buf, line, len))
+		return -EFAULT;
+	file->f_version = seq;
+	*ppos += len;
+	return len;
+}
+
+static unsigned int lowmem_pressure_poll(struct file *file, poll_table *wait)
+{
+	poll_wait(file, &lowmem_pressure_wait, wait);
+	if (file->f_version != atomic_read(&lowmem_pressure_seq))
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
+
+static const struct file_operations lowmem_pressure_fops = {
+	.owner = THIS_MODULE,
+	.open = lowmem_pressure_open,
+	.read = lowmem_pressure_read,
+	.poll = lowmem_pressure_poll,
+	.llseek = no_llseek,
+};
+
+static struct miscdevice lowmem_pressure_misc = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "mem_pressure",
+	.fops = &lowmem_pressure_fops,
+};
+
 #ifdef CONFIG_MEMORY_HOTPLUG
 static int lmk_hotplug_callback(struct notifier_block *self,
 				unsigned long cmd, void *data)
@@ -111,6 +376,7 @@ static int lmk_hotplug_callback(struct notifier_block *self,
 static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 {
 	struct task_struct *p;
+	struct hlist_node *node;
 	struct task_struct *selected = NULL;
 	int rem = 0;
 	int tasksize;
@@ -118,6 +384,7 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 	int min_adj = OOM_ADJUST_MAX + 1;
 	int selected_tasksize = 0;
 	int selected_oom_adj;
+	int oom_adj;
 	int array_size = ARRAY_SIZE(lowmem_adj);
 	int other_free = global_page_state(NR_FREE_PAGES);
 	int other_file = global_page_state(NR_FILE_PAGES) -
@@ -151,6 +418,9 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 		array_size = lowmem_adj_size;
 	if (lowmem_minfree_size < array_size)
 		array_size = lowmem_minfree_size;
+	if (array_size)
+		lowmem_update_pressure(max(other_free, other_file),
+				       lowmem_minfree[array_size - 1]);
 	for (i = 0; i < array_size; i++) {
 		if (other_free < lowmem_minfree[i] &&
 		    other_file < lowmem_minfree[i]) {
@@ -174,40 +444,35 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 	selected_oom_adj = min_adj;
 
 	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		struct mm_struct *mm;
-		struct signal_struct *sig;
-		int oom_adj;
-
-		task_lock(p);
-		mm = p->mm;
-		sig = p->signal;
-		if (!mm || !sig) {
-			task_unlock(p);
-			continue;
-		}
-		oom_adj = sig->oom_adj;
-		if (oom_adj < min_adj) {
+	spin_lock(&lowmem_index_lock);
+	/* the highest non-empty bucket at or above min_adj holds the victim */
+	for (oom_adj = OOM_ADJUST_MAX; oom_adj >= min_adj && !selected;
+	     oom_adj--) {
+		hlist_for_each_entry(p, node, lowmem_bucket(oom_adj),
+				     lowmem_node) {
+			struct mm_struct *mm;
+
+			task_lock(p);
+			mm = p->mm;
+			if (!mm || p->signal->oom_adj != oom_adj) {
+				task_unlock(p);
+				continue;
+			}
+			tasksize = get_mm_rss(mm);
 			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
+			if (tasksize <= 0)
 				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
+			if (selected && tasksize <= selected_tasksize)
 				continue;
+			selected = p;
+			selected_tasksize = tasksize;
+			selected_oom_adj = oom_adj;
+			lowmem_print(2, "select %d (%s), adj %d, size %d, "
+				     "to kill\n", p->pid, p->comm, oom_adj,
+				     tasksize);
 		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
 	}
+	spin_unlock(&lowmem_index_lock);
 	if (selected) {
 		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
 			     selected->pid, selected->comm,
@@ -232,6 +497,9 @@ static int __init lowmem_init(void)
 {
 	task_free_register(&task_nb);
 	register_shrinker(&lowmem_shrinker);
+	if (misc_register(&lowmem_pressure_misc))
+		printk(KERN_ERR "lowmemorykiller: failed to register "
+		       "mem_pressure device\n");
 #ifdef CONFIG_MEMORY_HOTPLUG
 	hotplug_memory_notifier(lmk_hotplug_callback, 0);
 #endif
@@ -240,7 +508,9 @@ static int __init lowmem_init(void)
 
 static void __exit lowmem_exit(void)
 {
+	misc_deregister(&lowmem_pressure_misc);
 	unregister_shrinker(&lowmem_shrinker);
+	cancel_delayed_work_sync(&lowmem_pressure_decay_work);
 	task_free_unregister(&task_nb);
 }
 
@@ -250,6 +520,10 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_named(pressure_medium, lowmem_pressure_medium, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_critical, lowmem_pressure_critical, uint,
+		   S_IRUGO | S_IWUSR);
 
 module_init(lowmem_init);
 module_exit(lowmem_exit);
@@ -0,0 +1,173 @@
+/*
+ * Snappy versus LZO throughput on page-sized buffers.
+ *
+ * Both algorithms are driven through the crypto API the way zram and
+ * zcache would use them.  All work is done at load time; the module
+ * then refuses to stay loaded, like tcrypt.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ */
+
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/crypto.h>
+#include <linux/hrtimer.h>
+#include <linux/math64.h>
+#include <linux/random.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+static unsigned int iterations = 1000;
+module_param(iterations, uint, 0);
+MODULE_PARM_DESC(iterations, "Passes over each input buffer");
+
+static const char * const bench_algs[] = { "snappy", "lzo" };
+
+static const char * const bench_words[] = {
+	"the", "page", "of", "memory", "kernel", "and", "a", "to",
+	"compressed", "swap", "in", "is", "block", "for", "data", "zero",
+};
+
+enum bench_input {
+	BENCH_TEXT,
+	BENCH_ZERO,
+	BENCH_RANDOM,
+	BENCH_NR_INPUTS,
+};
+
+static const char * const bench_input_names[] = {
+	[BENCH_TEXT]	= "text",
+	[BENCH_ZERO]	= "mostly-zero",
+	[BENCH_RANDOM]	= "random",
+};
+
+static void bench_fill(u8 *buf, enum bench_input type)
+{
+	unsigned int i, len;
+	const char *w;
+
+	switch (type) {
+	case BENCH_TEXT:
+		for (i = 0; i < PAGE_SIZE; i += len) {
+			w = bench_words[random32() % ARRAY_SIZE(bench_words)];
+			len = min_t(unsigned int, strlen(w), PAGE_SIZE - i);
+			memcpy(buf + i, w, len);
+			if (i + len < PAGE_SIZE)
+				buf[i + len++] = ' ';
+		}
+		break;
+	case BENCH_ZERO:
+		memset(buf, 0, PAGE_SIZE);
+		for (i = 0; i < PAGE_SIZE; i += 64)
+			*(u32 *)(buf + i) = random32();
+		break;
+	case BENCH_RANDOM:
+		for (i = 0; i < PAGE_SIZE; i += sizeof(u32))
+			*(u32 *)(buf + i) = random32();
+		break;
+	default:
+		BUG();
+	}
+}
+
+/* Returns MB/s for @bytes moved in @ns nanoseconds */
+static unsigned long bench_rate(u64 bytes, s64 ns)
+{
+	if (ns <= 0)
+		return 0;
+	return div64_u64(bytes * 1000, (u64)ns);
+}
+
+static int bench_one(const char *name, enum bench_input type,
+		     u8 *src, u8 *dst, u8 *out)
+{
+	struct crypto_comp *tfm;
+	unsigned int i, clen = 0, dlen;
+	ktime_t start;
+	s64 cns, dns;
+	int ret = 0;
+
+	tfm = crypto_alloc_comp(name, 0, 0);
+	if (IS_ERR(tfm)) {
+		printk(KERN_ERR "csnappy_bench: %s unavailable (%ld)\n",
+			name, PTR_ERR(tfm));
+		return PTR_ERR(tfm);
+	}
+
+	start = ktime_get();
+	for (i = 0; i < iterations; i++) {
+		clen = 2 * PAGE_SIZE;
+		ret = crypto_comp_compress(tfm, src, PAGE_SIZE, dst, &clen);
+		if (ret)
+			goto out;
+	}
+	cns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	start = ktime_get();
+	for (i = 0; i < iterations; i++) {
+		dlen = PAGE_SIZE;
+		ret = crypto_comp_decompress(tfm, dst, clen, out, &dlen);
+		if (ret)
+			goto out;
+	}
+	dns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	if (dlen != PAGE_SIZE || memcmp(src, out, PAGE_SIZE)) {
+		printk(KERN_ERR "csnappy_bench: %s %s: round trip mismatch\n",
+			name, bench_input_names[type]);
+		ret = -EIO;
+		goto out;
+	}
+
+	printk(KERN_INFO "csnappy_bench: %-6s %-11s ratio %3lu%% "
+		"compress %5lu MB/s decompress %5lu MB/s\n",
+		name, bench_input_names[type], clen * 100 / PAGE_SIZE,
+		bench_rate((u64)iterations * PAGE_SIZE, cns),
+		bench_rate((u64)iterations * PAGE_SIZE, dns));
+out:
+	if (ret && ret != -EIO)
+		printk(KERN_ERR "csnappy_bench: %s %s: error %d\n",
+			name, bench_input_names[type], ret);
+	crypto_free_comp(tfm);
+	return ret;
+}
+
+static int __init csnappy_bench_init(void)
+{
+	u8 *src, *dst, *out;
+	enum bench_input type;
+	unsigned int i;
+
+	src = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	dst = kmalloc(2 * PAGE_SIZE, GFP_KERNEL);
+	out = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!src || !dst || !out)
+		goto out;
+
+	if (!iterations)
+		iterations = 1;
+
+	for (type = 0; type < BENCH_NR_INPUTS; type++) {
+		bench_fill(src, type);
+		for (i = 0; i < ARRAY_SIZE(bench_algs); i++)
+			bench_one(bench_algs[i], type, src, dst, out);
+	}
+out:
+	kfree(out);
+	kfree(dst);
+	kfree(src);
+
+	/* Nothing to keep around; fail the load as tcrypt does */
+	return -EAGAIN;
+}
+
+static void __exit csnappy_bench_exit(void) { }
+
+module_init(csnappy_bench_init);
+module_exit(csnappy_bench_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Snappy and LZO page compression benchmark");
@@ -0,0 +1,127 @@
+/*
+ * Snappy compression algorithm for the Cryptographic API.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/crypto.h>
+#include <linux/vmalloc.h>
+#include <linux/string.h>
+#include "csnappy.h"
+
+/*
+ * csnappy writes up to csnappy_max_compressed_length() bytes regardless
+ * of how well the input compresses.  Callers of the crypto API usually
+ * size dst to the input length, so page-sized (or smaller) inputs are
+ * compressed into a bounce buffer when dst is short.
+ */
+#define SNAPPY_BOUNCE_MAX	PAGE_SIZE
+
+struct snappy_ctx {
+	void *workmem;
+	char *bounce;
+};
+
+static int snappy_init(struct crypto_tfm *tfm)
+{
+	struct snappy_ctx *ctx = crypto_tfm_ctx(tfm);
+
+	ctx->workmem = vmalloc(CSNAPPY_WORKMEM_BYTES +
+			csnappy_max_compressed_length(SNAPPY_BOUNCE_MAX));
+	if (!ctx->workmem)
+		return -ENOMEM;
+	ctx->bounce = (char *)ctx->workmem + CSNAPPY_WORKMEM_BYTES;
+
+	return 0;
+}
+
+static void snappy_exit(struct crypto_tfm *tfm)
+{
+	struct snappy_ctx *ctx = crypto_tfm_ctx(tfm);
+
+	vfree(ctx->workmem);
+}
+
+static int snappy_compress(struct crypto_tfm *tfm, const u8 *src,
+			   unsigned int slen, u8 *dst, unsigned int *dlen)
+{
+	struct snappy_ctx *ctx = crypto_tfm_ctx(tfm);
+	uint32_t olen;
+
+	if (*dlen >= csnappy_max_compressed_length(slen)) {
+		csnappy_compress((const char *)src, slen, (char *)dst, &olen,
+				 ctx->workmem,
+				 CSNAPPY_WORKMEM_BYTES_POWER_OF_TWO);
+		*dlen = olen;
+		return 0;
+	}
+
+	if (slen > SNAPPY_BOUNCE_MAX)
+		return -EINVAL;
+
+	csnappy_compress((const char *)src, slen, ctx->bounce, &olen,
+			 ctx->workmem, CSNAPPY_WORKMEM_BYTES_POWER_OF_TWO);
+	if (olen > *dlen)
+		return -EINVAL;
+
+	memcpy(dst, ctx->bounce, olen);
+	*dlen = olen;
+	return 0;
+}
+
+static int snappy_decompress(struct crypto_tfm *tfm, const u8 *src,
+			     unsigned int slen, u8 *dst, unsigned int *dlen)
+{
+	uint32_t olen;
+	int n, err;
+
+	n = csnappy_get_uncompressed_length((const char *)src, slen, &olen);
+	if (n < 0 || olen > *dlen)
+		return -EINVAL;
+
+	err = csnappy_decompress_noheader((const char *)src + n, slen - n,
+					  (char *)dst, &olen);
+	if (err != CSNAPPY_E_OK)
+		return -EINVAL;
+
+	*dlen = olen;
+	return 0;
+}
+
+static struct crypto_alg alg = {
+	.cra_name		= "snappy",
+	.cra_flags		= CRYPTO_ALG_TYPE_COMPRESS,
+	.cra_ctxsize		= sizeof(struct snappy_ctx),
+	.cra_module		= THIS_MODULE,
+	.cra_list		= LIST_HEAD_INIT(alg.cra_list),
+	.cra_init		= snappy_init,
+	.cra_exit		= snappy_exit,
+	.cra_u			= { .compress = {
+	.coa_compress		= snappy_compress,
+	.coa_decompress		= snappy_decompress } }
+};
+
+static int __init snappy_mod_init(void)
+{
+	return crypto_register_alg(&alg);
+}
+
+static void __exit snappy_mod_fini(void)
+{
+	crypto_unregister_alg(&alg);
+}
+
+module_init(snappy_mod_init);
+module_exit(snappy_mod_fini);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Snappy Compression Algorithm");
@@ -150,12 +150,12 @@ static const int kMaxIncrementCopyOverflow = 10;
 static inline void IncrementalCopyFastPath(const char *src, char *op, int len)
 {
 	while (op - src < 8) {
-		UNALIGNED_STORE64(op, UNALIGNED_LOAD64(src));
+		UNALIGNED_COPY64(op, src);
 		len -= op - src;
 		op += op - src;
 	}
 	while (len > 0) {
-		UNALIGNED_STORE64(op, UNALIGNED_LOAD64(src));
+		UNALIGNED_COPY64(op, src);
 		src += 8;
 		op += 8;
 		len -= 8;
@@ -178,8 +178,8 @@ SAW__Append(struct SnappyArrayWriter *this,
 	const int space_left = this->op_limit - op;
 	/*Fast path, used for the majority (about 90%) of dynamic invocations.*/
 	if (allow_fast_path && len <= 16 && space_left >= 16) {
-		UNALIGNED_STORE64(op, UNALIGNED_LOAD64(ip));
-		UNALIGNED_STORE64(op + 8, UNALIGNED_LOAD64(ip + 8));
+		UNALIGNED_COPY64(op, ip);
+		UNALIGNED_COPY64(op + 8, ip + 8);
 	} else {
 		if (space_left < len)
 			return CSNAPPY_E_OUTPUT_OVERRUN;
@@ -200,8 +200,8 @@ SAW__AppendFromSelf(struct SnappyArrayWriter *this,
 		return CSNAPPY_E_DATA_MALFORMED;
 	/* Fast path, used for the majority (70-80%) of dynamic invocations. */
 	if (len <= 16 && offset >= 8 && space_left >= 16) {
-		UNALIGNED_STORE64(op, UNALIGNED_LOAD64(op - offset));
-		UNALIGNED_STORE64(op + 8, UNALIGNED_LOAD64(op - offset + 8));
+		UNALIGNED_COPY64(op, op - offset);
+		UNALIGNED_COPY64(op + 8, op - offset + 8);
 	} else if (space_left >= len + kMaxIncrementCopyOverflow) {
 		IncrementalCopyFastPath(op - offset, op, len);
 	} else {
@@ -267,7 +267,8 @@ csnappy_decompress_noheader(
 		opcode = *(const uint8_t *)src++;
 		opword = char_table[opcode];
 		extra_bytes = opword >> 11;
-		trailer = get_unaligned_le32(src) & wordmask[extra_bytes];
+		trailer = le32_to_cpu(UNALIGNED_LOAD32(src)) &
+			wordmask[extra_bytes];
 		src += extra_bytes;
 		src_remaining -= 1 + extra_bytes;
 		length = opword & 0xff;
@@ -55,17 +55,63 @@ Zeev Tarantov <zeev.tarantov at gmail.com>
 #endif
 
 #define UNALIGNED_LOAD16(_p)		get_unaligned((const uint16_t *)(_p))
-#define UNALIGNED_LOAD32(_p)		get_unaligned((const uint32_t *)(_p))
 #define UNALIGNED_LOAD64(_p)		get_unaligned((const uint64_t *)(_p))
 #define UNALIGNED_STORE16(_p, _val)	put_unaligned((_val), (uint16_t *)(_p))
-#define UNALIGNED_STORE32(_p, _val)	put_unaligned((_val), (uint32_t *)(_p))
 #define UNALIGNED_STORE64(_p, _val)	put_unaligned((_val), (uint64_t *)(_p))
 
+#if defined(__arm__) && __LINUX_ARM_ARCH__ >= 6
+/*
+ * ARMv6 and later service unaligned ldr/str in hardware, but the
+ * generic get_unaligned() on ARM still assembles words a byte at a
+ * time.  Issue the word accesses directly; ldrd/ldm would fault on
+ * unaligned addresses so 64-bit moves are done as two words.
+ */
+static inline uint32_t csnappy_load32(const void *p)
+{
+	uint32_t v;
+
+	asm volatile("ldr	%0, %1" : "=r" (v)
+		     : "Q" (*(const uint32_t *)p));
+	return v;
+}
+
+static inline void csnappy_store32(void *p, uint32_t v)
+{
+	asm volatile("str	%1, %0" : "=Q" (*(uint32_t *)p)
+		     : "r" (v));
+}
+
+#define UNALIGNED_LOAD32(_p)		csnappy_load32(_p)
+#define UNALIGNED_STORE32(_p, _val)	csnappy_store32((_p), (_val))
+
+/*
+ * Copy 8 bytes between possibly overlapping locations.  Both words
+ * are loaded before either is stored so that pattern-extending copies
+ * (dst - src < 8) see the same bytes as a single 64-bit move would.
+ */
+#define UNALIGNED_COPY64(_dst, _src) do {				\
+		const char *__s = (const char *)(_src);			\
+		char *__d = (char *)(_dst);				\
+		uint32_t __lo = csnappy_load32(__s);			\
+		uint32_t __hi = csnappy_load32(__s + 4);		\
+		csnappy_store32(__d, __lo);				\
+		csnappy_store32(__d + 4, __hi);				\
+	} while (0)
+#else
+#define UNALIGNED_LOAD32(_p)		get_unaligned((const uint32_t *)(_p))
+#define UNALIGNED_STORE32(_p, _val)	put_unaligned((_val), (uint32_t *)(_p))
+#endif
+
 #define FindLSBSetNonZero(n)		__builtin_ctz(n)
 #define FindLSBSetNonZero64(n)		__builtin_ctzll(n)
 
 #endif /* __KERNEL__ */
 
+#ifndef UNALIGNED_COPY64
+#define UNALIGNED_COPY64(_dst, _src) \
+		UNALIGNED_STORE64((_dst), UNALIGNED_LOAD64(_src))
+#endif
+
 #define DCHECK_EQ(a, b)	DCHECK(((a) == (b)))
 #define DCHECK_NE(a, b)	DCHECK(((a) != (b)))
 #define DCHECK_GT(a, b)	DCHECK(((a) >  (b)))
@@ -8,8 +8,8 @@
  * and, thus indirectly, for cleancache and frontswap.  Zcache includes two
  * page-accessible memory [1] interfaces, both utilizing lzo1x compression:
  * 1) "compression buddies" ("zbud") is used for ephemeral pages
- * 2) xvmalloc is used for persistent pages.
- * Xvmalloc (based on the TLSF allocator) has very low fragmentation
+ * 2) zsmalloc is used for persistent pages.
+ * Zsmalloc packs objects of similar size together and can compact them
  * so maximizes space efficiency, while zbud allows pairs (and potentially,
  * in the future, more than a pair of) compressed pages to be closely linked
  * so that reclaiming can be done via the kernel's physical-page-oriented
@@ -29,7 +29,7 @@
 #include <linux/atomic.h>
 #include "tmem.h"
 
-#include "../zram/xvmalloc.h" /* if built in drivers/staging */
+#include "../zsmalloc/zsmalloc.h" /* if built in drivers/staging */
 
 #if (!defined(CONFIG_CLEANCACHE) && !defined(CONFIG_FRONTSWAP))
 #error "zcache is useless without CONFIG_CLEANCACHE or CONFIG_FRONTSWAP"
@@ -55,17 +55,22 @@
  * (physical) page and tracking them with data structures so that
  * the raw pages can be easily reclaimed.
  *
- * A zbud page ("zbpg") is an aligned page containing a list_head,
+ * A zbud page ("zbpg") is an aligned page containing two list_heads,
  * a lock, and two "zbud headers".  The remainder of the physical
  * page is divided up into aligned 64-byte "chunks" which contain
- * the compressed data for zero, one, or two zbuds.  Each zbpg
- * resides on: (1) an "unused list" if it has no zbuds; (2) a
- * "buddied" list if it is fully populated  with two zbuds; or
- * (3) one of PAGE_SIZE/64 "unbuddied" lists indexed by how many chunks
- * the one unbuddied zbud uses.  The data inside a zbpg cannot be
+ * the compressed data for zero, one, or two zbuds.  Both zbuds of a
+ * zbpg belong to the same tmem pool.  Each pool keeps the zbpgs in use
+ * on its own LRU list, and those with a single zbud also on one of
+ * PAGE_SIZE/64 "unbuddied" lists indexed by how many chunks the one
+ * unbuddied zbud uses.  These lists are protected by a per-pool lock,
+ * so puts to different pools do not contend.  A zbpg with no zbuds
+ * resides on the "unused list" of the cpu that freed it or, once that
+ * is full, on a global one.  The data inside a zbpg cannot be
  * read or written unless the zbpg's lock is held.
  */
 
+#define MAX_POOLS_PER_CLIENT 16
+
 #define ZBH_SENTINEL  0x43214321
 #define ZBPG_SENTINEL  0xdeadbeef
 
@@ -81,6 +86,7 @@ struct zbud_hdr {
 
 struct zbud_page {
 	struct list_head bud_list;
+	struct list_head lru; /* empty unless in use by a pool */
 	spinlock_t lock;
 	struct zbud_hdr buddy[ZBUD_MAX_BUDS];
 	DECL_SENTINEL
@@ -94,24 +100,41 @@ struct zbud_page {
 				CHUNK_MASK) >> CHUNK_SHIFT)
 #define MAX_CHUNK	(NCHUNKS-1)
 
-static struct {
-	struct list_head list;
-	unsigned count;
-} zbud_unbuddied[NCHUNKS];
-/* list N contains pages with N chunks USED and NCHUNKS-N unused */
-/* element 0 is never used but optimizing that isn't worth it */
+/*
+ * The zbpgs holding zbuds of one tmem pool.  Eviction goes to the pools
+ * with the lowest priority first and, among those, the largest first.
+ */
+struct zbud_pool {
+	/* protects the lists and buddied_count */
+	spinlock_t lock;
+	struct {
+		struct list_head list;
+		unsigned count;
+	} unbuddied[NCHUNKS];
+	/* list N contains pages with N chunks USED and NCHUNKS-N unused */
+	/* element 0 is never used but optimizing that isn't worth it */
+	struct list_head lru; /* most recently put to first */
+	unsigned long buddied_count;
+	atomic_t raw_pages;
+	int priority;
+};
+
+static struct zbud_pool zbud_pools[MAX_POOLS_PER_CLIENT];
 static unsigned long zbud_cumul_chunk_counts[NCHUNKS];
 
-struct list_head zbud_buddied_list;
-static unsigned long zcache_zbud_buddied_count;
+/* unused zbpgs a cpu keeps before handing them to the global list */
+#define ZBPG_PCP_MAX 8
 
-/* protects the buddied list and all unbuddied lists */
-static DEFINE_SPINLOCK(zbud_budlists_spinlock);
+struct zbpg_pcp {
+	struct list_head list;
+	unsigned count;
+};
+static DEFINE_PER_CPU(struct zbpg_pcp, zbpg_pcp);
 
 static LIST_HEAD(zbpg_unused_list);
 static unsigned long zcache_zbpg_unused_list_count;
 
-/* protects the unused page list */
+/* protects the global unused page list */
 static DEFINE_SPINLOCK(zbpg_unused_list_spinlock);
 
 static atomic_t zcache_zbud_curr_raw_pages;
@@ -184,23 +207,39 @@ static struct zbud_page *zbud_alloc_raw_page(void)
 {
 	struct zbud_page *zbpg = NULL;
 	struct zbud_hdr *zh0, *zh1;
+	struct zbpg_pcp *pcp;
+	unsigned long flags;
 	bool recycled = 0;
 
-	/* if any pages on the zbpg list, use one */
-	spin_lock(&zbpg_unused_list_spinlock);
-	if (!list_empty(&zbpg_unused_list)) {
-		zbpg = list_first_entry(&zbpg_unused_list,
+	/* if any pages on this cpu's unused list, use one */
+	local_irq_save(flags);
+	pcp = &__get_cpu_var(zbpg_pcp);
+	if (pcp->count) {
+		zbpg = list_first_entry(&pcp->list,
 				struct zbud_page, bud_list);
 		list_del_init(&zbpg->bud_list);
-		zcache_zbpg_unused_list_count--;
+		pcp->count--;
 		recycled = 1;
 	}
-	spin_unlock(&zbpg_unused_list_spinlock);
+	local_irq_restore(flags);
+	/* then on the global one */
+	if (zbpg == NULL) {
+		spin_lock(&zbpg_unused_list_spinlock);
+		if (!list_empty(&zbpg_unused_list)) {
+			zbpg = list_first_entry(&zbpg_unused_list,
+					struct zbud_page, bud_list);
+			list_del_init(&zbpg->bud_list);
+			zcache_zbpg_unused_list_count--;
+			recycled = 1;
+		}
+		spin_unlock(&zbpg_unused_list_spinlock);
+	}
 	if (zbpg == NULL)
-		/* none on zbpg list, try to get a kernel page */
+		/* none on zbpg lists, try to get a kernel page */
 		zbpg = zcache_get_free_page();
 	if (likely(zbpg != NULL)) {
 		INIT_LIST_HEAD(&zbpg->bud_list);
+		INIT_LIST_HEAD(&zbpg->lru);
 		zh0 = &zbpg->buddy[0]; zh1 = &zbpg->buddy[1];
 		spin_lock_init(&zbpg->lock);
 		if (recycled) {
@@ -210,7 +249,6 @@ static struct zbud_page *zbud_alloc_raw_page(void)
 			BUG_ON(zh1->size != 0 || tmem_oid_valid(&zh1->oid));
 		} else {
 			atomic_inc(&zcache_zbud_curr_raw_pages);
-			INIT_LIST_HEAD(&zbpg->bud_list);
 			SET_SENTINEL(zbpg, ZBPG);
 			zh0->size = 0; zh1->size = 0;
 			tmem_oid_set_invalid(&zh0->oid);
@@ -223,14 +261,27 @@ static struct zbud_page *zbud_alloc_raw_page(void)
 static void zbud_free_raw_page(struct zbud_page *zbpg)
 {
 	struct zbud_hdr *zh0 = &zbpg->buddy[0], *zh1 = &zbpg->buddy[1];
+	struct zbpg_pcp *pcp;
+	unsigned long flags;
 
 	ASSERT_SENTINEL(zbpg, ZBPG);
 	BUG_ON(!list_empty(&zbpg->bud_list));
+	BUG_ON(!list_empty(&zbpg->lru));
 	ASSERT_SPINLOCK(&zbpg->lock);
 	BUG_ON(zh0->size != 0 || tmem_oid_valid(&zh0->oid));
 	BUG_ON(zh1->size != 0 || tmem_oid_valid(&zh1->oid));
 	INVERT_SENTINEL(zbpg, ZBPG);
 	spin_unlock(&zbpg->lock);
+	local_irq_save(flags);
+	pcp = &__get_cpu_var(zbpg_pcp);
+	if (pcp->count < ZBPG_PCP_MAX) {
+		list_add(&zbpg->bud_list, &pcp->list);
+		pcp->count++;
+		zbpg = NULL;
+	}
+	local_irq_restore(flags);
+	if (zbpg == NULL)
+		return;
 	spin_lock(&zbpg_unused_list_spinlock);
 	list_add(&zbpg->bud_list, &zbpg_unused_list);
 	zcache_zbpg_unused_list_count++;
@@ -264,32 +315,35 @@ static void zbud_free_and_delist(struct zbud_hdr *zh)
 	unsigned budnum = zbud_budnum(zh), size;
 	struct zbud_page *zbpg =
 		container_of(zh, struct zbud_page, buddy[budnum]);
+	struct zbud_pool *zbp;
 
 	spin_lock(&zbpg->lock);
-	if (list_empty(&zbpg->bud_list)) {
+	if (list_empty(&zbpg->lru)) {
 		/* ignore zombie page... see zbud_evict_pages() */
 		spin_unlock(&zbpg->lock);
 		return;
 	}
+	zbp = &zbud_pools[zh->pool_id];
 	size = zbud_free(zh);
 	ASSERT_SPINLOCK(&zbpg->lock);
 	zh_other = &zbpg->buddy[(budnum == 0) ? 1 : 0];
 	if (zh_other->size == 0) { /* was unbuddied: unlist and free */
 		chunks = zbud_size_to_chunks(size) ;
-		spin_lock(&zbud_budlists_spinlock);
-		BUG_ON(list_empty(&zbud_unbuddied[chunks].list));
+		spin_lock(&zbp->lock);
+		BUG_ON(list_empty(&zbp->unbuddied[chunks].list));
 		list_del_init(&zbpg->bud_list);
-		zbud_unbuddied[chunks].count--;
-		spin_unlock(&zbud_budlists_spinlock);
+		zbp->unbuddied[chunks].count--;
+		list_del_init(&zbpg->lru);
+		atomic_dec(&zbp->raw_pages);
+		spin_unlock(&zbp->lock);
 		zbud_free_raw_page(zbpg);
 	} else { /* was buddied: move remaining buddy to unbuddied list */
 		chunks = zbud_size_to_chunks(zh_other->size) ;
-		spin_lock(&zbud_budlists_spinlock);
-		list_del_init(&zbpg->bud_list);
-		zcache_zbud_buddied_count--;
-		list_add_tail(&zbpg->bud_list, &zbud_unbuddied[chunks].list);
-		zbud_unbuddied[chunks].count++;
-		spin_unlock(&zbud_budlists_spinlock);
+		spin_lock(&zbp->lock);
+		zbp->buddied_count--;
+		list_add_tail(&zbpg->bud_list, &zbp->unbuddied[chunks].list);
+		zbp->unbuddied[chunks].count++;
+		spin_unlock(&zbp->lock);
 		spin_unlock(&zbpg->lock);
 	}
 }
@@ -298,35 +352,35 @@ static struct zbud_hdr *zbud_create(uint32_t pool_id, struct tmem_oid *oid,
 					uint32_t index, struct page *page,
 					void *cdata, unsigned size)
 {
+	struct zbud_pool *zbp = &zbud_pools[pool_id];
 	struct zbud_hdr *zh0, *zh1, *zh = NULL;
-	struct zbud_page *zbpg = NULL, *ztmp;
+	struct zbud_page *zbpg = NULL;
 	unsigned nchunks;
 	char *to;
 	int i, found_good_buddy = 0;
 
 	nchunks = zbud_size_to_chunks(size) ;
+	spin_lock(&zbp->lock);
 	for (i = MAX_CHUNK - nchunks + 1; i > 0; i--) {
-		spin_lock(&zbud_budlists_spinlock);
-		if (!list_empty(&zbud_unbuddied[i].list)) {
-			list_for_each_entry_safe(zbpg, ztmp,
-				    &zbud_unbuddied[i].list, bud_list) {
-				if (spin_trylock(&zbpg->lock)) {
-					found_good_buddy = i;
-					goto found_unbuddied;
-				}
+		list_for_each_entry(zbpg, &zbp->unbuddied[i].list, bud_list) {
+			if (spin_trylock(&zbpg->lock)) {
+				found_good_buddy = i;
+				goto found_unbuddied;
 			}
 		}
-		spin_unlock(&zbud_budlists_spinlock);
 	}
+	spin_unlock(&zbp->lock);
 	/* didn't find a good buddy, try allocating a new page */
 	zbpg = zbud_alloc_raw_page();
 	if (unlikely(zbpg == NULL))
 		goto out;
 	/* ok, have a page, now compress the data before taking locks */
 	spin_lock(&zbpg->lock);
-	spin_lock(&zbud_budlists_spinlock);
-	list_add_tail(&zbpg->bud_list, &zbud_unbuddied[nchunks].list);
-	zbud_unbuddied[nchunks].count++;
+	spin_lock(&zbp->lock);
+	list_add_tail(&zbpg->bud_list, &zbp->unbuddied[nchunks].list);
+	zbp->unbuddied[nchunks].count++;
+	list_add(&zbpg->lru, &zbp->lru);
+	atomic_inc(&zbp->raw_pages);
 	zh = &zbpg->buddy[0];
 	goto init_zh;
 
@@ -343,9 +397,10 @@ found_unbuddied:
 	} else
 		BUG();
 	list_del_init(&zbpg->bud_list);
-	zbud_unbuddied[found_good_buddy].count--;
-	list_add_tail(&zbpg->bud_list, &zbud_buddied_list);
-	zcache_zbud_buddied_count++;
+	zbp->unbuddied[found_good_buddy].count--;
+	zbp->buddied_count++;
+	/* the page now holds the most recent put */
+	list_move(&zbpg->lru, &zbp->lru);
 
 init_zh:
 	SET_SENTINEL(zh, ZBH);
@@ -354,7 +409,7 @@ init_zh:
 	zh->oid = *oid;
 	zh->pool_id = pool_id;
 	/* can wait to copy the data until the list locks are dropped */
-	spin_unlock(&zbud_budlists_spinlock);
+	spin_unlock(&zbp->lock);
 
 	to = zbud_data(zh, size);
 	memcpy(to, cdata, size);
@@ -379,7 +434,7 @@ static int zbud_decompress(struct page *page, struct zbud_hdr *zh)
 
 	zbpg = container_of(zh, struct zbud_page, buddy[budnum]);
 	spin_lock(&zbpg->lock);
-	if (list_empty(&zbpg->bud_list)) {
+	if (list_empty(&zbpg->lru)) {
 		/* ignore zombie page... see zbud_evict_pages() */
 		ret = -EINVAL;
 		goto out;
@@ -423,6 +478,7 @@ static void zbud_evict_zbpg(struct zbud_page *zbpg)
 
 	ASSERT_SPINLOCK(&zbpg->lock);
 	BUG_ON(!list_empty(&zbpg->bud_list));
+	BUG_ON(!list_empty(&zbpg->lru));
 	for (i = 0, j = 0; i < ZBUD_MAX_BUDS; i++) {
 		zh = &zbpg->buddy[i];
 		if (zh->size) {
@@ -446,6 +502,54 @@ static void zbud_evict_zbpg(struct zbud_page *zbpg)
 	zbud_free_raw_page(zbpg);
 }
 
+/*
+ * Evict up to nr of the least recently used zbpgs of a pool.  Returns
+ * the number evicted.
+ */
+static int zbud_evict_pool(struct zbud_pool *zbp, int nr)
+{
+	struct zbud_page *zbpg;
+	struct zbud_hdr *zh;
+	int evicted = 0;
+
+retry_lru:
+	spin_lock_bh(&zbp->lock);
+	list_for_each_entry_reverse(zbpg, &zbp->lru, lru) {
+		if (unlikely(!spin_trylock(&zbpg->lock)))
+			continue;
+		list_del_init(&zbpg->lru);
+		atomic_dec(&zbp->raw_pages);
+		if (list_empty(&zbpg->bud_list)) {
+			zbp->buddied_count--;
+			zcache_evicted_buddied_pages++;
+		} else {
+			zh = &zbpg->buddy[zbpg->buddy[0].size ? 0 : 1];
+			list_del_init(&zbpg->bud_list);
+			zbp->unbuddied[zbud_size_to_chunks(zh->size)].count--;
+			zcache_evicted_unbuddied_pages++;
+		}
+		spin_unlock(&zbp->lock);
+		/* want pool lists unlocked when doing zbpg eviction */
+		zbud_evict_zbpg(zbpg);
+		local_bh_enable();
+		if (++evicted >= nr)
+			goto out;
+		goto retry_lru;
+	}
+	spin_unlock_bh(&zbp->lock);
+out:
+	return evicted;
+}
+
+static bool zbud_evict_before(int a, int b)
+{
+	struct zbud_pool *zbpa = &zbud_pools[a], *zbpb = &zbud_pools[b];
+
+	if (zbpa->priority != zbpb->priority)
+		return zbpa->priority < zbpb->priority;
+	return atomic_read(&zbpa->raw_pages) > atomic_read(&zbpb->raw_pages);
+}
+
 /*
  * Free nr pages.  This code is funky because we want to hold the locks
  * protecting various lists for as short a time as possible, and in some
@@ -453,13 +557,20 @@ static void zbud_evict_zbpg(struct zbud_page *zbpg)
  * not held.  In some cases we also trylock not only to avoid waiting on a
  * page in use by another cpu, but also to avoid potential deadlock due to
  * lock inversion.
+ *
+ * Unused pages go first, then pools are emptied from their LRU end in
+ * the order of zbud_evict_before().  Unused pages kept by other cpus
+ * are left alone; there are at most ZBPG_PCP_MAX of them per cpu.
  */
 static void zbud_evict_pages(int nr)
 {
 	struct zbud_page *zbpg;
-	int i;
+	struct zbpg_pcp *pcp;
+	int order[MAX_POOLS_PER_CLIENT];
+	unsigned long flags;
+	int i, j, n;
 
-	/* first try freeing any pages on unused list */
+	/* first try freeing any pages on unused lists */
 retry_unused_list:
 	spin_lock_bh(&zbpg_unused_list_spinlock);
 	if (!list_empty(&zbpg_unused_list)) {
@@ -478,66 +589,72 @@ retry_unused_list:
 	}
 	spin_unlock_bh(&zbpg_unused_list_spinlock);
 
-	/* now try freeing unbuddied pages, starting with least space avail */
-	for (i = 0; i < MAX_CHUNK; i++) {
-retry_unbud_list_i:
-		spin_lock_bh(&zbud_budlists_spinlock);
-		if (list_empty(&zbud_unbuddied[i].list)) {
-			spin_unlock_bh(&zbud_budlists_spinlock);
-			continue;
-		}
-		list_for_each_entry(zbpg, &zbud_unbuddied[i].list, bud_list) {
-			if (unlikely(!spin_trylock(&zbpg->lock)))
-				continue;
-			list_del_init(&zbpg->bud_list);
-			zbud_unbuddied[i].count--;
-			spin_unlock(&zbud_budlists_spinlock);
-			zcache_evicted_unbuddied_pages++;
-			/* want budlists unlocked when doing zbpg eviction */
-			zbud_evict_zbpg(zbpg);
-			local_bh_enable();
-			if (--nr <= 0)
-				goto out;
-			goto retry_unbud_list_i;
-		}
-		spin_unlock_bh(&zbud_budlists_spinlock);
+	local_irq_save(flags);
+	pcp = &__get_cpu_var(zbpg_pcp);
+	while (pcp->count && nr > 0) {
+		zbpg = list_first_entry(&pcp->list,
+				struct zbud_page, bud_list);
+		list_del_init(&zbpg->bud_list);
+		pcp->count--;
+		atomic_dec(&zcache_zbud_curr_raw_pages);
+		zcache_free_page(zbpg);
+		zcache_evicted_raw_pages++;
+		nr--;
 	}
-
-	/* as a last resort, free buddied pages */
-retry_bud_list:
-	spin_lock_bh(&zbud_budlists_spinlock);
-	if (list_empty(&zbud_buddied_list)) {
-		spin_unlock_bh(&zbud_budlists_spinlock);
+	local_irq_restore(flags);
+	if (nr <= 0)
 		goto out;
-	}
-	list_for_each_entry(zbpg, &zbud_buddied_list, bud_list) {
-		if (unlikely(!spin_trylock(&zbpg->lock)))
+
+	/* now evict from the pools in priority order */
+	for (i = 0, n = 0; i < MAX_POOLS_PER_CLIENT; i++) {
+		if (!atomic_read(&zbud_pools[i].raw_pages))
 			continue;
-		list_del_init(&zbpg->bud_list);
-		zcache_zbud_buddied_count--;
-		spin_unlock(&zbud_budlists_spinlock);
-		zcache_evicted_buddied_pages++;
-		/* want budlists unlocked when doing zbpg eviction */
-		zbud_evict_zbpg(zbpg);
-		local_bh_enable();
-		if (--nr <= 0)
-			goto out;
-		goto retry_bud_list;
+		for (j = n; j > 0 && zbud_evict_before(i, order[j - 1]); j--)
+			order[j] = order[j - 1];
+		order[j] = i;
+		n++;
 	}
-	spin_unlock_bh(&zbud_budlists_spinlock);
+	for (i = 0; i < n && nr > 0; i++)
+		nr -= zbud_evict_pool(&zbud_pools[order[i]], nr);
 out:
 	return;
 }
 
-static void zbud_init(void)
+/*
+ * Hand the unused pages of a cpu going away to the global list
+ */
+static void zbud_cpu_dead(int cpu)
 {
-	int i;
+	struct zbpg_pcp *pcp = &per_cpu(zbpg_pcp, cpu);
 
-	INIT_LIST_HEAD(&zbud_buddied_list);
-	zcache_zbud_buddied_count = 0;
-	for (i = 0; i < NCHUNKS; i++) {
-		INIT_LIST_HEAD(&zbud_unbuddied[i].list);
-		zbud_unbuddied[i].count = 0;
+	if (!pcp->count)
+		return;
+	spin_lock_bh(&zbpg_unused_list_spinlock);
+	list_splice_init(&pcp->list, &zbpg_unused_list);
+	zcache_zbpg_unused_list_count += pcp->count;
+	pcp->count = 0;
+	spin_unlock_bh(&zbpg_unused_list_spinlock);
+}
+
+static void zbud_init(void)
+{
+	struct zbud_pool *zbp;
+	int i, j, cpu;
+
+	for (i = 0; i < MAX_POOLS_PER_CLIENT; i++) {
+		zbp = &zbud_pools[i];
+		spin_lock_init(&zbp->lock);
+		for (j = 0; j < NCHUNKS; j++) {
+			INIT_LIST_HEAD(&zbp->unbuddied[j].list);
+			zbp->unbuddied[j].count = 0;
+		}
+		INIT_LIST_HEAD(&zbp->lru);
+		zbp->buddied_count = 0;
+		atomic_set(&zbp->raw_pages, 0);
+	}
+	for_each_possible_cpu(cpu) {
+		INIT_LIST_HEAD(&per_cpu(zbpg_pcp, cpu).list);
+		per_cpu(zbpg_pcp, cpu).count = 0;
 	}
 }
 
@@ -549,15 +666,29 @@ static void zbud_init(void)
  */
 static int zbud_show_unbuddied_list_counts(char *buf)
 {
-	int i;
+	int i, j;
+	unsigned count;
 	char *p = buf;
 
-	for (i = 0; i < NCHUNKS - 1; i++)
-		p += sprintf(p, "%u ", zbud_unbuddied[i].count);
-	p += sprintf(p, "%d\n", zbud_unbuddied[i].count);
+	for (i = 0; i < NCHUNKS; i++) {
+		count = 0;
+		for (j = 0; j < MAX_POOLS_PER_CLIENT; j++)
+			count += zbud_pools[j].unbuddied[i].count;
+		p += sprintf(p, i < NCHUNKS - 1 ? "%u " : "%u\n", count);
+	}
 	return p - buf;
 }
 
+static int zbud_show_buddied_count(char *buf)
+{
+	unsigned long count = 0;
+	int i;
+
+	for (i = 0; i < MAX_POOLS_PER_CLIENT; i++)
+		count += zbud_pools[i].buddied_count;
+	return sprintf(buf, "%lu\n", count);
+}
+
 static int zbud_show_cumul_chunk_counts(char *buf)
 {
 	unsigned long i, chunks = 0, total_chunks = 0, sum_total_chunks = 0;
@@ -585,12 +716,13 @@ static int zbud_show_cumul_chunk_counts(char *buf)
 #endif
 
 /**********
- * This "zv" PAM implementation combines the TLSF-based xvMalloc
+ * This "zv" PAM implementation combines the size-class based zsmalloc
  * with lzo1x compression to maximize the amount of data that can
  * be packed into a physical page.
  *
  * Zv represents a PAM page with the index and object (plus a "size" value
  * necessary for decompression) immediately preceding the compressed data.
+ * The pampd is the zsmalloc handle of the zv.
  */
 
 #define ZVH_SENTINEL  0x43214321
@@ -599,67 +731,69 @@ struct zv_hdr {
 	uint32_t pool_id;
 	struct tmem_oid oid;
 	uint32_t index;
+	uint16_t size;
 	DECL_SENTINEL
 };
 
 static const int zv_max_page_size = (PAGE_SIZE / 8) * 7;
 
-static struct zv_hdr *zv_create(struct xv_pool *xvpool, uint32_t pool_id,
+static unsigned long zv_create(struct zs_pool *zspool, uint32_t pool_id,
 				struct tmem_oid *oid, uint32_t index,
 				void *cdata, unsigned clen)
 {
-	struct page *page;
-	struct zv_hdr *zv = NULL;
-	uint32_t offset;
-	int ret;
+	struct zv_hdr *zv;
+	unsigned long handle;
 
 	BUG_ON(!irqs_disabled());
-	ret = xv_malloc(xvpool, clen + sizeof(struct zv_hdr),
-			&page, &offset, ZCACHE_GFP_MASK);
-	if (unlikely(ret))
+	handle = zs_malloc(zspool, clen + sizeof(struct zv_hdr));
+	if (unlikely(!handle))
 		goto out;
-	zv = kmap_atomic(page, KM_USER0) + offset;
+	zv = zs_map_object(zspool, handle);
 	zv->index = index;
 	zv->oid = *oid;
 	zv->pool_id = pool_id;
+	zv->size = clen;
 	SET_SENTINEL(zv, ZVH);
 	memcpy((char *)zv + sizeof(struct zv_hdr), cdata, clen);
-	kunmap_atomic(zv, KM_USER0);
+	zs_unmap_object(zspool, handle);
 out:
-	return zv;
+	return handle;
 }
 
-static void zv_free(struct xv_pool *xvpool, struct zv_hdr *zv)
+static void zv_free(struct zs_pool *zspool, unsigned long handle)
 {
 	unsigned long flags;
-	struct page *page;
-	uint32_t offset;
+	struct zv_hdr *zv;
 	uint16_t size;
 
+	local_irq_save(flags);
+	zv = zs_map_object(zspool, handle);
 	ASSERT_SENTINEL(zv, ZVH);
-	size = xv_get_object_size(zv) - sizeof(*zv);
+	size = zv->size;
 	BUG_ON(size == 0 || size > zv_max_page_size);
 	INVERT_SENTINEL(zv, ZVH);
-	page = virt_to_page(zv);
-	offset = (unsigned long)zv & ~PAGE_MASK;
-	local_irq_save(flags);
-	xv_free(xvpool, page, offset);
+	zs_unmap_object(zspool, handle);
+	zs_free(zspool, handle);
 	local_irq_restore(flags);
 }
 
-static void zv_decompress(struct page *page, struct zv_hdr *zv)
+static void zv_decompress(struct zs_pool *zspool, struct page *page,
+			  unsigned long handle)
 {
 	size_t clen = PAGE_SIZE;
+	struct zv_hdr *zv;
 	char *to_va;
 	unsigned size;
 	int ret;
 
+	to_va = kmap_atomic(page, KM_USER0);
+	zv = zs_map_object(zspool, handle);
 	ASSERT_SENTINEL(zv, ZVH);
-	size = xv_get_object_size(zv) - sizeof(*zv);
+	size = zv->size;
 	BUG_ON(size == 0 || size > zv_max_page_size);
-	to_va = kmap_atomic(page, KM_USER0);
 	ret = lzo1x_decompress_safe((char *)zv + sizeof(*zv),
 					size, to_va, &clen);
+	zs_unmap_object(zspool, handle);
 	kunmap_atomic(to_va, KM_USER0);
 	BUG_ON(ret != LZO_E_OK);
 	BUG_ON(clen != PAGE_SIZE);
@@ -677,11 +811,9 @@ static unsigned long zcache_flobj_found;
 static unsigned long zcache_failed_eph_puts;
 static unsigned long zcache_failed_pers_puts;
 
-#define MAX_POOLS_PER_CLIENT 16
-
 static struct {
 	struct tmem_pool *tmem_pools[MAX_POOLS_PER_CLIENT];
-	struct xv_pool *xvpool;
+	struct zs_pool *zspool;
 } zcache_client;
 
 /*
@@ -942,7 +1074,7 @@ static void *zcache_pampd_create(struct tmem_pool *pool, struct tmem_oid *oid,
 			zcache_compress_poor++;
 			goto out;
 		}
-		pampd = (void *)zv_create(zcache_client.xvpool, pool->pool_id,
+		pampd = (void *)zv_create(zcache_client.zspool, pool->pool_id,
 						oid, index, cdata, clen);
 		if (pampd == NULL)
 			goto out;
@@ -966,7 +1098,8 @@ static int zcache_pampd_get_data(struct page *page, void *pampd,
 	if (is_ephemeral(pool))
 		ret = zbud_decompress(page, pampd);
 	else
-		zv_decompress(page, pampd);
+		zv_decompress(zcache_client.zspool, page,
+			      (unsigned long)pampd);
 	return ret;
 }
 
@@ -981,7 +1114,7 @@ static void zcache_pampd_free(void *pampd, struct tmem_pool *pool)
 		atomic_dec(&zcache_curr_eph_pampd_count);
 		BUG_ON(atomic_read(&zcache_curr_eph_pampd_count) < 0);
 	} else {
-		zv_free(zcache_client.xvpool, (struct zv_hdr *)pampd);
+		zv_free(zcache_client.zspool, (unsigned long)pampd);
 		atomic_dec(&zcache_curr_pers_pampd_count);
 		BUG_ON(atomic_read(&zcache_curr_pers_pampd_count) < 0);
 	}
@@ -1041,6 +1174,7 @@ static int zcache_cpu_notifier(struct notifier_block *nb,
 		break;
 	case CPU_DEAD:
 	case CPU_UP_CANCELED:
+		zbud_cpu_dead(cpu);
 		free_pages((unsigned long)per_cpu(zcache_dstmem, cpu),
 				LZO_DSTMEM_PAGE_ORDER);
 		per_cpu(zcache_dstmem, cpu) = NULL;
@@ -1067,6 +1201,19 @@ static struct notifier_block zcache_cpu_notifier_block = {
 };
 
 #ifdef CONFIG_SYSFS
+static int zv_show_pool_stats(char *buf)
+{
+	struct zs_pool_stats stats;
+
+	if (zcache_client.zspool == NULL)
+		return sprintf(buf, "pages:0 frag_bytes:0 compacted:0\n");
+	zs_get_stats(zcache_client.zspool, &stats);
+	return sprintf(buf, "pages:%lu frag_bytes:%llu compacted:%lu\n",
+		stats.pages_allocated,
+		((u64)stats.pages_allocated << PAGE_SHIFT) - stats.obj_bytes,
+		stats.pages_compacted);
+}
+
 #define ZCACHE_SYSFS_RO(_name) \
 	static ssize_t zcache_##_name##_show(struct kobject *kobj, \
 				struct kobj_attribute *attr, char *buf) \
@@ -1111,7 +1258,6 @@ ZCACHE_SYSFS_RO(failed_pers_puts);
 ZCACHE_SYSFS_RO(zbud_curr_zbytes);
 ZCACHE_SYSFS_RO(zbud_cumul_zpages);
 ZCACHE_SYSFS_RO(zbud_cumul_zbytes);
-ZCACHE_SYSFS_RO(zbud_buddied_count);
 ZCACHE_SYSFS_RO(zbpg_unused_list_count);
 ZCACHE_SYSFS_RO(evicted_raw_pages);
 ZCACHE_SYSFS_RO(evicted_unbuddied_pages);
@@ -1130,6 +1276,48 @@ ZCACHE_SYSFS_RO_CUSTOM(zbud_unbuddied_list_counts,
 			zbud_show_unbuddied_list_counts);
 ZCACHE_SYSFS_RO_CUSTOM(zbud_cumul_chunk_counts,
 			zbud_show_cumul_chunk_counts);
+ZCACHE_SYSFS_RO_CUSTOM(zbud_buddied_count, zbud_show_buddied_count);
+ZCACHE_SYSFS_RO_CUSTOM(zv_pool_stats, zv_show_pool_stats);
+
+/*
+ * Shows "pool_id:priority:zbud_pages" for each pool.  Writing
+ * "pool_id priority" sets the eviction priority of a pool: pools with
+ * lower priority are evicted from first.
+ */
+static ssize_t zcache_zbud_pool_priority_show(struct kobject *kobj,
+				struct kobj_attribute *attr, char *buf)
+{
+	char *p = buf;
+	int i;
+
+	for (i = 0; i < MAX_POOLS_PER_CLIENT; i++)
+		if (zcache_client.tmem_pools[i] != NULL)
+			p += sprintf(p, "%d:%d:%d ", i, zbud_pools[i].priority,
+				     atomic_read(&zbud_pools[i].raw_pages));
+	p += sprintf(p, "\n");
+	return p - buf;
+}
+
+static ssize_t zcache_zbud_pool_priority_store(struct kobject *kobj,
+				struct kobj_attribute *attr,
+				const char *buf, size_t count)
+{
+	int pool_id, priority;
+
+	if (sscanf(buf, "%d %d", &pool_id, &priority) != 2)
+		return -EINVAL;
+	if (pool_id < 0 || pool_id >= MAX_POOLS_PER_CLIENT ||
+	    zcache_client.tmem_pools[pool_id] == NULL)
+		return -EINVAL;
+	zbud_pools[pool_id].priority = priority;
+	return count;
+}
+
+static struct kobj_attribute zcache_zbud_pool_priority_attr = {
+	.attr = { .name = "zbud_pool_priority", .mode = 0644 },
+	.show = zcache_zbud_pool_priority_show,
+	.store = zcache_zbud_pool_priority_store,
+};
 
 static struct attribute *zcache_attrs[] = {
 	&zcache_curr_obj_count_attr.attr,
@@ -1160,6 +1348,8 @@ static struct attribute *zcache_attrs[] = {
 	&zcache_aborted_shrink_attr.attr,
 	&zcache_zbud_unbuddied_list_counts_attr.attr,
 	&zcache_zbud_cumul_chunk_counts_attr.attr,
+	&zcache_zv_pool_stats_attr.attr,
+	&zcache_zbud_pool_priority_attr.attr,
 	NULL,
 };
 
@@ -1179,7 +1369,8 @@ static struct attribute_group zcache_attr_group = {
 static bool zcache_freeze;
 
 /*
- * zcache shrinker interface (only useful for ephemeral pages, so zbud only)
+ * zcache shrinker interface (evicts ephemeral pages, so zbud only, but
+ * also compacts the persistent pages)
  */
 static int shrink_zcache_memory(struct shrinker *shrink,
 				struct shrink_control *sc)
@@ -1197,6 +1388,8 @@ static int shrink_zcache_memory(struct shrinker *shrink,
 			spin_unlock(&zcache_direct_reclaim_lock);
 		} else
 			zcache_aborted_shrink++;
+		if (nr > 0 && zcache_client.zspool != NULL)
+			zs_compact(zcache_client.zspool);
 	}
 	ret = (int)atomic_read(&zcache_zbud_curr_raw_pages);
 out:
@@ -1349,6 +1542,7 @@ static int zcache_new_pool(uint32_t flags)
 	pool->client = &zcache_client;
 	pool->pool_id = poolid;
 	tmem_new_pool(pool, flags);
+	zbud_pools[poolid].priority = 0;
 	zcache_client.tmem_pools[poolid] = pool;
 	pr_info("zcache: created %s tmem pool, id=%d\n",
 		flags & TMEM_POOL_PERSIST ? "persistent" : "ephemeral",
@@ -1642,14 +1836,14 @@ static int __init zcache_init(void)
 	if (zcache_enabled && use_frontswap) {
 		struct frontswap_ops old_ops;
 
-		zcache_client.xvpool = xv_create_pool();
-		if (zcache_client.xvpool == NULL) {
-			pr_err("zcache: can't create xvpool\n");
+		zcache_client.zspool = zs_create_pool(ZCACHE_GFP_MASK);
+		if (zcache_client.zspool == NULL) {
+			pr_err("zcache: can't create zspool\n");
 			goto out;
 		}
 		old_ops = zcache_frontswap_register_ops();
 		pr_info("zcache: frontswap enabled using kernel "
-			"transcendent memory and xvmalloc\n");
+			"transcendent memory and zsmalloc\n");
 		if (old_ops.init != NULL)
 			pr_warning("ktmem: frontswap_ops overridden");
 	}
@@ -0,0 +1,111 @@
+/*
+ * Compressed RAM block device
+ *
+ * Compression backends
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/types.h>
+#include <linux/lzo.h>
+
+#include "zram_drv.h"
+
+#ifdef CONFIG_ZRAM_SNAPPY
+#include "../snappy/csnappy.h"
+#endif
+
+static int zram_lzo_compress(const unsigned char *src, unsigned char *dst,
+			     size_t *dst_len, void *workmem)
+{
+	return lzo1x_1_compress(src, PAGE_SIZE, dst, dst_len, workmem) ==
+		LZO_E_OK ? 0 : -EINVAL;
+}
+
+static int zram_lzo_decompress(const unsigned char *src, size_t src_len,
+			       unsigned char *dst)
+{
+	size_t dst_len = PAGE_SIZE;
+	int ret;
+
+	ret = lzo1x_decompress_safe(src, src_len, dst, &dst_len);
+	return ret == LZO_E_OK && dst_len == PAGE_SIZE ? 0 : -EINVAL;
+}
+
+#ifdef CONFIG_ZRAM_SNAPPY
+static int zram_snappy_compress(const unsigned char *src, unsigned char *dst,
+				size_t *dst_len, void *workmem)
+{
+	uint32_t len;
+
+	csnappy_compress(src, PAGE_SIZE, dst, &len, workmem,
+			 CSNAPPY_WORKMEM_BYTES_POWER_OF_TWO);
+	*dst_len = len;
+	return 0;
+}
+
+static int zram_snappy_decompress(const unsigned char *src, size_t src_len,
+				  unsigned char *dst)
+{
+	return csnappy_decompress(src, src_len, dst, PAGE_SIZE) ==
+		CSNAPPY_E_OK ? 0 : -EINVAL;
+}
+#endif
+
+/* The first backend is the default, LZO is always built */
+static const struct zram_backend zram_backends[] = {
+	{
+		.name = "lzo",
+		.workmem_size = LZO1X_MEM_COMPRESS,
+		.compress = zram_lzo_compress,
+		.decompress = zram_lzo_decompress,
+	},
+#ifdef CONFIG_ZRAM_SNAPPY
+	{
+		.name = "snappy",
+		.workmem_size = CSNAPPY_WORKMEM_BYTES,
+		.compress = zram_snappy_compress,
+		.decompress = zram_snappy_decompress,
+	},
+#endif
+};
+
+const struct zram_backend *zram_default_backend(void)
+{
+	return &zram_backends[0];
+}
+
+const struct zram_backend *zram_find_backend(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(zram_backends); i++)
+		if (sysfs_streq(name, zram_backends[i].name))
+			return &zram_backends[i];
+
+	return NULL;
+}
+
+/*
+ * Lists the available backends, with the one in use in brackets.
+ */
+ssize_t zram_show_backends(const struct zram_backend *cur, char *buf)
+{
+	ssize_t len = 0;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(zram_backends); i++) {
+		const char *fmt = &zram_backends[i] == cur ? "[%s] " : "%s ";
+
+		len += sprintf(buf + len, fmt, zram_backends[i].name);
+	}
+	buf[len - 1] = '\n';
+
+	return len;
+}
@@ -29,9 +29,13 @@
 #include <linux/genhd.h>
 #include <linux/highmem.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
+#include <linux/cpumask.h>
+#include <linux/ktime.h>
+#include <linux/jhash.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
 
 #include "zram_drv.h"
 
@@ -42,33 +46,146 @@ struct zram *devices;
 /* Module params (documentation at end) */
 unsigned int num_devices;
 
-static void zram_stat_inc(u32 *v)
+static void zram_stat_inc(atomic_t *v)
 {
-	*v = *v + 1;
+	atomic_inc(v);
 }
 
-static void zram_stat_dec(u32 *v)
+static void zram_stat_dec(atomic_t *v)
 {
-	*v = *v - 1;
+	atomic_dec(v);
 }
 
-static void zram_stat64_add(struct zram *zram, u64 *v, u64 inc)
+static void zram_stat64_add(atomic64_t *v, u64 inc)
 {
-	spin_lock(&zram->stat64_lock);
-	*v = *v + inc;
-	spin_unlock(&zram->stat64_lock);
+	atomic64_add(inc, v);
 }
 
-static void zram_stat64_sub(struct zram *zram, u64 *v, u64 dec)
+static void zram_stat64_sub(atomic64_t *v, u64 dec)
 {
-	spin_lock(&zram->stat64_lock);
-	*v = *v - dec;
-	spin_unlock(&zram->stat64_lock);
+	atomic64_sub(dec, v);
 }
 
-static void zram_stat64_inc(struct zram *zram, u64 *v)
+static void zram_stat64_inc(atomic64_t *v)
 {
-	zram_stat64_add(zram, v, 1);
+	zram_stat64_add(v, 1);
+}
+
+static spinlock_t *zram_slot_lock(struct zram *zram, u32 index)
+{
+	return &zram->slot_lock[index % ZRAM_SLOT_LOCKS];
+}
+
+/* Memory holding stored pages, in pages */
+static unsigned long zram_mem_used_pages(struct zram *zram)
+{
+	return (zs_get_total_size_bytes(zram->mem_pool) >> PAGE_SHIFT) +
+		atomic_read(&zram->stats.pages_expand);
+}
+
+/*
+ * Checks that the memory in use, plus 'extra' pages not accounted yet,
+ * is within the limit and records it as the new peak if it is one.
+ */
+static int zram_check_mem_limit(struct zram *zram, unsigned long extra)
+{
+	unsigned long used = zram_mem_used_pages(zram) + extra;
+	unsigned long max, old;
+
+	if (zram->limit_pages && used > zram->limit_pages)
+		return -ENOMEM;
+
+	max = atomic_long_read(&zram->stats.max_used_pages);
+	while (used > max) {
+		old = atomic_long_cmpxchg(&zram->stats.max_used_pages,
+					  max, used);
+		if (old == max)
+			break;
+		max = old;
+	}
+
+	return 0;
+}
+
+void zram_reset_mem_used_max(struct zram *zram)
+{
+	atomic_long_set(&zram->stats.max_used_pages,
+			zram_mem_used_pages(zram));
+}
+
+static void zram_free_streams(struct zram *zram)
+{
+	struct zram_stream *zstrm, *tmp;
+
+	list_for_each_entry_safe(zstrm, tmp, &zram->idle_streams, list) {
+		list_del(&zstrm->list);
+		kfree(zstrm->workmem);
+		free_pages((unsigned long)zstrm->buffer, 1);
+		kfree(zstrm);
+	}
+	zram->num_streams = 0;
+}
+
+static int zram_alloc_streams(struct zram *zram)
+{
+	struct zram_stream *zstrm;
+	int i;
+
+	for (i = 0; i < num_possible_cpus(); i++) {
+		zstrm = kzalloc(sizeof(*zstrm), GFP_KERNEL);
+		if (!zstrm)
+			return -ENOMEM;
+		list_add(&zstrm->list, &zram->idle_streams);
+		zram->num_streams++;
+
+		zstrm->workmem = kzalloc(zram->backend->workmem_size,
+					 GFP_KERNEL);
+		zstrm->buffer = (void *)__get_free_pages(GFP_KERNEL |
+							 __GFP_ZERO, 1);
+		if (!zstrm->workmem || !zstrm->buffer)
+			return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/*
+ * Takes an idle compression stream, waiting for one if all of them are
+ * busy.
+ */
+static struct zram_stream *zram_get_stream(struct zram *zram)
+{
+	struct zram_stream *zstrm;
+
+	spin_lock(&zram->stream_lock);
+	while (list_empty(&zram->idle_streams)) {
+		spin_unlock(&zram->stream_lock);
+		zram_stat64_inc(&zram->stats.stream_waits);
+		wait_event(zram->stream_wait,
+			   !list_empty(&zram->idle_streams));
+		spin_lock(&zram->stream_lock);
+	}
+
+	zstrm = list_first_entry(&zram->idle_streams, struct zram_stream,
+				 list);
+	list_del(&zstrm->list);
+	if (++zram->busy_streams > zram->stats.max_busy_streams)
+		zram->stats.max_busy_streams = zram->busy_streams;
+	spin_unlock(&zram->stream_lock);
+
+	return zstrm;
+}
+
+static void zram_put_stream(struct zram *zram, struct zram_stream *zstrm)
+{
+	spin_lock(&zram->stream_lock);
+	list_add(&zstrm->list, &zram->idle_streams);
+	zram->busy_streams--;
+	spin_unlock(&zram->stream_lock);
+
+	smp_mb();
+	if (waitqueue_active(&zram->stream_wait))
+		wake_up(&zram->stream_wait);
 }
 
 static int zram_test_flag(struct zram *zram, u32 index,
@@ -89,21 +206,105 @@ static void zram_clear_flag(struct zram *zram, u32 index,
 	zram->table[index].flags &= ~BIT(flag);
 }
 
-static int page_zero_filled(void *ptr)
+static int page_same_filled(void *ptr, unsigned long *element)
 {
 	unsigned int pos;
 	unsigned long *page;
 
 	page = (unsigned long *)ptr;
 
-	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
-		if (page[pos])
+	for (pos = 1; pos != PAGE_SIZE / sizeof(*page); pos++) {
+		if (page[pos] != page[0])
 			return 0;
 	}
 
+	*element = page[0];
 	return 1;
 }
 
+/*
+ * Looks for a stored object with the same compressed data and takes a
+ * reference to it.
+ */
+static struct zram_dedup_entry *zram_dedup_get(struct zram *zram,
+		const unsigned char *data, u32 clen, u32 hash)
+{
+	struct zram_dedup_entry *entry;
+	struct hlist_node *pos;
+	struct hlist_head *head;
+	unsigned char *cmem;
+	int same;
+
+	head = &zram->dedup_hash[hash % ZRAM_DEDUP_BUCKETS];
+
+	spin_lock(&zram->dedup_lock);
+	hlist_for_each_entry(entry, pos, head, node) {
+		if (entry->hash != hash || entry->clen != clen)
+			continue;
+
+		cmem = zs_map_object(zram->mem_pool, entry->handle);
+		same = !memcmp(cmem + sizeof(struct zobj_header), data, clen);
+		zs_unmap_object(zram->mem_pool, entry->handle);
+		if (same) {
+			entry->refcount++;
+			spin_unlock(&zram->dedup_lock);
+			return entry;
+		}
+	}
+	spin_unlock(&zram->dedup_lock);
+
+	return NULL;
+}
+
+static struct zram_dedup_entry *zram_dedup_add(struct zram *zram,
+		unsigned long handle, u32 clen, u32 hash)
+{
+	struct zram_dedup_entry *entry;
+
+	entry = kmalloc(sizeof(*entry), GFP_NOIO);
+	if (!entry)
+		return NULL;
+
+	entry->hash = hash;
+	entry->clen = clen;
+	entry->refcount = 1;
+	entry->handle = handle;
+
+	spin_lock(&zram->dedup_lock);
+	hlist_add_head(&entry->node,
+		       &zram->dedup_hash[hash % ZRAM_DEDUP_BUCKETS]);
+	spin_unlock(&zram->dedup_lock);
+
+	return entry;
+}
+
+/*
+ * Drops a slot's reference to a shared object, freeing the object with
+ * the last one. Returns the compressed size of the object.
+ */
+static u32 zram_dedup_put(struct zram *zram, struct zram_dedup_entry *entry)
+{
+	u32 clen = entry->clen;
+
+	spin_lock(&zram->dedup_lock);
+	if (--entry->refcount) {
+		spin_unlock(&zram->dedup_lock);
+		zram_stat_dec(&zram->stats.pages_dup);
+		zram_stat64_sub(&zram->stats.dup_saved, clen);
+		return clen;
+	}
+	hlist_del(&entry->node);
+	spin_unlock(&zram->dedup_lock);
+
+	zs_free(zram->mem_pool, entry->handle);
+	kfree(entry);
+
+	if (clen <= PAGE_SIZE / 2)
+		zram_stat_dec(&zram->stats.good_compress);
+	zram_stat64_sub(&zram->stats.compr_size, clen);
+	return clen;
+}
+
 static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 {
 	if (!zram->disksize) {
@@ -133,56 +334,158 @@ static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 	zram->disksize &= PAGE_MASK;
 }
 
+static unsigned long zram_alloc_block(struct zram *zram)
+{
+	unsigned long block;
+
+	spin_lock(&zram->block_lock);
+	block = find_first_zero_bit(zram->block_map, zram->nr_blocks);
+	if (block < zram->nr_blocks)
+		__set_bit(block, zram->block_map);
+	spin_unlock(&zram->block_lock);
+
+	return block;
+}
+
+static void zram_free_block(struct zram *zram, unsigned long block)
+{
+	spin_lock(&zram->block_lock);
+	__clear_bit(block, zram->block_map);
+	spin_unlock(&zram->block_lock);
+}
+
+struct zram_bio_wait {
+	struct completion done;
+	int error;
+};
+
+static void zram_bio_end_io(struct bio *bio, int error)
+{
+	struct zram_bio_wait *wait = bio->bi_private;
+
+	wait->error = error;
+	complete(&wait->done);
+}
+
+/*
+ * Synchronously reads or writes one page of the backing device. Must not
+ * be called from zram_make_request(), where bios to other devices are
+ * only submitted after it returns.
+ */
+static int zram_bdev_rw(struct zram *zram, int rw, struct page *page,
+			unsigned long block)
+{
+	struct zram_bio_wait wait;
+	struct bio *bio;
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_bdev = zram->bdev;
+	bio->bi_sector = (sector_t)block << SECTORS_PER_PAGE_SHIFT;
+	if (!bio_add_page(bio, page, PAGE_SIZE, 0)) {
+		bio_put(bio);
+		return -EIO;
+	}
+
+	init_completion(&wait.done);
+	bio->bi_private = &wait;
+	bio->bi_end_io = zram_bio_end_io;
+	submit_bio(rw | REQ_SYNC, bio);
+	wait_for_completion(&wait.done);
+	bio_put(bio);
+
+	if (rw == WRITE)
+		zram_stat64_inc(&zram->stats.bd_writes);
+	else
+		zram_stat64_inc(&zram->stats.bd_reads);
+
+	return wait.error;
+}
+
+/*
+ * Caller must hold the slot lock of 'index'.
+ */
 static void zram_free_page(struct zram *zram, size_t index)
 {
 	u32 clen;
-	void *obj;
-
-	struct page *page = zram->table[index].page;
-	u32 offset = zram->table[index].offset;
-
-	if (unlikely(!page)) {
-		/*
-		 * No memory is allocated for zero filled pages.
-		 * Simply clear zero page flag.
-		 */
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			zram_clear_flag(zram, index, ZRAM_ZERO);
+	unsigned long handle = zram->table[index].handle;
+
+	zram_clear_flag(zram, index, ZRAM_IDLE);
+	/* tell a writeback in progress that the slot changed */
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		/* a reader still uses the block, it frees it when done */
+		if (zram->table[index].count)
+			zram_set_flag(zram, index, ZRAM_WB_STALE);
+		else
+			zram_free_block(zram, zram->table[index].block);
+		zram_clear_flag(zram, index, ZRAM_WB);
+		atomic_dec(&zram->stats.bd_count);
+		zram_stat_dec(&zram->stats.pages_stored);
+		zram->table[index].block = 0;
+		return;
+	}
+
+	/*
+	 * No memory is allocated for same filled pages.
+	 * Simply clear same page flag.
+	 */
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		zram_clear_flag(zram, index, ZRAM_SAME);
+		if (zram->table[index].element)
+			zram_stat_dec(&zram->stats.pages_same);
+		else
 			zram_stat_dec(&zram->stats.pages_zero);
-		}
+		zram->table[index].element = 0;
+		return;
+	}
+
+	if (unlikely(!handle))
+		return;
+
+	if (zram_test_flag(zram, index, ZRAM_DEDUP)) {
+		zram_dedup_put(zram, zram->table[index].entry);
+		zram_clear_flag(zram, index, ZRAM_DEDUP);
+		zram_stat_dec(&zram->stats.pages_stored);
+		zram->table[index].entry = NULL;
 		return;
 	}
 
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 		clen = PAGE_SIZE;
-		__free_page(page);
+		__free_page(zram->table[index].page);
 		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
 		zram_stat_dec(&zram->stats.pages_expand);
 		goto out;
 	}
 
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
-
-	xv_free(zram->mem_pool, page, offset);
+	clen = zram->table[index].size;
+	zs_free(zram->mem_pool, handle);
 	if (clen <= PAGE_SIZE / 2)
 		zram_stat_dec(&zram->stats.good_compress);
 
 out:
-	zram_stat64_sub(zram, &zram->stats.compr_size, clen);
+	zram_stat64_sub(&zram->stats.compr_size, clen);
 	zram_stat_dec(&zram->stats.pages_stored);
 
-	zram->table[index].page = NULL;
-	zram->table[index].offset = 0;
+	zram->table[index].handle = 0;
+	zram->table[index].size = 0;
 }
 
-static void handle_zero_page(struct page *page)
+static void handle_same_page(struct page *page, unsigned long element)
 {
-	void *user_mem;
+	unsigned long *user_mem;
+	int i;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	memset(user_mem, 0, PAGE_SIZE);
+	if (!element)
+		memset(user_mem, 0, PAGE_SIZE);
+	else
+		for (i = 0; i < PAGE_SIZE / sizeof(*user_mem); i++)
+			user_mem[i] = element;
 	kunmap_atomic(user_mem, KM_USER0);
 
 	flush_dcache_page(page);
@@ -194,8 +497,7 @@ static void handle_uncompressed_page(struct zram *zram,
 	unsigned char *user_mem, *cmem;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-			zram->table[index].offset;
+	cmem = kmap_atomic(zram->table[index].page, KM_USER1);
 
 	memcpy(user_mem, cmem, PAGE_SIZE);
 	kunmap_atomic(user_mem, KM_USER0);
@@ -204,196 +506,345 @@ static void handle_uncompressed_page(struct zram *zram,
 	flush_dcache_page(page);
 }
 
-static void zram_read(struct zram *zram, struct bio *bio)
+/*
+ * Reads slot 'index' into 'page'. Returns -EAGAIN for a page on the
+ * backing device unless 'can_sleep' is set.
+ */
+static int zram_read_page(struct zram *zram, struct page *page, u32 index,
+			  int can_sleep)
 {
+	int ret;
+	u32 clen;
+	ktime_t start;
+	unsigned long handle;
+	struct zobj_header *zheader;
+	unsigned char *user_mem, *cmem;
+	spinlock_t *lock = zram_slot_lock(zram, index);
 
-	int i;
-	u32 index;
-	struct bio_vec *bvec;
+	spin_lock(lock);
+	zram_clear_flag(zram, index, ZRAM_IDLE);
 
-	zram_stat64_inc(zram, &zram->stats.num_reads);
-	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		unsigned long block = zram->table[index].block;
 
-	bio_for_each_segment(bvec, bio, i) {
-		int ret;
-		size_t clen;
-		struct page *page;
-		struct zobj_header *zheader;
-		unsigned char *user_mem, *cmem;
+		if (!can_sleep) {
+			spin_unlock(lock);
+			return -EAGAIN;
+		}
+		/* pin the block against reuse while it is read */
+		zram->table[index].count++;
+		spin_unlock(lock);
 
-		page = bvec->bv_page;
+		ret = zram_bdev_rw(zram, READ, page, block);
 
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			handle_zero_page(page);
-			index++;
-			continue;
+		spin_lock(lock);
+		if (!--zram->table[index].count &&
+		    zram_test_flag(zram, index, ZRAM_WB_STALE)) {
+			zram_clear_flag(zram, index, ZRAM_WB_STALE);
+			zram_free_block(zram, block);
 		}
+		spin_unlock(lock);
 
-		/* Requested page is not present in compressed area */
-		if (unlikely(!zram->table[index].page)) {
-			pr_debug("Read before write: sector=%lu, size=%u",
-				(ulong)(bio->bi_sector), bio->bi_size);
-			handle_zero_page(page);
-			index++;
-			continue;
+		if (ret) {
+			zram_stat64_inc(&zram->stats.failed_reads);
+			return ret;
 		}
+		flush_dcache_page(page);
+		return 0;
+	}
 
-		/* Page is stored uncompressed since it's incompressible */
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-			handle_uncompressed_page(zram, page, index);
-			index++;
-			continue;
-		}
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		unsigned long element = zram->table[index].element;
 
-		user_mem = kmap_atomic(page, KM_USER0);
-		clen = PAGE_SIZE;
+		spin_unlock(lock);
+		handle_same_page(page, element);
+		return 0;
+	}
+
+	/* Requested page is not present in compressed area */
+	if (unlikely(!zram->table[index].handle)) {
+		spin_unlock(lock);
+		pr_debug("Read before write: page=%u\n", index);
+		handle_same_page(page, 0);
+		return 0;
+	}
 
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
+	/* Page is stored uncompressed since it's incompressible */
+	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
+		handle_uncompressed_page(zram, page, index);
+		spin_unlock(lock);
+		return 0;
+	}
 
-		ret = lzo1x_decompress_safe(
-			cmem + sizeof(*zheader),
-			xv_get_object_size(cmem) - sizeof(*zheader),
-			user_mem, &clen);
+	if (zram_test_flag(zram, index, ZRAM_DEDUP)) {
+		handle = zram->table[index].entry->handle;
+		clen = zram->table[index].entry->clen;
+	} else {
+		handle = zram->table[index].handle;
+		clen = zram->table[index].size;
+	}
 
-		kunmap_atomic(user_mem, KM_USER0);
-		kunmap_atomic(cmem, KM_USER1);
+	user_mem = kmap_atomic(page, KM_USER0);
+	cmem = zs_map_object(zram->mem_pool, handle);
 
-		/* Should NEVER happen. Return bio error if it does. */
-		if (unlikely(ret != LZO_E_OK)) {
-			pr_err("Decompression failed! err=%d, page=%u\n",
-				ret, index);
-			zram_stat64_inc(zram, &zram->stats.failed_reads);
-			goto out;
-		}
+	start = ktime_get();
+	ret = zram->backend->decompress(cmem + sizeof(*zheader), clen,
+					user_mem);
+	zram_stat64_add(&zram->stats.decompr_ns,
+			ktime_to_ns(ktime_sub(ktime_get(), start)));
 
-		flush_dcache_page(page);
-		index++;
+	zs_unmap_object(zram->mem_pool, handle);
+	kunmap_atomic(user_mem, KM_USER0);
+	spin_unlock(lock);
+
+	/* Should NEVER happen. Return bio error if it does. */
+	if (unlikely(ret)) {
+		pr_err("Decompression failed! err=%d, page=%u\n",
+			ret, index);
+		zram_stat64_inc(&zram->stats.failed_reads);
+		return -EIO;
 	}
 
-	set_bit(BIO_UPTODATE, &bio->bi_flags);
-	bio_endio(bio, 0);
-	return;
-
-out:
-	bio_io_error(bio);
+	flush_dcache_page(page);
+	return 0;
 }
 
-static void zram_write(struct zram *zram, struct bio *bio)
+static int zram_read_bio(struct zram *zram, struct bio *bio, int can_sleep)
 {
-	int i;
+	int i, ret;
 	u32 index;
 	struct bio_vec *bvec;
 
-	zram_stat64_inc(zram, &zram->stats.num_writes);
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
 	bio_for_each_segment(bvec, bio, i) {
-		int ret;
-		u32 offset;
-		size_t clen;
-		struct zobj_header *zheader;
-		struct page *page, *page_store;
-		unsigned char *user_mem, *cmem, *src;
-
-		page = bvec->bv_page;
-		src = zram->compress_buffer;
-
-		/*
-		 * System overwrites unused sectors. Free memory associated
-		 * with this sector now.
-		 */
-		if (zram->table[index].page ||
-				zram_test_flag(zram, index, ZRAM_ZERO))
-			zram_free_page(zram, index);
-
-		mutex_lock(&zram->lock);
-
-		user_mem = kmap_atomic(page, KM_USER0);
-		if (page_zero_filled(user_mem)) {
-			kunmap_atomic(user_mem, KM_USER0);
-			mutex_unlock(&zram->lock);
-			zram_stat_inc(&zram->stats.pages_zero);
-			zram_set_flag(zram, index, ZRAM_ZERO);
-			index++;
-			continue;
+		ret = zram_read_page(zram, bvec->bv_page, index, can_sleep);
+		if (ret)
+			return ret;
+		index++;
+	}
+
+	return 0;
+}
+
+static void zram_end_read(struct bio *bio, int ret)
+{
+	if (ret) {
+		bio_io_error(bio);
+		return;
+	}
+
+	set_bit(BIO_UPTODATE, &bio->bi_flags);
+	bio_endio(bio, 0);
+}
+
+/* Reads that touch the backing device are finished from a workqueue */
+struct zram_read_work {
+	struct work_struct work;
+	struct zram *zram;
+	struct bio *bio;
+};
+
+static void zram_read_work_fn(struct work_struct *work)
+{
+	struct zram_read_work *rw = container_of(work, struct zram_read_work,
+						 work);
+
+	zram_end_read(rw->bio, zram_read_bio(rw->zram, rw->bio, 1));
+	kfree(rw);
+}
+
+static void zram_read(struct zram *zram, struct bio *bio)
+{
+	struct zram_read_work *rw;
+	int ret;
+
+	zram_stat64_inc(&zram->stats.num_reads);
+
+	ret = zram_read_bio(zram, bio, 0);
+	if (ret == -EAGAIN) {
+		rw = kmalloc(sizeof(*rw), GFP_NOIO);
+		if (rw) {
+			INIT_WORK(&rw->work, zram_read_work_fn);
+			rw->zram = zram;
+			rw->bio = bio;
+			queue_work(system_unbound_wq, &rw->work);
+			return;
 		}
+	}
 
-		ret = lzo1x_1_compress(user_mem, PAGE_SIZE, src, &clen,
-					zram->compress_workmem);
+	zram_end_read(bio, ret);
+}
 
+static int zram_write_page(struct zram *zram, struct page *page, u32 index)
+{
+	int ret;
+	u32 hash = 0;
+	size_t clen;
+	ktime_t start;
+	unsigned long element, handle = 0;
+	struct zobj_header *zheader;
+	struct zram_stream *zstrm;
+	struct zram_dedup_entry *entry = NULL;
+	struct page *page_store = NULL;
+	unsigned char *user_mem, *cmem, *src;
+	spinlock_t *lock = zram_slot_lock(zram, index);
+
+	user_mem = kmap_atomic(page, KM_USER0);
+	if (page_same_filled(user_mem, &element)) {
 		kunmap_atomic(user_mem, KM_USER0);
+		spin_lock(lock);
+		zram_free_page(zram, index);
+		if (element)
+			zram_stat_inc(&zram->stats.pages_same);
+		else
+			zram_stat_inc(&zram->stats.pages_zero);
+		zram_set_flag(zram, index, ZRAM_SAME);
+		zram->table[index].element = element;
+		spin_unlock(lock);
+		return 0;
+	}
+	kunmap_atomic(user_mem, KM_USER0);
 
-		if (unlikely(ret != LZO_E_OK)) {
-			mutex_unlock(&zram->lock);
-			pr_err("Compression failed! err=%d\n", ret);
-			zram_stat64_inc(zram, &zram->stats.failed_writes);
-			goto out;
-		}
+	zstrm = zram_get_stream(zram);
+	src = zstrm->buffer;
+
+	user_mem = kmap_atomic(page, KM_USER0);
+	start = ktime_get();
+	ret = zram->backend->compress(user_mem, src, &clen, zstrm->workmem);
+	zram_stat64_add(&zram->stats.compr_ns,
+			ktime_to_ns(ktime_sub(ktime_get(), start)));
+	kunmap_atomic(user_mem, KM_USER0);
 
-		/*
-		 * Page is incompressible. Store it as-is (uncompressed)
-		 * since we do not want to return too many disk write
-		 * errors which has side effect of hanging the system.
-		 */
-		if (unlikely(clen > max_zpage_size)) {
-			clen = PAGE_SIZE;
-			page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
-			if (unlikely(!page_store)) {
-				mutex_unlock(&zram->lock);
-				pr_info("Error allocating memory for "
-					"incompressible page: %u\n", index);
-				zram_stat64_inc(zram,
-					&zram->stats.failed_writes);
-				goto out;
-			}
-
-			offset = 0;
-			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
-			zram_stat_inc(&zram->stats.pages_expand);
-			zram->table[index].page = page_store;
-			src = kmap_atomic(page, KM_USER0);
-			goto memstore;
+	if (unlikely(ret)) {
+		zram_put_stream(zram, zstrm);
+		pr_err("Compression failed! err=%d\n", ret);
+		zram_stat64_inc(&zram->stats.failed_writes);
+		return -EIO;
+	}
+
+	/*
+	 * Page is incompressible. Store it as-is (uncompressed)
+	 * since we do not want to return too many disk write
+	 * errors which has side effect of hanging the system.
+	 */
+	if (unlikely(clen > max_zpage_size)) {
+		zram_put_stream(zram, zstrm);
+		clen = PAGE_SIZE;
+		page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
+		if (unlikely(!page_store)) {
+			pr_info("Error allocating memory for "
+				"incompressible page: %u\n", index);
+			zram_stat64_inc(&zram->stats.failed_writes);
+			return -ENOMEM;
+		}
+		if (zram_check_mem_limit(zram, 1)) {
+			__free_page(page_store);
+			zram_stat64_inc(&zram->stats.failed_writes);
+			return -ENOMEM;
 		}
 
-		if (xv_malloc(zram->mem_pool, clen + sizeof(*zheader),
-				&zram->table[index].page, &offset,
-				GFP_NOIO | __GFP_HIGHMEM)) {
-			mutex_unlock(&zram->lock);
-			pr_info("Error allocating memory for compressed "
-				"page: %u, size=%zu\n", index, clen);
-			zram_stat64_inc(zram, &zram->stats.failed_writes);
-			goto out;
+		src = kmap_atomic(page, KM_USER0);
+		cmem = kmap_atomic(page_store, KM_USER1);
+		memcpy(cmem, src, clen);
+		kunmap_atomic(cmem, KM_USER1);
+		kunmap_atomic(src, KM_USER0);
+		goto stored;
+	}
+
+	if (zram->dedup_hash) {
+		hash = jhash(src, clen, 0);
+		entry = zram_dedup_get(zram, src, clen, hash);
+		if (entry) {
+			zram_put_stream(zram, zstrm);
+			goto install;
 		}
+	}
 
-memstore:
-		zram->table[index].offset = offset;
+	handle = zs_malloc(zram->mem_pool, clen + sizeof(*zheader));
+	if (!handle) {
+		zram_put_stream(zram, zstrm);
+		pr_info("Error allocating memory for compressed "
+			"page: %u, size=%zu\n", index, clen);
+		zram_stat64_inc(&zram->stats.failed_writes);
+		return -ENOMEM;
+	}
+
+	if (zram_check_mem_limit(zram, 0)) {
+		zs_free(zram->mem_pool, handle);
+		zram_put_stream(zram, zstrm);
+		zram_stat64_inc(&zram->stats.failed_writes);
+		return -ENOMEM;
+	}
 
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
+	cmem = zs_map_object(zram->mem_pool, handle);
 
 #if 0
-		/* Back-reference needed for memory defragmentation */
-		if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
-			zheader = (struct zobj_header *)cmem;
-			zheader->table_idx = index;
-			cmem += sizeof(*zheader);
-		}
+	/* Back-reference needed for memory defragmentation */
+	zheader = (struct zobj_header *)cmem;
+	zheader->table_idx = index;
+	cmem += sizeof(*zheader);
 #endif
 
-		memcpy(cmem, src, clen);
+	memcpy(cmem, src, clen);
 
-		kunmap_atomic(cmem, KM_USER1);
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			kunmap_atomic(src, KM_USER0);
+	zs_unmap_object(zram->mem_pool, handle);
+	zram_put_stream(zram, zstrm);
 
-		/* Update stats */
-		zram_stat64_add(zram, &zram->stats.compr_size, clen);
-		zram_stat_inc(&zram->stats.pages_stored);
-		if (clen <= PAGE_SIZE / 2)
-			zram_stat_inc(&zram->stats.good_compress);
+stored:
+	/* Update stats */
+	zram_stat64_add(&zram->stats.compr_size, clen);
+	if (clen <= PAGE_SIZE / 2)
+		zram_stat_inc(&zram->stats.good_compress);
 
-		mutex_unlock(&zram->lock);
+	/* Without an entry, the object is stored unshared */
+	if (!page_store && zram->dedup_hash)
+		entry = zram_dedup_add(zram, handle, clen, hash);
+
+install:
+	if (entry && entry->handle != handle) {
+		zram_stat_inc(&zram->stats.pages_dup);
+		zram_stat64_add(&zram->stats.dup_saved, clen);
+	}
+
+	/*
+	 * System overwrites unused sectors. Free memory associated
+	 * with this sector now.
+	 */
+	spin_lock(lock);
+	zram_free_page(zram, index);
+
+	if (entry) {
+		zram->table[index].entry = entry;
+		zram_set_flag(zram, index, ZRAM_DEDUP);
+	} else if (handle) {
+		zram->table[index].handle = handle;
+		zram->table[index].size = clen;
+	} else {
+		zram->table[index].page = page_store;
+	}
+	if (page_store) {
+		zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
+		zram_stat_inc(&zram->stats.pages_expand);
+	}
+	zram_stat_inc(&zram->stats.pages_stored);
+	spin_unlock(lock);
+
+	return 0;
+}
+
+static void zram_write(struct zram *zram, struct bio *bio)
+{
+	int i;
+	u32 index;
+	struct bio_vec *bvec;
+
+	zram_stat64_inc(&zram->stats.num_writes);
+	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
+
+	bio_for_each_segment(bvec, bio, i) {
+		if (zram_write_page(zram, bvec->bv_page, index))
+			goto out;
 		index++;
 	}
 
@@ -430,7 +881,7 @@ static int zram_make_request(struct request_queue *queue, struct bio *bio)
 	struct zram *zram = queue->queuedata;
 
 	if (!valid_io_request(zram, bio)) {
-		zram_stat64_inc(zram, &zram->stats.invalid_io);
+		zram_stat64_inc(&zram->stats.invalid_io);
 		bio_io_error(bio);
 		return 0;
 	}
@@ -461,37 +912,35 @@ void zram_reset_device(struct zram *zram)
 	zram->init_done = 0;
 
 	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
-
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+	zram_free_streams(zram);
 
 	/* Free all pages that are still in this zram device */
-	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
-		struct page *page;
-		u16 offset;
-
-		page = zram->table[index].page;
-		offset = zram->table[index].offset;
-
-		if (!page)
-			continue;
-
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			__free_page(page);
-		else
-			xv_free(zram->mem_pool, page, offset);
-	}
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++)
+		zram_free_page(zram, index);
 
 	vfree(zram->table);
 	zram->table = NULL;
 
-	xv_destroy_pool(zram->mem_pool);
+	kfree(zram->dedup_hash);
+	zram->dedup_hash = NULL;
+
+	if (zram->bdev) {
+		blkdev_put(zram->bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+		zram->bdev = NULL;
+	}
+	vfree(zram->block_map);
+	zram->block_map = NULL;
+	zram->nr_blocks = 0;
+	kfree(zram->backing_dev);
+	zram->backing_dev = NULL;
+
+	if (zram->mem_pool)
+		zs_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
 
 	/* Reset stats */
 	memset(&zram->stats, 0, sizeof(zram->stats));
+	zram->limit_pages = 0;
 
 	zram->disksize = 0;
 	mutex_unlock(&zram->init_lock);
@@ -511,17 +960,9 @@ int zram_init_device(struct zram *zram)
 
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail;
-	}
-
-	zram->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
+	ret = zram_alloc_streams(zram);
+	if (ret) {
+		pr_err("Error allocating compression streams\n");
 		goto fail;
 	}
 
@@ -535,12 +976,22 @@ int zram_init_device(struct zram *zram)
 		goto fail;
 	}
 
+	if (zram->dedup_enable) {
+		zram->dedup_hash = kcalloc(ZRAM_DEDUP_BUCKETS,
+				sizeof(*zram->dedup_hash), GFP_KERNEL);
+		if (!zram->dedup_hash) {
+			pr_err("Error allocating deduplication table\n");
+			ret = -ENOMEM;
+			goto fail;
+		}
+	}
+
 	set_capacity(zram->disk, zram->disksize >> SECTOR_SHIFT);
 
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = xv_create_pool();
+	zram->mem_pool = zs_create_pool(GFP_NOIO | __GFP_HIGHMEM);
 	if (!zram->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
@@ -561,13 +1012,154 @@ fail:
 	return ret;
 }
 
+/*
+ * Opens the block device at 'path' as the backing device of an
+ * uninitialized zram. Caller must hold init_lock.
+ */
+int zram_set_backing_dev(struct zram *zram, const char *path)
+{
+	struct block_device *bdev;
+	unsigned long nr_blocks;
+	unsigned long *block_map;
+	char *name;
+
+	name = kstrdup(path, GFP_KERNEL);
+	if (!name)
+		return -ENOMEM;
+	strim(name);
+
+	bdev = blkdev_get_by_path(name, FMODE_READ | FMODE_WRITE | FMODE_EXCL,
+				  zram);
+	if (IS_ERR(bdev)) {
+		kfree(name);
+		return PTR_ERR(bdev);
+	}
+
+	nr_blocks = i_size_read(bdev->bd_inode) >> PAGE_SHIFT;
+	block_map = vzalloc(BITS_TO_LONGS(nr_blocks) * sizeof(long));
+	if (!nr_blocks || !block_map) {
+		vfree(block_map);
+		blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+		kfree(name);
+		return nr_blocks ? -ENOMEM : -EINVAL;
+	}
+
+	if (zram->bdev)
+		blkdev_put(zram->bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	vfree(zram->block_map);
+	kfree(zram->backing_dev);
+
+	zram->bdev = bdev;
+	zram->nr_blocks = nr_blocks;
+	zram->block_map = block_map;
+	zram->backing_dev = name;
+
+	pr_info("%s: using %s as backing device, %lu pages\n",
+		zram->disk->disk_name, name, nr_blocks);
+	return 0;
+}
+
+/*
+ * Marks every stored page idle. Pages still idle at the next writeback
+ * have not been accessed in between.
+ */
+void zram_mark_idle(struct zram *zram)
+{
+	size_t index;
+
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+		spinlock_t *lock = zram_slot_lock(zram, index);
+
+		spin_lock(lock);
+		if (zram->table[index].handle &&
+		    !zram_test_flag(zram, index, ZRAM_SAME) &&
+		    !zram_test_flag(zram, index, ZRAM_WB))
+			zram_set_flag(zram, index, ZRAM_IDLE);
+		spin_unlock(lock);
+	}
+}
+
+/*
+ * Writes idle pages, or incompressible ones if 'huge' is set, to the
+ * backing device and frees their memory. Shared and same-filled pages
+ * are left alone. Caller must hold init_lock.
+ */
+int zram_writeback(struct zram *zram, int huge)
+{
+	struct page *bounce;
+	unsigned long block;
+	size_t index;
+	int ret = 0;
+
+	if (!zram->bdev)
+		return -ENODEV;
+
+	bounce = alloc_page(GFP_KERNEL);
+	if (!bounce)
+		return -ENOMEM;
+
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+		spinlock_t *lock = zram_slot_lock(zram, index);
+		int err;
+
+		spin_lock(lock);
+		if (!zram->table[index].handle ||
+		    zram_test_flag(zram, index, ZRAM_SAME) ||
+		    zram_test_flag(zram, index, ZRAM_DEDUP) ||
+		    zram_test_flag(zram, index, ZRAM_WB) ||
+		    zram_test_flag(zram, index, ZRAM_UNDER_WB) ||
+		    zram_test_flag(zram, index, ZRAM_WB_STALE) ||
+		    !zram_test_flag(zram, index,
+				    huge ? ZRAM_UNCOMPRESSED : ZRAM_IDLE)) {
+			spin_unlock(lock);
+			continue;
+		}
+		zram_set_flag(zram, index, ZRAM_UNDER_WB);
+		spin_unlock(lock);
+
+		block = zram_alloc_block(zram);
+		if (block >= zram->nr_blocks) {
+			spin_lock(lock);
+			zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+			spin_unlock(lock);
+			ret = -ENOSPC;
+			break;
+		}
+
+		err = zram_read_page(zram, bounce, index, 0);
+		if (!err)
+			err = zram_bdev_rw(zram, WRITE, bounce, block);
+
+		spin_lock(lock);
+		/* give up on slots that were rewritten or freed meanwhile */
+		if (err || !zram_test_flag(zram, index, ZRAM_UNDER_WB)) {
+			zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+			spin_unlock(lock);
+			zram_free_block(zram, block);
+			continue;
+		}
+
+		zram_free_page(zram, index);
+		zram_set_flag(zram, index, ZRAM_WB);
+		zram->table[index].block = block;
+		atomic_inc(&zram->stats.bd_count);
+		zram_stat_inc(&zram->stats.pages_stored);
+		spin_unlock(lock);
+	}
+
+	__free_page(bounce);
+	return ret;
+}
+
 void zram_slot_free_notify(struct block_device *bdev, unsigned long index)
 {
 	struct zram *zram;
 
 	zram = bdev->bd_disk->private_data;
+	spin_lock(zram_slot_lock(zram, index));
 	zram_free_page(zram, index);
-	zram_stat64_inc(zram, &zram->stats.notify_free);
+	spin_unlock(zram_slot_lock(zram, index));
+	zram_stat64_inc(&zram->stats.notify_free);
 }
 
 static const struct block_device_operations zram_devops = {
@@ -577,11 +1169,17 @@ static const struct block_device_operations zram_devops = {
 
 static int create_device(struct zram *zram, int device_id)
 {
-	int ret = 0;
+	int ret = 0, i;
 
-	mutex_init(&zram->lock);
 	mutex_init(&zram->init_lock);
-	spin_lock_init(&zram->stat64_lock);
+	zram->backend = zram_default_backend();
+	for (i = 0; i < ZRAM_SLOT_LOCKS; i++)
+		spin_lock_init(&zram->slot_lock[i]);
+	INIT_LIST_HEAD(&zram->idle_streams);
+	spin_lock_init(&zram->stream_lock);
+	spin_lock_init(&zram->dedup_lock);
+	spin_lock_init(&zram->block_lock);
+	init_waitqueue_head(&zram->stream_wait);
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -17,8 +17,10 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/list.h>
 
-#include "xvmalloc.h"
+#include "../zsmalloc/zsmalloc.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -51,8 +53,8 @@ static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
 
 /*
  * NOTE: max_zpage_size must be less than or equal to:
- *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
- * otherwise, xv_malloc() would always return failure.
+ *   ZS_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
+ * otherwise, zs_malloc() would always return failure.
  */
 
 /*-- End of configurable params */
@@ -63,49 +65,140 @@ static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
 #define SECTORS_PER_PAGE	(1 << SECTORS_PER_PAGE_SHIFT)
 #define ZRAM_LOGICAL_BLOCK_SIZE	4096
 
+/* Number of locks the table slots are hashed onto */
+#define ZRAM_SLOT_LOCKS		128
+
+/* Buckets of the deduplication hash table */
+#define ZRAM_DEDUP_BUCKETS	1024
+
 /* Flags for zram pages (table[page_no].flags) */
 enum zram_pageflags {
 	/* Page is stored uncompressed */
 	ZRAM_UNCOMPRESSED,
 
-	/* Page consists entirely of zeros */
-	ZRAM_ZERO,
+	/* Page is one word repeated; the word is in table[].element */
+	ZRAM_SAME,
+
+	/* Page shares a compressed object; table[].entry refers to it */
+	ZRAM_DEDUP,
+
+	/* Page has not been accessed since slots were last marked idle */
+	ZRAM_IDLE,
+
+	/* Page lives on the backing device, in block table[].block */
+	ZRAM_WB,
+
+	/* Page is being written to the backing device */
+	ZRAM_UNDER_WB,
+
+	/* Slot was freed during a backing device read; the last reader
+	 * frees the block */
+	ZRAM_WB_STALE,
 
 	__NR_ZRAM_PAGEFLAGS,
 };
 
 /*-- Data structures */
 
+/*
+ * A compressed object shared by all slots whose pages compressed to the
+ * same bytes. Protected by zram->dedup_lock.
+ */
+struct zram_dedup_entry {
+	struct hlist_node node;
+	u32 hash;		/* jhash of the compressed data */
+	u32 clen;
+	u32 refcount;		/* slots referring to the object */
+	unsigned long handle;
+};
+
 /* Allocated for each disk page */
 struct table {
-	struct page *page;
-	u16 offset;
-	u8 count;	/* object ref count (not yet used) */
+	union {
+		unsigned long handle;		/* compressed object */
+		struct page *page;		/* ZRAM_UNCOMPRESSED */
+		unsigned long element;		/* ZRAM_SAME */
+		struct zram_dedup_entry *entry;	/* ZRAM_DEDUP */
+		unsigned long block;		/* ZRAM_WB */
+	};
+	u16 size;	/* compressed size of the object */
+	u8 count;	/* backing device reads in flight */
 	u8 flags;
 } __attribute__((aligned(4)));
 
 struct zram_stats {
-	u64 compr_size;		/* compressed size of pages stored */
-	u64 num_reads;		/* failed + successful */
-	u64 num_writes;		/* --do-- */
-	u64 failed_reads;	/* should NEVER! happen */
-	u64 failed_writes;	/* can happen when memory is too low */
-	u64 invalid_io;		/* non-page-aligned I/O requests */
-	u64 notify_free;	/* no. of swap slot free notifications */
-	u32 pages_zero;		/* no. of zero filled pages */
-	u32 pages_stored;	/* no. of pages currently stored */
-	u32 good_compress;	/* % of pages with compression ratio<=50% */
-	u32 pages_expand;	/* % of incompressible pages */
+	atomic64_t compr_size;	/* compressed size of pages stored */
+	atomic64_t num_reads;	/* failed + successful */
+	atomic64_t num_writes;	/* --do-- */
+	atomic64_t failed_reads;	/* should NEVER! happen */
+	atomic64_t failed_writes;	/* can happen when memory is too low */
+	atomic64_t invalid_io;	/* non-page-aligned I/O requests */
+	atomic64_t notify_free;	/* no. of swap slot free notifications */
+	atomic64_t compr_ns;	/* time spent compressing */
+	atomic64_t decompr_ns;	/* time spent decompressing */
+	atomic64_t stream_waits;	/* writes that waited for a stream */
+	atomic64_t dup_saved;	/* compressed bytes not stored thanks to
+				 * deduplication */
+	atomic_t pages_zero;	/* no. of zero filled pages */
+	atomic_t pages_same;	/* no. of other same filled pages */
+	atomic_t pages_dup;	/* no. of pages sharing a stored object */
+	atomic_t bd_count;	/* no. of pages on the backing device */
+	atomic64_t bd_reads;	/* pages read from the backing device */
+	atomic64_t bd_writes;	/* pages written to the backing device */
+	atomic_t pages_stored;	/* no. of pages currently stored */
+	atomic_t good_compress;	/* % of pages with compression ratio<=50% */
+	atomic_t pages_expand;	/* % of incompressible pages */
+	u32 max_busy_streams;	/* most streams compressing at once */
+	atomic_long_t max_used_pages;	/* peak memory use, in pages */
+};
+
+/*
+ * A compression backend. Pages are compressed whole; compress() may write
+ * up to two pages to 'dst'.  Both return 0 on success.
+ */
+struct zram_backend {
+	const char *name;
+	size_t workmem_size;
+	int (*compress)(const unsigned char *src, unsigned char *dst,
+			size_t *dst_len, void *workmem);
+	int (*decompress)(const unsigned char *src, size_t src_len,
+			  unsigned char *dst);
+};
+
+/*
+ * Compression workspace. A device gets one per possible cpu when it
+ * is initialized, so that many writers can compress in parallel.
+ */
+struct zram_stream {
+	struct list_head list;	/* on zram->idle_streams when unused */
+	void *workmem;
+	void *buffer;		/* compressed output, two pages */
 };
 
 struct zram {
-	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct zs_pool *mem_pool;
+	/* Can only be changed while the device is not initialized */
+	const struct zram_backend *backend;
 	struct table *table;
-	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct mutex lock;	/* protect compression buffers against
-				 * concurrent writes */
+	/* protect table slots; slot i uses slot_lock[i % ZRAM_SLOT_LOCKS] */
+	spinlock_t slot_lock[ZRAM_SLOT_LOCKS];
+	struct list_head idle_streams;
+	spinlock_t stream_lock;	/* protect idle_streams, busy_streams */
+	wait_queue_head_t stream_wait;
+	int num_streams;
+	int busy_streams;
+	/* Deduplication of compressed objects; set before init */
+	int dedup_enable;
+	/* Writes fail once this many pages are in use; 0 for no limit */
+	unsigned long limit_pages;
+	struct hlist_head *dedup_hash;
+	spinlock_t dedup_lock;
+	/* Optional backing device for writeback; set before init */
+	struct block_device *bdev;
+	char *backing_dev;	/* path it was opened by */
+	unsigned long nr_blocks;	/* in pages */
+	unsigned long *block_map;	/* blocks in use */
+	spinlock_t block_lock;	/* protect block_map */
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -129,4 +222,14 @@ extern struct attribute_group zram_disk_attr_group;
 extern int zram_init_device(struct zram *zram);
 extern void zram_reset_device(struct zram *zram);
 
+extern void zram_reset_mem_used_max(struct zram *zram);
+
+extern int zram_set_backing_dev(struct zram *zram, const char *path);
+extern void zram_mark_idle(struct zram *zram);
+extern int zram_writeback(struct zram *zram, int huge);
+
+extern const struct zram_backend *zram_default_backend(void);
+extern const struct zram_backend *zram_find_backend(const char *name);
+extern ssize_t zram_show_backends(const struct zram_backend *cur, char *buf);
+
 #endif
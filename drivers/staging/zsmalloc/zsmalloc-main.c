@@ -0,0 +1,601 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+/*
+ * Objects are grouped into size classes ZS_SIZE_CLASS_DELTA bytes apart.
+ * Each class carves "zspages" of one to ZS_MAX_PAGES_PER_ZSPAGE physical
+ * pages into equal slots, using as many pages as leaves the least space
+ * over, so an object may straddle two pages. Such objects are copied
+ * through a per-cpu buffer while mapped.
+ *
+ * Callers hold handles rather than addresses. A handle refers to a small
+ * descriptor recording where its object currently lives, which lets
+ * zs_compact() move objects out of sparsely used zspages into the free
+ * slots of others in the same class and give the emptied pages back.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/highmem.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+
+#include "zsmalloc.h"
+
+#define ZS_MIN_ALLOC_SIZE	32
+#define ZS_SIZE_CLASS_DELTA	16
+#define ZS_MAX_PAGES_PER_ZSPAGE	4
+#define ZS_SIZE_CLASSES \
+	((ZS_MAX_ALLOC_SIZE - ZS_MIN_ALLOC_SIZE) / ZS_SIZE_CLASS_DELTA + 1)
+
+struct zs_zspage;
+
+/* What a handle refers to. Updated under the class lock when moved. */
+struct zs_handle {
+	struct zs_zspage *zspage;
+	u16 idx;		/* slot within the zspage */
+	u16 class;		/* size class; never changes */
+};
+
+struct zs_zspage {
+	struct list_head list;	/* on class->partial or class->full */
+	unsigned int inuse;	/* slots holding an object */
+	unsigned int free_hint;	/* no free slot below this one */
+	struct page *pages[ZS_MAX_PAGES_PER_ZSPAGE];
+	struct zs_handle *handles[0];	/* owner of each slot, or NULL */
+};
+
+struct zs_size_class {
+	spinlock_t lock;
+	/*
+	 * Taken for reading while an object is mapped and for writing by
+	 * compaction, so that mapped objects don't move but mappings don't
+	 * serialize on lock.
+	 */
+	rwlock_t migrate_lock;
+	unsigned int size;		/* of each slot */
+	unsigned int pages_per_zspage;
+	unsigned int objs_per_zspage;
+	struct list_head partial;	/* zspages with free slots */
+	struct list_head full;
+	unsigned long nr_objs;
+};
+
+/* Per-cpu state of the object currently mapped */
+struct zs_map_area {
+	char *buf;		/* copy of an object straddling two pages */
+	void *vaddr;		/* kmap_atomic() address otherwise */
+};
+
+struct zs_pool {
+	gfp_t flags;
+	struct zs_map_area __percpu *map_area;
+	atomic_long_t pages_allocated;
+	atomic_long_t pages_compacted;
+	struct zs_size_class classes[ZS_SIZE_CLASSES];
+};
+
+/* Handle descriptors of all pools */
+static DEFINE_MUTEX(zs_handle_cache_lock);
+static struct kmem_cache *zs_handle_cache;
+static int zs_handle_cache_users;
+
+static int zs_get_handle_cache(void)
+{
+	int ret = 0;
+
+	mutex_lock(&zs_handle_cache_lock);
+	if (!zs_handle_cache_users) {
+		zs_handle_cache = KMEM_CACHE(zs_handle, 0);
+		if (!zs_handle_cache)
+			ret = -ENOMEM;
+	}
+	if (!ret)
+		zs_handle_cache_users++;
+	mutex_unlock(&zs_handle_cache_lock);
+
+	return ret;
+}
+
+static void zs_put_handle_cache(void)
+{
+	mutex_lock(&zs_handle_cache_lock);
+	if (!--zs_handle_cache_users) {
+		kmem_cache_destroy(zs_handle_cache);
+		zs_handle_cache = NULL;
+	}
+	mutex_unlock(&zs_handle_cache_lock);
+}
+
+static unsigned int get_class_index(size_t size)
+{
+	if (size <= ZS_MIN_ALLOC_SIZE)
+		return 0;
+	return DIV_ROUND_UP(size - ZS_MIN_ALLOC_SIZE, ZS_SIZE_CLASS_DELTA);
+}
+
+/*
+ * Picks the zspage size, in pages, that wastes the smallest fraction of
+ * itself on slots of 'size' bytes.
+ */
+static unsigned int get_pages_per_zspage(unsigned int size)
+{
+	unsigned int i, best = 1, best_used = 0;
+
+	for (i = 1; i <= ZS_MAX_PAGES_PER_ZSPAGE; i++) {
+		unsigned int zspage_size = i * PAGE_SIZE;
+		unsigned int used = (zspage_size - zspage_size % size) * 100 /
+				    zspage_size;
+
+		if (used > best_used) {
+			best_used = used;
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+static void free_zspage(struct zs_size_class *class,
+			struct zs_zspage *zspage)
+{
+	int i;
+
+	for (i = 0; i < class->pages_per_zspage; i++)
+		if (zspage->pages[i])
+			__free_page(zspage->pages[i]);
+	kfree(zspage);
+}
+
+static struct zs_zspage *alloc_zspage(struct zs_pool *pool,
+				      struct zs_size_class *class)
+{
+	struct zs_zspage *zspage;
+	int i;
+
+	zspage = kzalloc(sizeof(*zspage) + class->objs_per_zspage *
+			 sizeof(zspage->handles[0]),
+			 pool->flags & ~__GFP_HIGHMEM);
+	if (!zspage)
+		return NULL;
+
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		zspage->pages[i] = alloc_page(pool->flags);
+		if (!zspage->pages[i]) {
+			free_zspage(class, zspage);
+			return NULL;
+		}
+	}
+
+	return zspage;
+}
+
+/*
+ * Puts 'handle' in the lowest free slot of 'zspage'. Caller must hold
+ * the class lock.
+ */
+static void place_object(struct zs_size_class *class,
+			 struct zs_zspage *zspage, struct zs_handle *handle)
+{
+	unsigned int idx = zspage->free_hint;
+
+	while (zspage->handles[idx])
+		idx++;
+
+	zspage->handles[idx] = handle;
+	zspage->free_hint = idx + 1;
+	zspage->inuse++;
+	class->nr_objs++;
+
+	handle->zspage = zspage;
+	handle->idx = idx;
+
+	if (zspage->inuse == class->objs_per_zspage)
+		list_move(&zspage->list, &class->full);
+}
+
+/*
+ * Empties slot 'idx' of 'zspage'. Caller must hold the class lock and
+ * free the zspage when it has no objects left.
+ */
+static void remove_object(struct zs_size_class *class,
+			  struct zs_zspage *zspage, unsigned int idx)
+{
+	if (zspage->inuse == class->objs_per_zspage)
+		list_move(&zspage->list, &class->partial);
+
+	zspage->handles[idx] = NULL;
+	if (idx < zspage->free_hint)
+		zspage->free_hint = idx;
+	zspage->inuse--;
+	class->nr_objs--;
+}
+
+/*
+ * Copies slot 'idx' of 'zspage' into 'buf', or 'buf' into the slot if
+ * 'write' is set.
+ */
+static void copy_slot(struct zs_size_class *class, struct zs_zspage *zspage,
+		      unsigned int idx, char *buf, int write)
+{
+	unsigned long off = (unsigned long)idx * class->size;
+	unsigned int pg = off >> PAGE_SHIFT;
+	size_t offset = off & ~PAGE_MASK;
+	size_t len = class->size, n;
+	char *vaddr;
+
+	while (len) {
+		n = min_t(size_t, len, PAGE_SIZE - offset);
+		vaddr = kmap_atomic(zspage->pages[pg], KM_USER1);
+		if (write)
+			memcpy(vaddr + offset, buf, n);
+		else
+			memcpy(buf, vaddr + offset, n);
+		kunmap_atomic(vaddr, KM_USER1);
+
+		buf += n;
+		len -= n;
+		offset = 0;
+		pg++;
+	}
+}
+
+static int slot_is_split(struct zs_size_class *class, unsigned int idx)
+{
+	unsigned long off = (unsigned long)idx * class->size;
+
+	return (off & ~PAGE_MASK) + class->size > PAGE_SIZE;
+}
+
+/**
+ * zs_create_pool - Creates an allocation pool to work from.
+ * @flags: allocation flags used to allocate pool pages
+ *
+ * Returns NULL on failure.
+ */
+struct zs_pool *zs_create_pool(gfp_t flags)
+{
+	struct zs_pool *pool;
+	int i, cpu;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	pool->flags = flags;
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct zs_size_class *class = &pool->classes[i];
+
+		spin_lock_init(&class->lock);
+		rwlock_init(&class->migrate_lock);
+		class->size = ZS_MIN_ALLOC_SIZE + i * ZS_SIZE_CLASS_DELTA;
+		class->pages_per_zspage = get_pages_per_zspage(class->size);
+		class->objs_per_zspage = class->pages_per_zspage * PAGE_SIZE /
+					 class->size;
+		INIT_LIST_HEAD(&class->partial);
+		INIT_LIST_HEAD(&class->full);
+	}
+
+	pool->map_area = alloc_percpu(struct zs_map_area);
+	if (!pool->map_area)
+		goto fail;
+
+	for_each_possible_cpu(cpu) {
+		struct zs_map_area *area = per_cpu_ptr(pool->map_area, cpu);
+
+		area->buf = kmalloc(ZS_MAX_ALLOC_SIZE, GFP_KERNEL);
+		if (!area->buf)
+			goto fail;
+	}
+
+	if (zs_get_handle_cache())
+		goto fail;
+
+	return pool;
+
+fail:
+	if (pool->map_area) {
+		for_each_possible_cpu(cpu)
+			kfree(per_cpu_ptr(pool->map_area, cpu)->buf);
+		free_percpu(pool->map_area);
+	}
+	kfree(pool);
+	return NULL;
+}
+EXPORT_SYMBOL_GPL(zs_create_pool);
+
+/**
+ * zs_destroy_pool - Frees a pool and any objects still allocated from it.
+ * @pool: pool to destroy
+ */
+void zs_destroy_pool(struct zs_pool *pool)
+{
+	struct zs_zspage *zspage, *tmp;
+	struct list_head *lists[2];
+	int i, j, l, cpu;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct zs_size_class *class = &pool->classes[i];
+
+		lists[0] = &class->partial;
+		lists[1] = &class->full;
+		for (l = 0; l < 2; l++) {
+			list_for_each_entry_safe(zspage, tmp, lists[l], list) {
+				for (j = 0; j < class->objs_per_zspage; j++)
+					if (zspage->handles[j])
+						kmem_cache_free(zs_handle_cache,
+							zspage->handles[j]);
+				list_del(&zspage->list);
+				free_zspage(class, zspage);
+			}
+		}
+	}
+
+	for_each_possible_cpu(cpu)
+		kfree(per_cpu_ptr(pool->map_area, cpu)->buf);
+	free_percpu(pool->map_area);
+
+	zs_put_handle_cache();
+	kfree(pool);
+}
+EXPORT_SYMBOL_GPL(zs_destroy_pool);
+
+/**
+ * zs_malloc - Allocates an object of given size from a pool.
+ * @pool: pool to allocate from
+ * @size: size of the object, at most ZS_MAX_ALLOC_SIZE
+ *
+ * Returns a handle to the object, or 0 on failure. The object has to be
+ * mapped with zs_map_object() to be accessed.
+ */
+unsigned long zs_malloc(struct zs_pool *pool, size_t size)
+{
+	struct zs_size_class *class;
+	struct zs_zspage *zspage;
+	struct zs_handle *handle;
+
+	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE))
+		return 0;
+
+	handle = kmem_cache_alloc(zs_handle_cache,
+				  pool->flags & ~__GFP_HIGHMEM);
+	if (!handle)
+		return 0;
+
+	handle->class = get_class_index(size);
+	class = &pool->classes[handle->class];
+
+	spin_lock(&class->lock);
+	if (list_empty(&class->partial)) {
+		spin_unlock(&class->lock);
+
+		zspage = alloc_zspage(pool, class);
+		if (!zspage) {
+			kmem_cache_free(zs_handle_cache, handle);
+			return 0;
+		}
+		atomic_long_add(class->pages_per_zspage,
+				&pool->pages_allocated);
+
+		spin_lock(&class->lock);
+		list_add(&zspage->list, &class->partial);
+	}
+
+	zspage = list_first_entry(&class->partial, struct zs_zspage, list);
+	place_object(class, zspage, handle);
+	spin_unlock(&class->lock);
+
+	return (unsigned long)handle;
+}
+EXPORT_SYMBOL_GPL(zs_malloc);
+
+/**
+ * zs_free - Frees an object allocated with zs_malloc().
+ * @pool: pool the object was allocated from
+ * @obj: handle of the object
+ */
+void zs_free(struct zs_pool *pool, unsigned long obj)
+{
+	struct zs_handle *handle = (struct zs_handle *)obj;
+	struct zs_size_class *class;
+	struct zs_zspage *zspage;
+
+	if (unlikely(!handle))
+		return;
+
+	class = &pool->classes[handle->class];
+
+	spin_lock(&class->lock);
+	zspage = handle->zspage;
+	remove_object(class, zspage, handle->idx);
+	if (!zspage->inuse)
+		list_del(&zspage->list);
+	else
+		zspage = NULL;
+	spin_unlock(&class->lock);
+
+	if (zspage) {
+		free_zspage(class, zspage);
+		atomic_long_sub(class->pages_per_zspage,
+				&pool->pages_allocated);
+	}
+	kmem_cache_free(zs_handle_cache, handle);
+}
+EXPORT_SYMBOL_GPL(zs_free);
+
+/**
+ * zs_map_object - Gives access to an object.
+ * @pool: pool the object was allocated from
+ * @obj: handle of the object
+ *
+ * The object stays in place until zs_unmap_object(), which has to be
+ * called before mapping another object on this cpu and without sleeping
+ * in between. KM_USER1 is used for the mapping.
+ */
+void *zs_map_object(struct zs_pool *pool, unsigned long obj)
+{
+	struct zs_handle *handle = (struct zs_handle *)obj;
+	struct zs_size_class *class = &pool->classes[handle->class];
+	struct zs_map_area *area;
+	unsigned long off;
+
+	read_lock(&class->migrate_lock);
+	area = this_cpu_ptr(pool->map_area);
+
+	if (unlikely(slot_is_split(class, handle->idx))) {
+		copy_slot(class, handle->zspage, handle->idx, area->buf, 0);
+		area->vaddr = NULL;
+		return area->buf;
+	}
+
+	off = (unsigned long)handle->idx * class->size;
+	area->vaddr = kmap_atomic(handle->zspage->pages[off >> PAGE_SHIFT],
+				  KM_USER1);
+	return area->vaddr + (off & ~PAGE_MASK);
+}
+EXPORT_SYMBOL_GPL(zs_map_object);
+
+/**
+ * zs_unmap_object - Ends access to an object mapped by zs_map_object().
+ * @pool: pool the object was allocated from
+ * @obj: handle of the object
+ */
+void zs_unmap_object(struct zs_pool *pool, unsigned long obj)
+{
+	struct zs_handle *handle = (struct zs_handle *)obj;
+	struct zs_size_class *class = &pool->classes[handle->class];
+	struct zs_map_area *area = this_cpu_ptr(pool->map_area);
+
+	if (unlikely(!area->vaddr))
+		copy_slot(class, handle->zspage, handle->idx, area->buf, 1);
+	else
+		kunmap_atomic(area->vaddr, KM_USER1);
+	read_unlock(&class->migrate_lock);
+}
+EXPORT_SYMBOL_GPL(zs_unmap_object);
+
+/*
+ * Drains the least used zspages of a class into the free slots of its
+ * other partial zspages for as long as they have room.
+ */
+static unsigned long compact_class(struct zs_pool *pool,
+				   struct zs_size_class *class)
+{
+	struct zs_zspage *src, *dst, *zspage;
+	struct zs_handle *handle;
+	unsigned long freed = 0;
+	unsigned int free_slots, idx;
+	char *buf;
+
+	write_lock(&class->migrate_lock);
+	spin_lock(&class->lock);
+	for (;;) {
+		src = NULL;
+		free_slots = 0;
+		list_for_each_entry(zspage, &class->partial, list) {
+			free_slots += class->objs_per_zspage - zspage->inuse;
+			if (!src || zspage->inuse < src->inuse)
+				src = zspage;
+		}
+		if (!src)
+			break;
+		free_slots -= class->objs_per_zspage - src->inuse;
+		if (free_slots < src->inuse)
+			break;
+
+		list_del(&src->list);
+		buf = this_cpu_ptr(pool->map_area)->buf;
+		for (idx = 0; src->inuse; idx++) {
+			handle = src->handles[idx];
+			if (!handle)
+				continue;
+
+			copy_slot(class, src, idx, buf, 0);
+			src->handles[idx] = NULL;
+			src->inuse--;
+			class->nr_objs--;
+
+			dst = list_first_entry(&class->partial,
+					       struct zs_zspage, list);
+			place_object(class, dst, handle);
+			copy_slot(class, dst, handle->idx, buf, 1);
+		}
+		spin_unlock(&class->lock);
+		write_unlock(&class->migrate_lock);
+
+		free_zspage(class, src);
+		atomic_long_sub(class->pages_per_zspage,
+				&pool->pages_allocated);
+		freed += class->pages_per_zspage;
+
+		cond_resched();
+		write_lock(&class->migrate_lock);
+		spin_lock(&class->lock);
+	}
+	spin_unlock(&class->lock);
+	write_unlock(&class->migrate_lock);
+
+	return freed;
+}
+
+/**
+ * zs_compact - Moves objects to free as many pool pages as possible.
+ * @pool: pool to compact
+ *
+ * May sleep. Returns the number of pages freed.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	unsigned long freed = 0;
+	int i;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		freed += compact_class(pool, &pool->classes[i]);
+		cond_resched();
+	}
+	atomic_long_add(freed, &pool->pages_compacted);
+
+	return freed;
+}
+EXPORT_SYMBOL_GPL(zs_compact);
+
+u64 zs_get_total_size_bytes(struct zs_pool *pool)
+{
+	return (u64)atomic_long_read(&pool->pages_allocated) << PAGE_SHIFT;
+}
+EXPORT_SYMBOL_GPL(zs_get_total_size_bytes);
+
+/*
+ * Objects count at the size of their class, so the difference between
+ * obj_bytes and the pool pages is what is lost to partly used zspages.
+ */
+void zs_get_stats(struct zs_pool *pool, struct zs_pool_stats *stats)
+{
+	int i;
+
+	stats->pages_allocated = atomic_long_read(&pool->pages_allocated);
+	stats->pages_compacted = atomic_long_read(&pool->pages_compacted);
+	stats->obj_bytes = 0;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct zs_size_class *class = &pool->classes[i];
+
+		spin_lock(&class->lock);
+		stats->obj_bytes += (u64)class->nr_objs * class->size;
+		spin_unlock(&class->lock);
+	}
+}
+EXPORT_SYMBOL_GPL(zs_get_stats);
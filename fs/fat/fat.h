@@ -7,6 +7,7 @@
 #include <linux/fs.h>
 #include <linux/mutex.h>
 #include <linux/ratelimit.h>
+#include <linux/workqueue.h>
 #include <linux/msdos_fs.h>
 
 /*
@@ -86,6 +87,13 @@ struct msdos_sb_info {
 
 	struct ratelimit_state ratelimit;
 
+#ifdef CONFIG_FAT_FREE_BITMAP
+	unsigned long *free_bitmap;  /* set bit = free cluster, under fat_lock */
+	int free_bitmap_ready;	     /* bitmap fully built and usable */
+	int free_bitmap_stop;	     /* abort the build, unmounting */
+	struct work_struct free_bitmap_work;
+#endif
+
 	spinlock_t inode_hash_lock;
 	struct hlist_head inode_hashtable[FAT_HASH_SIZE];
 };
@@ -300,6 +308,13 @@ extern int fat_alloc_clusters(struct inode *inode, int *cluster,
 			      int nr_cluster);
 extern int fat_free_clusters(struct inode *inode, int cluster);
 extern int fat_count_free_clusters(struct super_block *sb);
+#ifdef CONFIG_FAT_FREE_BITMAP
+extern void fat_free_bitmap_init(struct super_block *sb);
+extern void fat_free_bitmap_release(struct super_block *sb);
+#else
+static inline void fat_free_bitmap_init(struct super_block *sb) { }
+static inline void fat_free_bitmap_release(struct super_block *sb) { }
+#endif
 
 /* fat/file.c */
 extern long fat_generic_ioctl(struct file *filp, unsigned int cmd,
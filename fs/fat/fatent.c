@@ -7,6 +7,7 @@
 #include <linux/fs.h>
 #include <linux/msdos_fs.h>
 #include <linux/blkdev.h>
+#include <linux/vmalloc.h>
 #include "fat.h"
 
 struct fatent_operations {
@@ -286,6 +287,89 @@ static inline void unlock_fat(struct msdos_sb_info *sbi)
 	mutex_unlock(&sbi->fat_lock);
 }
 
+#ifdef CONFIG_FAT_FREE_BITMAP
+/*
+ * The bitmap is allocated before the build starts, so allocations and
+ * frees racing with the build keep it current for the entries that have
+ * already been scanned.  It is only used once the build has finished.
+ */
+static inline void fat_free_bitmap_set(struct msdos_sb_info *sbi, int entry)
+{
+	if (sbi->free_bitmap)
+		__set_bit(entry, sbi->free_bitmap);
+}
+
+static inline void fat_free_bitmap_clear(struct msdos_sb_info *sbi,
+					 int entry)
+{
+	if (sbi->free_bitmap)
+		__clear_bit(entry, sbi->free_bitmap);
+}
+
+static inline int fat_free_bitmap_ready(struct msdos_sb_info *sbi)
+{
+	return sbi->free_bitmap_ready;
+}
+
+/* Fall back to scanning the FAT for good */
+static inline void fat_free_bitmap_drop(struct msdos_sb_info *sbi)
+{
+	sbi->free_bitmap_ready = 0;
+}
+
+/* Returns the first free entry from @start on, wrapping around, or -1. */
+static int fat_free_bitmap_find(struct msdos_sb_info *sbi, int start)
+{
+	unsigned long entry;
+
+	if (start >= sbi->max_cluster)
+		start = FAT_START_ENT;
+
+	entry = find_next_bit(sbi->free_bitmap, sbi->max_cluster, start);
+	if (entry < sbi->max_cluster)
+		return entry;
+
+	entry = find_next_bit(sbi->free_bitmap, start, FAT_START_ENT);
+	if (entry < start)
+		return entry;
+
+	return -1;
+}
+
+/* A running build counts the free clusters anyway, wait for it */
+static inline void fat_free_bitmap_wait(struct msdos_sb_info *sbi)
+{
+	flush_work(&sbi->free_bitmap_work);
+}
+#else
+static inline void fat_free_bitmap_set(struct msdos_sb_info *sbi, int entry)
+{
+}
+
+static inline void fat_free_bitmap_clear(struct msdos_sb_info *sbi,
+					 int entry)
+{
+}
+
+static inline int fat_free_bitmap_ready(struct msdos_sb_info *sbi)
+{
+	return 0;
+}
+
+static inline void fat_free_bitmap_drop(struct msdos_sb_info *sbi)
+{
+}
+
+static inline int fat_free_bitmap_find(struct msdos_sb_info *sbi, int start)
+{
+	return -1;
+}
+
+static inline void fat_free_bitmap_wait(struct msdos_sb_info *sbi)
+{
+}
+#endif
+
 void fat_ent_access_init(struct super_block *sb)
 {
 	struct msdos_sb_info *sbi = MSDOS_SB(sb);
@@ -452,6 +536,29 @@ static void fat_collect_bhs(struct buffer_head **bhs, int *nr_bhs,
 	}
 }
 
+/* Allocate the free @fatent and link it to the end of @prev_ent's chain */
+static void fat_ent_alloc(struct super_block *sb, struct fat_entry *fatent,
+			  struct fat_entry *prev_ent,
+			  struct buffer_head **bhs, int *nr_bhs)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	struct fatent_operations *ops = sbi->fatent_ops;
+	int entry = fatent->entry;
+
+	/* make the cluster chain */
+	ops->ent_put(fatent, FAT_ENT_EOF);
+	if (prev_ent->nr_bhs)
+		ops->ent_put(prev_ent, entry);
+
+	fat_collect_bhs(bhs, nr_bhs, fatent);
+
+	sbi->prev_free = entry;
+	if (sbi->free_clusters != -1)
+		sbi->free_clusters--;
+	fat_free_bitmap_clear(sbi, entry);
+	sb->s_dirt = 1;
+}
+
 int fat_alloc_clusters(struct inode *inode, int *cluster, int nr_cluster)
 {
 	struct super_block *sb = inode->i_sb;
@@ -459,7 +566,7 @@ int fat_alloc_clusters(struct inode *inode, int *cluster, int nr_cluster)
 	struct fatent_operations *ops = sbi->fatent_ops;
 	struct fat_entry fatent, prev_ent;
 	struct buffer_head *bhs[MAX_BUF_PER_PAGE];
-	int i, count, err, nr_bhs, idx_clus;
+	int i, count, err, nr_bhs, idx_clus, entry;
 
 	BUG_ON(nr_cluster > (MAX_BUF_PER_PAGE / 2));	/* fixed limit */
 
@@ -474,6 +581,38 @@ int fat_alloc_clusters(struct inode *inode, int *cluster, int nr_cluster)
 	count = FAT_START_ENT;
 	fatent_init(&prev_ent);
 	fatent_init(&fatent);
+
+	if (fat_free_bitmap_ready(sbi)) {
+		/* Go straight to the free entries */
+		entry = sbi->prev_free + 1;
+		while ((entry = fat_free_bitmap_find(sbi, entry)) >= 0) {
+			err = fat_ent_read(inode, &fatent, entry);
+			if (err < 0)
+				goto out;
+			if (err != FAT_ENT_FREE) {
+				fat_msg(sb, KERN_WARNING, "free cluster bitmap "
+					"out of sync (entry 0x%08x), dropping it",
+					entry);
+				fat_free_bitmap_drop(sbi);
+				err = 0;
+				break;
+			}
+			err = 0;
+
+			fat_ent_alloc(sb, &fatent, &prev_ent, bhs, &nr_bhs);
+			cluster[idx_clus] = entry;
+			idx_clus++;
+			if (idx_clus == nr_cluster)
+				goto out;
+
+			/* fat_collect_bhs() holds the bhs, see below */
+			prev_ent = fatent;
+			entry++;
+		}
+		if (fat_free_bitmap_ready(sbi))
+			goto nospc;
+	}
+
 	fatent_set_entry(&fatent, sbi->prev_free + 1);
 	while (count < sbi->max_cluster) {
 		if (fatent.entry >= sbi->max_cluster)
@@ -486,19 +625,9 @@ int fat_alloc_clusters(struct inode *inode, int *cluster, int nr_cluster)
 		/* Find the free entries in a block */
 		do {
 			if (ops->ent_get(&fatent) == FAT_ENT_FREE) {
-				int entry = fatent.entry;
-
-				/* make the cluster chain */
-				ops->ent_put(&fatent, FAT_ENT_EOF);
-				if (prev_ent.nr_bhs)
-					ops->ent_put(&prev_ent, entry);
-
-				fat_collect_bhs(bhs, &nr_bhs, &fatent);
-
-				sbi->prev_free = entry;
-				if (sbi->free_clusters != -1)
-					sbi->free_clusters--;
-				sb->s_dirt = 1;
+				entry = fatent.entry;
+				fat_ent_alloc(sb, &fatent, &prev_ent,
+					      bhs, &nr_bhs);
 
 				cluster[idx_clus] = entry;
 				idx_clus++;
@@ -517,6 +646,7 @@ int fat_alloc_clusters(struct inode *inode, int *cluster, int nr_cluster)
 		} while (fat_ent_next(sbi, &fatent));
 	}
 
+nospc:
 	/* Couldn't allocate the free entries */
 	sbi->free_clusters = 0;
 	sbi->free_clus_valid = 1;
@@ -585,6 +715,7 @@ int fat_free_clusters(struct inode *inode, int cluster)
 		}
 
 		ops->ent_put(&fatent, FAT_ENT_FREE);
+		fat_free_bitmap_set(sbi, fatent.entry);
 		if (sbi->free_clusters != -1) {
 			sbi->free_clusters++;
 			sb->s_dirt = 1;
@@ -647,6 +778,8 @@ int fat_count_free_clusters(struct super_block *sb)
 	unsigned long reada_blocks, reada_mask, cur_block;
 	int err = 0, free;
 
+	fat_free_bitmap_wait(sbi);
+
 	lock_fat(sbi);
 	if (sbi->free_clusters != -1 && sbi->free_clus_valid)
 		goto out;
@@ -683,3 +816,110 @@ out:
 	unlock_fat(sbi);
 	return err;
 }
+
+#ifdef CONFIG_FAT_FREE_BITMAP
+static void fat_free_bitmap_build(struct work_struct *work)
+{
+	struct msdos_sb_info *sbi = container_of(work, struct msdos_sb_info,
+						 free_bitmap_work);
+	struct super_block *sb = sbi->fat_inode->i_sb;
+	struct fatent_operations *ops = sbi->fatent_ops;
+	unsigned long *bitmap = sbi->free_bitmap;
+	struct fat_entry fatent;
+	unsigned long reada_blocks, reada_mask, cur_block;
+	int err = 0;
+
+	reada_blocks = FAT_READA_SIZE >> sb->s_blocksize_bits;
+	reada_mask = reada_blocks - 1;
+	cur_block = 0;
+
+	/*
+	 * Scan one FAT block at a time, so that allocations don't have to
+	 * wait for the whole table.
+	 */
+	fatent_init(&fatent);
+	fatent_set_entry(&fatent, FAT_START_ENT);
+	while (fatent.entry < sbi->max_cluster) {
+		if (sbi->free_bitmap_stop) {
+			err = -EINTR;
+			break;
+		}
+
+		/* readahead of fat blocks */
+		if ((cur_block & reada_mask) == 0) {
+			unsigned long rest = sbi->fat_length - cur_block;
+			fat_ent_reada(sb, &fatent, min(reada_blocks, rest));
+		}
+		cur_block++;
+
+		lock_fat(sbi);
+		err = fat_ent_read_block(sb, &fatent);
+		if (err) {
+			unlock_fat(sbi);
+			break;
+		}
+		do {
+			if (ops->ent_get(&fatent) == FAT_ENT_FREE)
+				__set_bit(fatent.entry, bitmap);
+			else
+				__clear_bit(fatent.entry, bitmap);
+		} while (fat_ent_next(sbi, &fatent));
+		unlock_fat(sbi);
+
+		cond_resched();
+	}
+	fatent_brelse(&fatent);
+
+	lock_fat(sbi);
+	if (err) {
+		sbi->free_bitmap = NULL;
+	} else {
+		sbi->free_clusters = bitmap_weight(bitmap, sbi->max_cluster);
+		sbi->free_clus_valid = 1;
+		sbi->free_bitmap_ready = 1;
+		sb->s_dirt = 1;
+	}
+	unlock_fat(sbi);
+
+	if (err)
+		vfree(bitmap);
+}
+
+/**
+ * fat_free_bitmap_init - start building the free cluster bitmap
+ * @sb: freshly mounted superblock
+ *
+ * The FAT is scanned from a workqueue, the mount doesn't wait for it.
+ * Without memory for the bitmap the FAT is simply scanned as before.
+ */
+void fat_free_bitmap_init(struct super_block *sb)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+
+	INIT_WORK(&sbi->free_bitmap_work, fat_free_bitmap_build);
+	sbi->free_bitmap_ready = 0;
+	sbi->free_bitmap_stop = 0;
+
+	sbi->free_bitmap = vzalloc(BITS_TO_LONGS(sbi->max_cluster) *
+				   sizeof(unsigned long));
+	if (!sbi->free_bitmap) {
+		fat_msg(sb, KERN_WARNING,
+			"no memory for the free cluster bitmap");
+		return;
+	}
+
+	queue_work(system_long_wq, &sbi->free_bitmap_work);
+}
+
+void fat_free_bitmap_release(struct super_block *sb)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+
+	sbi->free_bitmap_stop = 1;
+	cancel_work_sync(&sbi->free_bitmap_work);
+
+	sbi->free_bitmap_ready = 0;
+	vfree(sbi->free_bitmap);
+	sbi->free_bitmap = NULL;
+}
+#endif /* CONFIG_FAT_FREE_BITMAP */
@@ -487,6 +487,8 @@ static void fat_put_super(struct super_block *sb)
 {
 	struct msdos_sb_info *sbi = MSDOS_SB(sb);
 
+	fat_free_bitmap_release(sb);
+
 	if (sb->s_dirt)
 		fat_write_super(sb);
 
@@ -1515,6 +1517,8 @@ int fat_fill_super(struct super_block *sb, void *data, int silent, int isvfat,
 		goto out_fail;
 	}
 
+	fat_free_bitmap_init(sb);
+
 	return 0;
 
 out_invalid:
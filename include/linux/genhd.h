@@ -152,6 +152,20 @@ struct disk_part_tbl {
 
 struct disk_events;
 
+#ifdef CONFIG_BLK_DEV_LATENCY_HIST
+/*
+ * Per-cpu request latency histogram.  Bucket i counts requests whose
+ * latency in usecs fell in [2^i, 2^(i+1)), bucket 0 also takes < 1us
+ * and the last bucket takes everything beyond.
+ */
+#define DISK_LAT_HIST_BUCKETS	24
+
+struct disk_lat_hist {
+	unsigned long queue[2][DISK_LAT_HIST_BUCKETS];	/* insert -> dispatch */
+	unsigned long service[2][DISK_LAT_HIST_BUCKETS];/* dispatch -> done */
+};
+#endif
+
 struct gendisk {
 	/* major, first_minor and minors are input parameters only,
 	 * don't use directly.  Use disk_devt() and disk_max_parts().
@@ -188,6 +202,9 @@ struct gendisk {
 	struct disk_events *ev;
 #ifdef  CONFIG_BLK_DEV_INTEGRITY
 	struct blk_integrity *integrity;
+#endif
+#ifdef CONFIG_BLK_DEV_LATENCY_HIST
+	struct disk_lat_hist __percpu *lat_hist;
 #endif
 	int node_id;
 };
@@ -64,6 +64,11 @@ struct mmc_ext_csd {
 	unsigned long long	enhanced_area_offset;	/* Units: Byte */
 	unsigned int		enhanced_area_size;	/* Units: KB */
 	unsigned int		boot_size;		/* in bytes */
+	unsigned int		cache_size;		/* Units: KB */
+	bool			cache_ctrl;		/* cache enabled */
+	bool			packed_event_en;	/* packed event enabled */
+	u8			max_packed_writes;	/* 500 */
+	u8			max_packed_reads;	/* 501 */
 	u8			raw_partition_support;	/* 160 */
 	u8			raw_erased_mem_count;	/* 181 */
 	u8			raw_ext_csd_structure;	/* 194 */
@@ -0,0 +1,509 @@
+/*
+ * Test lzo1x_decompress_safe() against the bytewise reference
+ * decompressor it replaced, and report the throughput of both.
+ *
+ * All work is done at module load; the load then fails so that the
+ * module does not stay resident.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ */
+
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/lzo.h>
+#include <linux/random.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+#include <linux/hrtimer.h>
+#include <linux/math64.h>
+#include <asm/unaligned.h>
+#include "lzo/lzodefs.h"
+
+static unsigned int iterations = 2000;
+module_param(iterations, uint, 0);
+MODULE_PARM_DESC(iterations, "Decompressions of each benchmark input");
+
+/*
+ * Reference: the LZO1X decompressor as it stood before the wide-copy
+ * rewrite, copying literals four bytes at a time and matches a byte at
+ * a time.
+ */
+#define HAVE_IP(x, ip_end, ip) ((size_t)(ip_end - ip) < (x))
+#define HAVE_OP(x, op_end, op) ((size_t)(op_end - op) < (x))
+#define HAVE_LB(m_pos, out, op) (m_pos < out || m_pos >= op)
+
+#define COPY4(dst, src)	\
+		put_unaligned(get_unaligned((const u32 *)(src)), (u32 *)(dst))
+
+static int lzo1x_decompress_ref(const unsigned char *in, size_t in_len,
+				unsigned char *out, size_t *out_len)
+{
+	const unsigned char * const ip_end = in + in_len;
+	unsigned char * const op_end = out + *out_len;
+	const unsigned char *ip = in, *m_pos;
+	unsigned char *op = out;
+	size_t t;
+
+	*out_len = 0;
+
+	if (*ip > 17) {
+		t = *ip++ - 17;
+		if (t < 4)
+			goto match_next;
+		if (HAVE_OP(t, op_end, op))
+			goto output_overrun;
+		if (HAVE_IP(t + 1, ip_end, ip))
+			goto input_overrun;
+		do {
+			*op++ = *ip++;
+		} while (--t > 0);
+		goto first_literal_run;
+	}
+
+	while ((ip < ip_end)) {
+		t = *ip++;
+		if (t >= 16)
+			goto match;
+		if (t == 0) {
+			if (HAVE_IP(1, ip_end, ip))
+				goto input_overrun;
+			while (*ip == 0) {
+				t += 255;
+				ip++;
+				if (HAVE_IP(1, ip_end, ip))
+					goto input_overrun;
+			}
+			t += 15 + *ip++;
+		}
+		if (HAVE_OP(t + 3, op_end, op))
+			goto output_overrun;
+		if (HAVE_IP(t + 4, ip_end, ip))
+			goto input_overrun;
+
+		COPY4(op, ip);
+		op += 4;
+		ip += 4;
+		if (--t > 0) {
+			if (t >= 4) {
+				do {
+					COPY4(op, ip);
+					op += 4;
+					ip += 4;
+					t -= 4;
+				} while (t >= 4);
+				if (t > 0) {
+					do {
+						*op++ = *ip++;
+					} while (--t > 0);
+				}
+			} else {
+				do {
+					*op++ = *ip++;
+				} while (--t > 0);
+			}
+		}
+
+first_literal_run:
+		t = *ip++;
+		if (t >= 16)
+			goto match;
+		m_pos = op - (1 + M2_MAX_OFFSET);
+		m_pos -= t >> 2;
+		m_pos -= *ip++ << 2;
+
+		if (HAVE_LB(m_pos, out, op))
+			goto lookbehind_overrun;
+
+		if (HAVE_OP(3, op_end, op))
+			goto output_overrun;
+		*op++ = *m_pos++;
+		*op++ = *m_pos++;
+		*op++ = *m_pos;
+
+		goto match_done;
+
+		do {
+match:
+			if (t >= 64) {
+				m_pos = op - 1;
+				m_pos -= (t >> 2) & 7;
+				m_pos -= *ip++ << 3;
+				t = (t >> 5) - 1;
+				if (HAVE_LB(m_pos, out, op))
+					goto lookbehind_overrun;
+				if (HAVE_OP(t + 3 - 1, op_end, op))
+					goto output_overrun;
+				goto copy_match;
+			} else if (t >= 32) {
+				t &= 31;
+				if (t == 0) {
+					if (HAVE_IP(1, ip_end, ip))
+						goto input_overrun;
+					while (*ip == 0) {
+						t += 255;
+						ip++;
+						if (HAVE_IP(1, ip_end, ip))
+							goto input_overrun;
+					}
+					t += 31 + *ip++;
+				}
+				m_pos = op - 1;
+				m_pos -= get_unaligned_le16(ip) >> 2;
+				ip += 2;
+			} else if (t >= 16) {
+				m_pos = op;
+				m_pos -= (t & 8) << 11;
+
+				t &= 7;
+				if (t == 0) {
+					if (HAVE_IP(1, ip_end, ip))
+						goto input_overrun;
+					while (*ip == 0) {
+						t += 255;
+						ip++;
+						if (HAVE_IP(1, ip_end, ip))
+							goto input_overrun;
+					}
+					t += 7 + *ip++;
+				}
+				m_pos -= get_unaligned_le16(ip) >> 2;
+				ip += 2;
+				if (m_pos == op)
+					goto eof_found;
+				m_pos -= 0x4000;
+			} else {
+				m_pos = op - 1;
+				m_pos -= t >> 2;
+				m_pos -= *ip++ << 2;
+
+				if (HAVE_LB(m_pos, out, op))
+					goto lookbehind_overrun;
+				if (HAVE_OP(2, op_end, op))
+					goto output_overrun;
+
+				*op++ = *m_pos++;
+				*op++ = *m_pos;
+				goto match_done;
+			}
+
+			if (HAVE_LB(m_pos, out, op))
+				goto lookbehind_overrun;
+			if (HAVE_OP(t + 3 - 1, op_end, op))
+				goto output_overrun;
+
+			if (t >= 2 * 4 - (3 - 1) && (op - m_pos) >= 4) {
+				COPY4(op, m_pos);
+				op += 4;
+				m_pos += 4;
+				t -= 4 - (3 - 1);
+				do {
+					COPY4(op, m_pos);
+					op += 4;
+					m_pos += 4;
+					t -= 4;
+				} while (t >= 4);
+				if (t > 0)
+					do {
+						*op++ = *m_pos++;
+					} while (--t > 0);
+			} else {
+copy_match:
+				*op++ = *m_pos++;
+				*op++ = *m_pos++;
+				do {
+					*op++ = *m_pos++;
+				} while (--t > 0);
+			}
+match_done:
+			t = ip[-2] & 3;
+			if (t == 0)
+				break;
+match_next:
+			if (HAVE_OP(t, op_end, op))
+				goto output_overrun;
+			if (HAVE_IP(t + 1, ip_end, ip))
+				goto input_overrun;
+
+			*op++ = *ip++;
+			if (t > 1) {
+				*op++ = *ip++;
+				if (t > 2)
+					*op++ = *ip++;
+			}
+
+			t = *ip++;
+		} while (ip < ip_end);
+	}
+
+	*out_len = op - out;
+	return LZO_E_EOF_NOT_FOUND;
+
+eof_found:
+	*out_len = op - out;
+	return (ip == ip_end ? LZO_E_OK :
+		(ip < ip_end ? LZO_E_INPUT_NOT_CONSUMED : LZO_E_INPUT_OVERRUN));
+input_overrun:
+	*out_len = op - out;
+	return LZO_E_INPUT_OVERRUN;
+
+output_overrun:
+	*out_len = op - out;
+	return LZO_E_OUTPUT_OVERRUN;
+
+lookbehind_overrun:
+	*out_len = op - out;
+	return LZO_E_LOOKBEHIND_OVERRUN;
+}
+
+#define TEST_MAX_LEN	(64 * 1024)
+#define TEST_GUARD	32
+#define TEST_POISON	0xa5
+
+enum test_pattern {
+	PAT_ZERO,
+	PAT_TEXT,
+	PAT_RANDOM,
+	PAT_SHORT_PERIOD,
+	PAT_MIXED,
+	PAT_NR,
+};
+
+static const char * const pattern_names[] = {
+	[PAT_ZERO]		= "zero",
+	[PAT_TEXT]		= "text",
+	[PAT_RANDOM]		= "random",
+	[PAT_SHORT_PERIOD]	= "short-period",
+	[PAT_MIXED]		= "mixed",
+};
+
+static const char * const test_words[] = {
+	"the", "page", "of", "memory", "kernel", "and", "a", "to",
+	"compressed", "swap", "in", "is", "block", "for", "data", "zero",
+};
+
+static const size_t test_lens[] = {
+	1, 2, 3, 4, 7, 8, 15, 16, 17, 31, 64, 255, 256, 1000,
+	PAGE_SIZE - 1, PAGE_SIZE, PAGE_SIZE + 1, 3 * PAGE_SIZE,
+	TEST_MAX_LEN,
+};
+
+struct test_bufs {
+	unsigned char *src;
+	unsigned char *comp;
+	unsigned char *ref;
+	unsigned char *out;
+	void *wrkmem;
+};
+
+static void fill_pattern(unsigned char *buf, size_t len,
+			 enum test_pattern pat)
+{
+	size_t i, n;
+	const char *w;
+	unsigned int period;
+
+	switch (pat) {
+	case PAT_ZERO:
+		memset(buf, 0, len);
+		break;
+	case PAT_TEXT:
+		for (i = 0; i < len; i += n) {
+			w = test_words[random32() % ARRAY_SIZE(test_words)];
+			n = min(strlen(w), len - i);
+			memcpy(buf + i, w, n);
+			if (i + n < len)
+				buf[i + n++] = ' ';
+		}
+		break;
+	case PAT_RANDOM:
+		for (i = 0; i < len; i++)
+			buf[i] = random32();
+		break;
+	case PAT_SHORT_PERIOD:
+		/* match distances under 8 bytes take the overlapping path */
+		period = 1 + random32() % 7;
+		for (i = 0; i < len; i++)
+			buf[i] = i < period ? random32() : buf[i - period];
+		break;
+	case PAT_MIXED:
+		for (i = 0; i < len; i += n) {
+			n = min_t(size_t, 1 + random32() % 300, len - i);
+			fill_pattern(buf + i, n, random32() % PAT_MIXED);
+		}
+		break;
+	default:
+		BUG();
+	}
+}
+
+static bool guard_intact(const unsigned char *buf, size_t len)
+{
+	size_t i;
+
+	for (i = len; i < len + TEST_GUARD; i++)
+		if (buf[i] != TEST_POISON)
+			return false;
+	return true;
+}
+
+enum check_kind {
+	CHECK_VALID,		/* intact stream, must match the reference */
+	CHECK_SHORT,		/* truncated input or output, must fail */
+	CHECK_DAMAGED,		/* corrupted stream, must not overrun */
+};
+
+/*
+ * Decompress @clen bytes of bufs->comp into an output of @olen bytes
+ * with both decompressors.  Neither may write past @olen, and whenever
+ * both succeed their output must be identical.
+ */
+static int check_one(struct test_bufs *bufs, size_t clen, size_t olen,
+		     enum check_kind kind, const char *what)
+{
+	size_t ref_len = olen, out_len = olen;
+	int ref_ret, ret;
+
+	memset(bufs->ref, TEST_POISON, olen + TEST_GUARD);
+	memset(bufs->out, TEST_POISON, olen + TEST_GUARD);
+
+	ref_ret = lzo1x_decompress_ref(bufs->comp, clen, bufs->ref, &ref_len);
+	ret = lzo1x_decompress_safe(bufs->comp, clen, bufs->out, &out_len);
+
+	if (!guard_intact(bufs->out, olen)) {
+		printk(KERN_ERR "test_lzo: %s: wrote past %zu byte output\n",
+			what, olen);
+		return -EIO;
+	}
+	if ((kind == CHECK_VALID && (ret != LZO_E_OK || ref_ret != LZO_E_OK)) ||
+	    (kind == CHECK_SHORT && ret == LZO_E_OK)) {
+		printk(KERN_ERR "test_lzo: %s: returned %d, reference %d\n",
+			what, ret, ref_ret);
+		return -EIO;
+	}
+	if (ret == LZO_E_OK && ref_ret == LZO_E_OK &&
+	    (out_len != ref_len || memcmp(bufs->out, bufs->ref, out_len))) {
+		printk(KERN_ERR "test_lzo: %s: output differs from reference\n",
+			what);
+		return -EIO;
+	}
+	return 0;
+}
+
+static int test_pattern(struct test_bufs *bufs, size_t len,
+			enum test_pattern pat)
+{
+	size_t clen = lzo1x_worst_compress(TEST_MAX_LEN);
+	size_t i, cut;
+	char what[48];
+	int ret;
+
+	fill_pattern(bufs->src, len, pat);
+	if (lzo1x_1_compress(bufs->src, len, bufs->comp, &clen,
+			     bufs->wrkmem) != LZO_E_OK)
+		return -EIO;
+
+	snprintf(what, sizeof(what), "%s/%zu", pattern_names[pat], len);
+	ret = check_one(bufs, clen, len, CHECK_VALID, what);
+	if (ret)
+		return ret;
+	if (memcmp(bufs->out, bufs->src, len)) {
+		printk(KERN_ERR "test_lzo: %s: round trip mismatch\n", what);
+		return -EIO;
+	}
+
+	/* output one byte short, then truncated input */
+	ret = check_one(bufs, clen, len - 1, CHECK_SHORT, what);
+	for (cut = 1; !ret && cut < min_t(size_t, clen, 16); cut++)
+		ret = check_one(bufs, clen - cut, len, CHECK_SHORT, what);
+
+	/* corrupt a few bytes and make sure nothing is overrun */
+	for (i = 0; !ret && i < 8; i++) {
+		bufs->comp[random32() % clen] ^= 1 << (random32() % 8);
+		ret = check_one(bufs, clen, len, CHECK_DAMAGED, what);
+	}
+	return ret;
+}
+
+static unsigned long bench_rate(size_t bytes, s64 ns)
+{
+	if (ns <= 0)
+		return 0;
+	return div64_u64((u64)bytes * iterations * 1000, ns);
+}
+
+static void bench_pattern(struct test_bufs *bufs, enum test_pattern pat)
+{
+	size_t clen = lzo1x_worst_compress(PAGE_SIZE), olen;
+	unsigned int i;
+	ktime_t start;
+	s64 ref_ns, ns;
+
+	fill_pattern(bufs->src, PAGE_SIZE, pat);
+	lzo1x_1_compress(bufs->src, PAGE_SIZE, bufs->comp, &clen,
+			 bufs->wrkmem);
+
+	start = ktime_get();
+	for (i = 0; i < iterations; i++) {
+		olen = PAGE_SIZE;
+		lzo1x_decompress_ref(bufs->comp, clen, bufs->ref, &olen);
+	}
+	ref_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	start = ktime_get();
+	for (i = 0; i < iterations; i++) {
+		olen = PAGE_SIZE;
+		lzo1x_decompress_safe(bufs->comp, clen, bufs->out, &olen);
+	}
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	printk(KERN_INFO "test_lzo: %-12s ratio %3zu%% reference %5lu MB/s "
+		"decompress %5lu MB/s\n", pattern_names[pat],
+		clen * 100 / PAGE_SIZE, bench_rate(PAGE_SIZE, ref_ns),
+		bench_rate(PAGE_SIZE, ns));
+}
+
+static int __init test_lzo_init(void)
+{
+	struct test_bufs bufs;
+	enum test_pattern pat;
+	unsigned int i, failed = 0;
+
+	bufs.src = vmalloc(TEST_MAX_LEN);
+	bufs.comp = vmalloc(lzo1x_worst_compress(TEST_MAX_LEN));
+	bufs.ref = vmalloc(TEST_MAX_LEN + TEST_GUARD);
+	bufs.out = vmalloc(TEST_MAX_LEN + TEST_GUARD);
+	bufs.wrkmem = vmalloc(LZO1X_MEM_COMPRESS);
+	if (!bufs.src || !bufs.comp || !bufs.ref || !bufs.out ||
+	    !bufs.wrkmem) {
+		failed = 1;
+		goto out;
+	}
+
+	for (pat = 0; pat < PAT_NR; pat++)
+		for (i = 0; i < ARRAY_SIZE(test_lens); i++)
+			if (test_pattern(&bufs, test_lens[i], pat))
+				failed++;
+
+	if (failed)
+		printk(KERN_ERR "test_lzo: %u tests failed\n", failed);
+	else
+		printk(KERN_INFO "test_lzo: all tests passed\n");
+
+	if (iterations)
+		for (pat = 0; pat < PAT_NR; pat++)
+			bench_pattern(&bufs, pat);
+out:
+	vfree(bufs.wrkmem);
+	vfree(bufs.out);
+	vfree(bufs.ref);
+	vfree(bufs.comp);
+	vfree(bufs.src);
+
+	return -EAGAIN;
+}
+module_init(test_lzo_init);
+MODULE_LICENSE("GPL");
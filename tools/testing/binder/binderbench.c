@@ -0,0 +1,456 @@
+/*
+ * binderbench.c -- throughput and latency benchmark for /dev/binder
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * A server process registers itself as the binder context manager and
+ * answers transactions to handle 0 from a pool of looper threads.  A
+ * client process then drives it from several threads with a mix of
+ * synchronous and one-way transactions and reports ops/s and latency
+ * percentiles.  Only the driver ABI is used, no libbinder.
+ *
+ * Only one context manager can be registered at a time, and only by the
+ * uid that registered the first one, so stop servicemanager before
+ * running this on an Android device.
+ *
+ * $(CROSS_COMPILE)gcc -Wall -Wextra -O2 -I../../../drivers/staging/android \
+ *	-o binderbench binderbench.c -lpthread -lrt
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "binder.h"
+
+#define MAP_SIZE	(1024 * 1024)
+#define READ_SIZE	256
+#define BENCH_CODE	1
+
+struct options {
+	const char *device;
+	size_t payload;
+	size_t reply;
+	int clients;
+	int servers;
+	long iterations;
+	int oneway_pct;
+};
+
+static struct options opts = {
+	.device = "/dev/binder",
+	.payload = 128,
+	.reply = 0,
+	.clients = 1,
+	.servers = 4,
+	.iterations = 10000,
+	.oneway_pct = 0,
+};
+
+struct client {
+	pthread_t thread;
+	int fd;
+	unsigned seed;
+	uint64_t *latency;
+	long done;
+	long failed;
+	long oneway;
+};
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int open_binder(void)
+{
+	struct binder_version version;
+	void *map;
+	int fd;
+
+	fd = open(opts.device, O_RDWR);
+	if (fd < 0)
+		die(opts.device);
+	if (ioctl(fd, BINDER_VERSION, &version) < 0)
+		die("BINDER_VERSION");
+	if (version.protocol_version != BINDER_CURRENT_PROTOCOL_VERSION) {
+		fprintf(stderr, "binder protocol version %ld, expected %d\n",
+			version.protocol_version,
+			BINDER_CURRENT_PROTOCOL_VERSION);
+		exit(1);
+	}
+	map = mmap(NULL, MAP_SIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		die("mmap");
+	return fd;
+}
+
+static void put_cmd(uint8_t *buf, size_t *len, uint32_t cmd,
+		    const void *arg, size_t arg_len)
+{
+	memcpy(buf + *len, &cmd, sizeof(cmd));
+	*len += sizeof(cmd);
+	if (arg_len) {
+		memcpy(buf + *len, arg, arg_len);
+		*len += arg_len;
+	}
+}
+
+static int write_read(int fd, void *wbuf, size_t wlen, void *rbuf,
+		      size_t rlen, size_t *consumed)
+{
+	struct binder_write_read bwr;
+	int ret;
+
+	memset(&bwr, 0, sizeof(bwr));
+	bwr.write_buffer = (unsigned long)wbuf;
+	bwr.write_size = wlen;
+	bwr.read_buffer = (unsigned long)rbuf;
+	bwr.read_size = rlen;
+	do {
+		ret = ioctl(fd, BINDER_WRITE_READ, &bwr);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		return -1;
+	if (consumed)
+		*consumed = bwr.read_consumed;
+	return 0;
+}
+
+/* Skips the argument of a return command we have no use for. */
+static size_t br_arg_size(uint32_t cmd)
+{
+	return _IOC_SIZE(cmd);
+}
+
+static void *server_thread(void *arg)
+{
+	int fd = (long)arg;
+	uint8_t rbuf[READ_SIZE];
+	uint8_t wbuf[READ_SIZE * 2];	/* replies and frees for one read */
+	size_t wlen = 0;
+	void *reply = calloc(1, opts.reply ? opts.reply : 1);
+
+	put_cmd(wbuf, &wlen, BC_ENTER_LOOPER, NULL, 0);
+	for (;;) {
+		size_t consumed, pos = 0;
+
+		if (write_read(fd, wbuf, wlen, rbuf, sizeof(rbuf), &consumed))
+			die("server BINDER_WRITE_READ");
+		wlen = 0;
+		while (pos < consumed) {
+			uint32_t cmd;
+			struct binder_transaction_data tr;
+
+			memcpy(&cmd, rbuf + pos, sizeof(cmd));
+			pos += sizeof(cmd);
+			if (cmd != BR_TRANSACTION) {
+				pos += br_arg_size(cmd);
+				continue;
+			}
+			memcpy(&tr, rbuf + pos, sizeof(tr));
+			pos += sizeof(tr);
+
+			put_cmd(wbuf, &wlen, BC_FREE_BUFFER,
+				&tr.data.ptr.buffer, sizeof(void *));
+			if (tr.flags & TF_ONE_WAY)
+				continue;
+
+			memset(&tr, 0, sizeof(tr));
+			tr.code = BENCH_CODE;
+			tr.data_size = opts.reply;
+			tr.data.ptr.buffer = reply;
+			put_cmd(wbuf, &wlen, BC_REPLY, &tr, sizeof(tr));
+		}
+	}
+	return NULL;
+}
+
+static void run_server(int ready_fd)
+{
+	pthread_t thread;
+	size_t max_threads = 0;
+	int fd = open_binder();
+	int i;
+
+	if (ioctl(fd, BINDER_SET_MAX_THREADS, &max_threads) < 0)
+		die("BINDER_SET_MAX_THREADS");
+	if (ioctl(fd, BINDER_SET_CONTEXT_MGR, 0) < 0)
+		die("BINDER_SET_CONTEXT_MGR");
+	for (i = 1; i < opts.servers; i++)
+		if (pthread_create(&thread, NULL, server_thread,
+				   (void *)(long)fd))
+			die("pthread_create");
+	if (write(ready_fd, "", 1) != 1)
+		die("write");
+	close(ready_fd);
+	server_thread((void *)(long)fd);
+}
+
+/*
+ * Sends one transaction and waits for BR_TRANSACTION_COMPLETE (one-way)
+ * or BR_REPLY (synchronous).  A reply buffer is handed back to the driver
+ * with the next transaction, through *pending_free.
+ */
+static int transact(struct client *c, const void *payload, int oneway,
+		    void **pending_free)
+{
+	uint8_t wbuf[64 + sizeof(struct binder_transaction_data)];
+	uint8_t rbuf[READ_SIZE];
+	struct binder_transaction_data tr;
+	size_t wlen = 0;
+	int complete = 0, replied = oneway, failed = 0;
+
+	if (*pending_free) {
+		put_cmd(wbuf, &wlen, BC_FREE_BUFFER, pending_free,
+			sizeof(void *));
+		*pending_free = NULL;
+	}
+	memset(&tr, 0, sizeof(tr));
+	tr.target.handle = 0;
+	tr.code = BENCH_CODE;
+	tr.flags = oneway ? TF_ONE_WAY : 0;
+	tr.data_size = opts.payload;
+	tr.data.ptr.buffer = payload;
+	put_cmd(wbuf, &wlen, BC_TRANSACTION, &tr, sizeof(tr));
+
+	while (!(complete && replied) && !failed) {
+		size_t consumed, pos = 0;
+
+		if (write_read(c->fd, wbuf, wlen, rbuf, sizeof(rbuf),
+			       &consumed))
+			die("client BINDER_WRITE_READ");
+		wlen = 0;
+		while (pos < consumed) {
+			uint32_t cmd;
+
+			memcpy(&cmd, rbuf + pos, sizeof(cmd));
+			pos += sizeof(cmd);
+			switch (cmd) {
+			case BR_TRANSACTION_COMPLETE:
+				complete = 1;
+				break;
+			case BR_REPLY:
+				memcpy(&tr, rbuf + pos, sizeof(tr));
+				*pending_free = (void *)tr.data.ptr.buffer;
+				replied = 1;
+				break;
+			case BR_DEAD_REPLY:
+			case BR_FAILED_REPLY:
+				failed = 1;
+				break;
+			default:
+				break;
+			}
+			pos += br_arg_size(cmd);
+		}
+	}
+	return failed ? -1 : 0;
+}
+
+static void *client_thread(void *arg)
+{
+	struct client *c = arg;
+	void *payload = calloc(1, opts.payload ? opts.payload : 1);
+	void *pending_free = NULL;
+	long i;
+
+	for (i = 0; i < opts.iterations; i++) {
+		int oneway = (int)(rand_r(&c->seed) % 100) < opts.oneway_pct;
+		uint64_t start = now_ns();
+
+		if (transact(c, payload, oneway, &pending_free)) {
+			c->failed++;
+			continue;
+		}
+		c->latency[c->done++] = now_ns() - start;
+		c->oneway += oneway;
+	}
+	if (pending_free) {
+		uint8_t wbuf[16];
+		size_t wlen = 0;
+
+		put_cmd(wbuf, &wlen, BC_FREE_BUFFER, &pending_free,
+			sizeof(void *));
+		write_read(c->fd, wbuf, wlen, NULL, 0, NULL);
+	}
+	free(payload);
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile_us(uint64_t *sorted, long n, int pct)
+{
+	long i;
+
+	if (n == 0)
+		return 0;
+	i = (n * pct + 99) / 100 - 1;
+	if (i < 0)
+		i = 0;
+	return sorted[i] / 1000.0;
+}
+
+static void run_clients(void)
+{
+	struct client *clients;
+	uint64_t *all, start, elapsed;
+	long total = 0, failed = 0, oneway = 0;
+	int fd = open_binder();
+	int i;
+
+	clients = calloc(opts.clients, sizeof(*clients));
+	all = malloc(sizeof(*all) * opts.clients * opts.iterations);
+	if (!clients || !all)
+		die("malloc");
+
+	start = now_ns();
+	for (i = 0; i < opts.clients; i++) {
+		clients[i].fd = fd;
+		clients[i].seed = i + 1;
+		clients[i].latency = all + (long)i * opts.iterations;
+		if (pthread_create(&clients[i].thread, NULL, client_thread,
+				   &clients[i]))
+			die("pthread_create");
+	}
+	for (i = 0; i < opts.clients; i++) {
+		pthread_join(clients[i].thread, NULL);
+		memmove(all + total, clients[i].latency,
+			sizeof(*all) * clients[i].done);
+		total += clients[i].done;
+		failed += clients[i].failed;
+		oneway += clients[i].oneway;
+	}
+	elapsed = now_ns() - start;
+
+	qsort(all, total, sizeof(*all), cmp_u64);
+	printf("payload %zu reply %zu clients %d servers %d oneway %d%%\n",
+	       opts.payload, opts.reply, opts.clients, opts.servers,
+	       opts.oneway_pct);
+	printf("  ops %ld (oneway %ld) failed %ld in %.3f s: %.0f ops/s\n",
+	       total, oneway, failed, elapsed / 1e9,
+	       total / (elapsed / 1e9));
+	printf("  latency us: min %.1f p50 %.1f p90 %.1f p99 %.1f "
+	       "max %.1f\n", total ? all[0] / 1000.0 : 0,
+	       percentile_us(all, total, 50), percentile_us(all, total, 90),
+	       percentile_us(all, total, 99),
+	       total ? all[total - 1] / 1000.0 : 0);
+	free(all);
+	free(clients);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-d device] [-s payload] [-r reply] [-c clients]\n"
+		"          [-S servers] [-n iterations] [-o oneway%%]\n"
+		"  -d  binder device (default %s)\n"
+		"  -s  bytes sent per transaction (default %zu)\n"
+		"  -r  bytes sent per reply (default %zu)\n"
+		"  -c  client threads (default %d)\n"
+		"  -S  server looper threads (default %d)\n"
+		"  -n  transactions per client thread (default %ld)\n"
+		"  -o  percentage of one-way transactions (default %d)\n",
+		name, opts.device, opts.payload, opts.reply, opts.clients,
+		opts.servers, opts.iterations, opts.oneway_pct);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	int ready[2];
+	pid_t server;
+	char c;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:s:r:c:S:n:o:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			opts.device = optarg;
+			break;
+		case 's':
+			opts.payload = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			opts.reply = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			opts.clients = atoi(optarg);
+			break;
+		case 'S':
+			opts.servers = atoi(optarg);
+			break;
+		case 'n':
+			opts.iterations = atol(optarg);
+			break;
+		case 'o':
+			opts.oneway_pct = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (opts.clients < 1 || opts.servers < 1 || opts.iterations < 1 ||
+	    opts.oneway_pct < 0 || opts.oneway_pct > 100 ||
+	    opts.payload > MAP_SIZE / 4 || opts.reply > MAP_SIZE / 4)
+		usage(argv[0]);
+
+	if (pipe(ready))
+		die("pipe");
+	server = fork();
+	if (server < 0)
+		die("fork");
+	if (server == 0) {
+		close(ready[0]);
+		run_server(ready[1]);
+		exit(0);
+	}
+	close(ready[1]);
+	if (read(ready[0], &c, 1) != 1) {
+		fprintf(stderr, "server failed to start\n");
+		waitpid(server, NULL, 0);
+		return 1;
+	}
+	close(ready[0]);
+
+	run_clients();
+
+	kill(server, SIGTERM);
+	waitpid(server, NULL, 0);
+	return 0;
+}
@@ -0,0 +1,42 @@
+#!/bin/sh
+#
+# Runs binderbench over a matrix of payload sizes, client thread counts
+# and one-way mixes.  Each line of the matrix is a separate server and
+# client pair, so a failure in one configuration does not affect the
+# others.  The binder context manager must be free (see binderbench.c).
+#
+# Environment:
+#   BENCH       path to binderbench (default ./binderbench)
+#   ITERATIONS  transactions per client thread (default 10000)
+#   SIZES       payload sizes in bytes (default "0 128 4096 65536")
+#   CLIENTS     client thread counts (default "1 4")
+#   ONEWAY      percentages of one-way transactions (default "0 50")
+#   SERVERS     server looper threads (default 4)
+#
+
+BENCH=${BENCH:-./binderbench}
+ITERATIONS=${ITERATIONS:-10000}
+SIZES=${SIZES:-"0 128 4096 65536"}
+CLIENTS=${CLIENTS:-"1 4"}
+ONEWAY=${ONEWAY:-"0 50"}
+SERVERS=${SERVERS:-4}
+
+if [ ! -x "$BENCH" ]; then
+	echo "$BENCH not found, run make first" >&2
+	exit 1
+fi
+
+status=0
+for size in $SIZES; do
+	for clients in $CLIENTS; do
+		for oneway in $ONEWAY; do
+			if ! "$BENCH" -s "$size" -c "$clients" -S "$SERVERS" \
+			    -o "$oneway" -n "$ITERATIONS"; then
+				echo "FAILED: size $size clients $clients" \
+				     "oneway $oneway" >&2
+				status=1
+			fi
+		done
+	done
+done
+exit $status